@@ -0,0 +1,142 @@
+#include "CertificateStore.h"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#ifndef WEBRTC_WIN
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <webrtc/rtc_base/rtccertificategenerator.h>
+#include <webrtc/rtc_base/sslidentity.h>
+
+#include "logging.h"
+
+namespace faf {
+
+/* a cached certificate is replaced if it expires within this time */
+static constexpr uint64_t certificateMinRemainingMs = 24 * 60 * 60 * 1000;
+
+static char const* certificatePemBegin = "-----BEGIN CERTIFICATE-----";
+
+CertificateStore::CertificateStore(std::string const& directory):
+  _loadDurationMs(0.)
+{
+  if (!directory.empty())
+  {
+    _path = directory + "/ice_adapter_certificate.pem";
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (_load())
+  {
+    _source = "cached";
+  }
+  else
+  {
+    _generate();
+    _source = "generated";
+    _save();
+  }
+  _loadDurationMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000.;
+  if (_certificate)
+  {
+    FAF_LOG_INFO << "using " << _source << " DTLS certificate, took " << _loadDurationMs << " ms";
+  }
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> CertificateStore::certificate() const
+{
+  return _certificate;
+}
+
+Json::Value CertificateStore::status() const
+{
+  Json::Value result;
+  result["source"] = _certificate ? _source : "none";
+  result["load_ms"] = _loadDurationMs;
+  result["expires"] = static_cast<Json::UInt64>(_certificate ? _certificate->Expires() : 0);
+  return result;
+}
+
+bool CertificateStore::_load()
+{
+  if (_path.empty())
+  {
+    return false;
+  }
+  std::ifstream file(_path);
+  if (!file)
+  {
+    return false;
+  }
+  std::stringstream content;
+  content << file.rdbuf();
+  auto pem = content.str();
+  /* the file holds the private key followed by the certificate */
+  auto certificateBegin = pem.find(certificatePemBegin);
+  if (certificateBegin == std::string::npos)
+  {
+    FAF_LOG_WARN << "ignoring malformed certificate cache " << _path;
+    return false;
+  }
+  auto certificate = rtc::RTCCertificate::FromPEM(rtc::RTCCertificatePEM(pem.substr(0, certificateBegin),
+                                                                         pem.substr(certificateBegin)));
+  if (!certificate)
+  {
+    FAF_LOG_WARN << "ignoring unreadable certificate cache " << _path;
+    return false;
+  }
+  auto nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  if (certificate->HasExpired(static_cast<uint64_t>(nowMs) + certificateMinRemainingMs))
+  {
+    FAF_LOG_INFO << "cached certificate expires soon, generating a new one";
+    return false;
+  }
+  _certificate = certificate;
+  return true;
+}
+
+void CertificateStore::_generate()
+{
+  _certificate = rtc::RTCCertificateGenerator::GenerateCertificate(rtc::KeyParams::ECDSA(rtc::EC_NIST_P256),
+                                                                   rtc::Optional<uint64_t>());
+  if (!_certificate)
+  {
+    FAF_LOG_ERROR << "generating DTLS certificate failed";
+  }
+}
+
+void CertificateStore::_save()
+{
+  if (_path.empty() ||
+      !_certificate)
+  {
+    return;
+  }
+  auto pem = _certificate->ToPEM();
+  auto content = pem.private_key() + pem.certificate();
+#ifndef WEBRTC_WIN
+  /* the file holds the private key, only the owner may read it */
+  int fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  bool written = fd >= 0 &&
+                 ::fchmod(fd, S_IRUSR | S_IWUSR) == 0 &&
+                 ::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+  if (fd >= 0)
+  {
+    ::close(fd);
+  }
+#else
+  std::ofstream file(_path, std::ios::trunc | std::ios::binary);
+  file << content;
+  bool written = static_cast<bool>(file);
+#endif
+  if (!written)
+  {
+    FAF_LOG_WARN << "unable to cache certificate in " << _path;
+  }
+}
+
+} // namespace faf
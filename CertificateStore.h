@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+
+#include <webrtc/rtc_base/rtccertificate.h>
+#include <webrtc/rtc_base/scoped_ref_ptr.h>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief The DTLS certificate shared by all PeerConnections of the adapter.
+ *         Without it WebRTC generates a new key pair for every PeerConnection.
+ *         The certificate can be cached in a private directory and reused until it expires.
+ *         It is never written to the log directory, which users attach to bug reports.
+ */
+class CertificateStore
+{
+public:
+  /** \brief Load the cached certificate or generate a new ECDSA one
+       \param directory: where the certificate and its private key are cached, "" disables the cache
+      */
+  explicit CertificateStore(std::string const& directory);
+
+  /** \returns nullptr if no certificate could be loaded or generated */
+  rtc::scoped_refptr<rtc::RTCCertificate> certificate() const;
+
+  Json::Value status() const;
+
+protected:
+  bool _load();
+  void _generate();
+  void _save();
+
+  std::string _path;
+  rtc::scoped_refptr<rtc::RTCCertificate> _certificate;
+  std::string _source;
+  double _loadDurationMs;
+};
+
+} // namespace faf
@@ -0,0 +1,145 @@
+#include "ConnectionAttemptLog.h"
+
+#include <algorithm>
+
+namespace faf {
+
+static double toSeconds(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000000.;
+}
+
+ConnectionAttemptLog::ConnectionAttemptLog(std::size_t capacity):
+  _attempts(std::max<std::size_t>(capacity, 1)),
+  _next(0),
+  _size(0)
+{
+}
+
+void ConnectionAttemptLog::begin(std::chrono::steady_clock::time_point now, std::string const& reason)
+{
+  auto& attempt = _attempts[_next];
+  attempt.reason = reason;
+  attempt.start = now;
+  attempt.reached.fill(false);
+  attempt.offsets.fill(std::chrono::steady_clock::duration::zero());
+  _next = (_next + 1) % _attempts.size();
+  _size = std::min(_size + 1, _attempts.size());
+}
+
+void ConnectionAttemptLog::mark(ConnectionPhase phase, std::chrono::steady_clock::time_point now)
+{
+  if (_size == 0)
+  {
+    return;
+  }
+  auto& attempt = _attempts[(_next + _attempts.size() - 1) % _attempts.size()];
+  auto index = static_cast<std::size_t>(phase);
+  if (attempt.reached[index])
+  {
+    return;
+  }
+  attempt.reached[index] = true;
+  attempt.offsets[index] = now - attempt.start;
+}
+
+bool ConnectionAttemptLog::reached(ConnectionPhase phase, std::chrono::steady_clock::time_point& at) const
+{
+  if (_size == 0)
+  {
+    return false;
+  }
+  auto const& attempt = _attempts[(_next + _attempts.size() - 1) % _attempts.size()];
+  auto index = static_cast<std::size_t>(phase);
+  if (!attempt.reached[index])
+  {
+    return false;
+  }
+  at = attempt.start + attempt.offsets[index];
+  return true;
+}
+
+Json::Value ConnectionAttemptLog::status() const
+{
+  Json::Value result(Json::arrayValue);
+  for (std::size_t i = 0; i < _size; ++i)
+  {
+    auto const& attempt = _attempts[(_next + _attempts.size() - _size + i) % _attempts.size()];
+    Json::Value attemptJson;
+    attemptJson["reason"] = attempt.reason;
+    attemptJson["age"] = toSeconds(std::chrono::steady_clock::now() - attempt.start);
+    for (std::size_t phase = 0; phase < numPhases; ++phase)
+    {
+      attemptJson["phases"][phaseName(static_cast<ConnectionPhase>(phase))] = attempt.reached[phase] ? Json::Value(toSeconds(attempt.offsets[phase])) : Json::Value();
+    }
+    result.append(attemptJson);
+  }
+  return result;
+}
+
+Json::Value ConnectionAttemptLog::aggregate(std::vector<ConnectionAttemptLog const*> const& logs)
+{
+  std::array<std::vector<double>, numPhases> samples;
+  for (auto log : logs)
+  {
+    for (std::size_t i = 0; i < log->_size; ++i)
+    {
+      auto const& attempt = log->_attempts[(log->_next + log->_attempts.size() - log->_size + i) % log->_attempts.size()];
+      for (std::size_t phase = 0; phase < numPhases; ++phase)
+      {
+        if (attempt.reached[phase])
+        {
+          samples[phase].push_back(toSeconds(attempt.offsets[phase]));
+        }
+      }
+    }
+  }
+  Json::Value result;
+  for (std::size_t phase = 0; phase < numPhases; ++phase)
+  {
+    auto& values = samples[phase];
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p)
+    {
+      return values.empty() ? 0. : values[std::min(values.size() - 1, static_cast<std::size_t>(p * values.size()))];
+    };
+    Json::Value phaseJson;
+    phaseJson["count"] = static_cast<Json::UInt64>(values.size());
+    phaseJson["p50"] = percentile(0.5);
+    phaseJson["p90"] = percentile(0.9);
+    phaseJson["p99"] = percentile(0.99);
+    phaseJson["max"] = values.empty() ? 0. : values.back();
+    result[phaseName(static_cast<ConnectionPhase>(phase))] = phaseJson;
+  }
+  return result;
+}
+
+char const* ConnectionAttemptLog::phaseName(ConnectionPhase phase)
+{
+  switch (phase)
+  {
+    case ConnectionPhase::SdpCreated:
+      return "sdp_created";
+    case ConnectionPhase::LocalDescription:
+      return "local_description";
+    case ConnectionPhase::RemoteDescription:
+      return "remote_description";
+    case ConnectionPhase::FirstCandidate:
+      return "first_candidate";
+    case ConnectionPhase::FirstRemoteCandidate:
+      return "first_remote_candidate";
+    case ConnectionPhase::Gathered:
+      return "gathered";
+    case ConnectionPhase::Checking:
+      return "checking";
+    case ConnectionPhase::Connected:
+      return "connected";
+    case ConnectionPhase::DataChannelOpen:
+      return "data_channel_open";
+    case ConnectionPhase::Count:
+      break;
+  }
+  return "unknown";
+}
+
+} // namespace faf
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief The steps of establishing a connection to a peer, in their usual order
+ */
+enum class ConnectionPhase
+{
+  SdpCreated,           /* CreateOffer or CreateAnswer succeeded */
+  LocalDescription,     /* SetLocalDescription succeeded, the offer or answer goes to the client */
+  RemoteDescription,    /* SetRemoteDescription succeeded with the peer's offer or answer */
+  FirstCandidate,       /* the first local candidate was gathered */
+  FirstRemoteCandidate, /* the first candidate of the peer arrived via the client */
+  Gathered,             /* candidate gathering completed */
+  Checking,             /* ICE state "checking" */
+  Connected,            /* ICE state "connected" or "completed" */
+  DataChannelOpen,      /* the data channel for game packets opened */
+  Count
+};
+
+/*! \brief Timestamps of the connection phases of the last PeerConnections of a PeerRelay.
+ *         Every phase is recorded the first time it is reached within an attempt.
+ */
+class ConnectionAttemptLog
+{
+public:
+  explicit ConnectionAttemptLog(std::size_t capacity);
+
+  /** \brief Start a new attempt, the oldest one is dropped if the log is full
+       \param reason: why the PeerConnection was created, e.g. "initial" or "rebuild"
+      */
+  void begin(std::chrono::steady_clock::time_point now, std::string const& reason);
+
+  /** \brief Record the time the current attempt reached phase, unless it did before */
+  void mark(ConnectionPhase phase, std::chrono::steady_clock::time_point now);
+
+  /** \brief Get the time the current attempt reached phase
+       \returns false without an attempt or if the current one did not reach phase yet
+      */
+  bool reached(ConnectionPhase phase, std::chrono::steady_clock::time_point& at) const;
+
+  /** \returns the attempts oldest first, with the seconds from creating the PeerConnection to every phase */
+  Json::Value status() const;
+
+  /** \brief Percentiles of the phase durations over all attempts of several logs
+       \returns per phase the count, p50, p90, p99 and max in seconds
+      */
+  static Json::Value aggregate(std::vector<ConnectionAttemptLog const*> const& logs);
+
+  static char const* phaseName(ConnectionPhase phase);
+
+protected:
+  static constexpr std::size_t numPhases = static_cast<std::size_t>(ConnectionPhase::Count);
+
+  struct Attempt
+  {
+    std::string reason;
+    std::chrono::steady_clock::time_point start;
+    std::array<bool, numPhases> reached;
+    std::array<std::chrono::steady_clock::duration, numPhases> offsets;
+  };
+
+  std::vector<Attempt> _attempts;
+  std::size_t _next;
+  std::size_t _size;
+};
+
+} // namespace faf
@@ -0,0 +1,360 @@
+#include "FecCodec.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define FAF_XOR_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define FAF_XOR_NEON
+#endif
+
+#include "RelayFraming.h"
+
+namespace faf {
+
+/* kind byte and sequence number */
+static constexpr std::size_t fecDataHeaderSize = 3;
+
+/* kind byte, first sequence number, count and length XOR */
+static constexpr std::size_t fecParityHeaderSize = 6;
+
+/* kind byte, expected and received count */
+static constexpr std::size_t lossReportSize = 5;
+
+static void writeUint16(uint8_t* data, uint16_t value)
+{
+  data[0] = static_cast<uint8_t>(value >> 8);
+  data[1] = static_cast<uint8_t>(value & 0xff);
+}
+
+static uint16_t readUint16(uint8_t const* data)
+{
+  return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+void xorBytes(uint8_t* dst, uint8_t const* src, std::size_t len)
+{
+  std::size_t i = 0;
+#if defined(FAF_XOR_SSE2)
+  for (; i + 16 <= len; i += 16)
+  {
+    auto a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(dst + i));
+    auto b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(a, b));
+  }
+#elif defined(FAF_XOR_NEON)
+  for (; i + 16 <= len; i += 16)
+  {
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+  }
+#endif
+  for (; i < len; ++i)
+  {
+    dst[i] ^= src[i];
+  }
+}
+
+char const* xorBytesImplementation()
+{
+#if defined(FAF_XOR_SSE2)
+  return "sse2";
+#elif defined(FAF_XOR_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+rtc::CopyOnWriteBuffer frameLossReport(uint16_t expected, uint16_t received)
+{
+  uint8_t data[lossReportSize];
+  data[0] = static_cast<uint8_t>(RelayFrameKind::LossReport);
+  writeUint16(data + 1, expected);
+  writeUint16(data + 3, received);
+  return rtc::CopyOnWriteBuffer(data, lossReportSize);
+}
+
+bool parseLossReport(rtc::CopyOnWriteBuffer const& message, uint16_t& expected, uint16_t& received)
+{
+  if (message.size() < lossReportSize ||
+      message.cdata()[0] != static_cast<uint8_t>(RelayFrameKind::LossReport))
+  {
+    return false;
+  }
+  expected = readUint16(message.cdata() + 1);
+  received = readUint16(message.cdata() + 3);
+  return true;
+}
+
+FecEncoder::FecEncoder():
+  _nextSeq(0),
+  _groupSize(0),
+  _nextGroupSize(0),
+  _groupFirstSeq(0),
+  _groupCount(0),
+  _groupLengthXor(0),
+  _dataMessages(0),
+  _parityMessages(0),
+  _parityBytes(0)
+{
+}
+
+void FecEncoder::setGroupSize(std::size_t groupSize)
+{
+  _nextGroupSize = std::min(groupSize, maxGroupSize);
+  if (_groupCount == 0)
+  {
+    _groupSize = _nextGroupSize;
+  }
+}
+
+std::size_t FecEncoder::groupSize() const
+{
+  return _nextGroupSize;
+}
+
+rtc::CopyOnWriteBuffer FecEncoder::encode(rtc::CopyOnWriteBuffer const& message,
+                                          rtc::CopyOnWriteBuffer& parity)
+{
+  auto seq = _nextSeq++;
+  ++_dataMessages;
+  rtc::CopyOnWriteBuffer result(0, fecDataHeaderSize + message.size());
+  uint8_t header[fecDataHeaderSize];
+  header[0] = static_cast<uint8_t>(RelayFrameKind::FecData);
+  writeUint16(header + 1, seq);
+  result.AppendData(header, fecDataHeaderSize);
+  result.AppendData(message.cdata(), message.size());
+
+  parity.Clear();
+  if (_groupSize == 0)
+  {
+    return result;
+  }
+  if (_groupCount == 0)
+  {
+    _groupFirstSeq = seq;
+    _groupLengthXor = 0;
+    /* resize() zero fills, the capacity is kept across groups */
+    _parity.clear();
+  }
+  if (message.size() > _parity.size())
+  {
+    _parity.resize(message.size());
+  }
+  xorBytes(_parity.data(), message.cdata(), message.size());
+  _groupLengthXor ^= static_cast<uint16_t>(message.size());
+  ++_groupCount;
+
+  if (_groupCount >= _groupSize)
+  {
+    parity.EnsureCapacity(fecParityHeaderSize + _parity.size());
+    uint8_t parityHeader[fecParityHeaderSize];
+    parityHeader[0] = static_cast<uint8_t>(RelayFrameKind::FecParity);
+    writeUint16(parityHeader + 1, _groupFirstSeq);
+    parityHeader[3] = static_cast<uint8_t>(_groupCount);
+    writeUint16(parityHeader + 4, _groupLengthXor);
+    parity.AppendData(parityHeader, fecParityHeaderSize);
+    parity.AppendData(_parity.data(), _parity.size());
+    ++_parityMessages;
+    _parityBytes += parity.size();
+    _groupCount = 0;
+    _groupSize = _nextGroupSize;
+  }
+  return result;
+}
+
+Json::Value FecEncoder::status() const
+{
+  Json::Value result;
+  result["group_size"] = static_cast<Json::UInt64>(_nextGroupSize);
+  result["data_messages"] = static_cast<Json::UInt64>(_dataMessages);
+  result["parity_messages"] = static_cast<Json::UInt64>(_parityMessages);
+  result["parity_bytes"] = static_cast<Json::UInt64>(_parityBytes);
+  return result;
+}
+
+FecDecoder::FecDecoder():
+  _started(false),
+  _highestSeq(0),
+  _intervalExpected(0),
+  _intervalReceived(0),
+  _received(0),
+  _lost(0),
+  _late(0),
+  _recovered(0),
+  _duplicates(0),
+  _parityMessages(0)
+{
+  _historySeqs.fill(std::numeric_limits<int64_t>::min());
+}
+
+bool FecDecoder::decode(rtc::CopyOnWriteBuffer const& message,
+                        MessageCallback const& messageCallback)
+{
+  auto data = message.cdata();
+  if (message.size() >= fecDataHeaderSize &&
+      data[0] == static_cast<uint8_t>(RelayFrameKind::FecData))
+  {
+    _accept(_unwrap(readUint16(data + 1)),
+            rtc::CopyOnWriteBuffer(data + fecDataHeaderSize, message.size() - fecDataHeaderSize),
+            true,
+            messageCallback);
+    return true;
+  }
+  if (message.size() >= fecParityHeaderSize &&
+      data[0] == static_cast<uint8_t>(RelayFrameKind::FecParity))
+  {
+    ++_parityMessages;
+    if (_started)
+    {
+      _recover(_unwrap(readUint16(data + 1)),
+               data[3],
+               readUint16(data + 4),
+               data + fecParityHeaderSize,
+               message.size() - fecParityHeaderSize,
+               messageCallback);
+    }
+    return true;
+  }
+  return false;
+}
+
+void FecDecoder::takeInterval(uint16_t& expected, uint16_t& received)
+{
+  expected = static_cast<uint16_t>(std::min<uint64_t>(_intervalExpected, 0xffff));
+  received = static_cast<uint16_t>(std::min<uint64_t>(_intervalReceived, expected));
+  _intervalExpected = 0;
+  _intervalReceived = 0;
+}
+
+Json::Value FecDecoder::status() const
+{
+  Json::Value result;
+  result["received"] = static_cast<Json::UInt64>(_received);
+  result["parity_messages"] = static_cast<Json::UInt64>(_parityMessages);
+  result["lost"] = static_cast<Json::UInt64>(_lost);
+  result["late"] = static_cast<Json::UInt64>(_late);
+  result["recovered"] = static_cast<Json::UInt64>(_recovered);
+  result["unrecoverable"] = static_cast<Json::UInt64>(_lost - std::min(_lost, _late + _recovered));
+  result["duplicates"] = static_cast<Json::UInt64>(_duplicates);
+  return result;
+}
+
+int64_t FecDecoder::_unwrap(uint16_t seq) const
+{
+  if (!_started)
+  {
+    return seq;
+  }
+  return _highestSeq + static_cast<int16_t>(seq - static_cast<uint16_t>(_highestSeq));
+}
+
+bool FecDecoder::_have(int64_t seq) const
+{
+  return _historySeqs[static_cast<std::size_t>(seq) % historySize] == seq;
+}
+
+void FecDecoder::_accept(int64_t seq,
+                         rtc::CopyOnWriteBuffer const& message,
+                         bool fromNetwork,
+                         MessageCallback const& messageCallback)
+{
+  if (!_started)
+  {
+    _started = true;
+    _highestSeq = seq - 1;
+  }
+  if (seq > _highestSeq)
+  {
+    /* everything skipped is lost until it arrives late or is rebuilt,
+       a rebuilt message counts as lost itself */
+    auto skipped = static_cast<uint64_t>(seq - _highestSeq - 1);
+    _lost += skipped + (fromNetwork ? 0 : 1);
+    _intervalExpected += skipped + 1;
+    _highestSeq = seq;
+  }
+  else if (_have(seq))
+  {
+    ++_duplicates;
+    return;
+  }
+  else if (fromNetwork)
+  {
+    ++_late;
+  }
+  if (fromNetwork)
+  {
+    ++_received;
+    ++_intervalReceived;
+  }
+  else
+  {
+    ++_recovered;
+  }
+  /* too old for the history, deliver it without keeping it */
+  if (_highestSeq - seq < static_cast<int64_t>(historySize))
+  {
+    _historySeqs[static_cast<std::size_t>(seq) % historySize] = seq;
+    _history[static_cast<std::size_t>(seq) % historySize] = message;
+  }
+  messageCallback(message);
+}
+
+void FecDecoder::_recover(int64_t firstSeq,
+                          std::size_t count,
+                          uint16_t lengthXor,
+                          uint8_t const* parity,
+                          std::size_t parityLength,
+                          MessageCallback const& messageCallback)
+{
+  if (count == 0 ||
+      _highestSeq - firstSeq >= static_cast<int64_t>(historySize - count))
+  {
+    return;
+  }
+  /* unwrapped sequence numbers can be negative, so -1 can't mean none */
+  bool missing = false;
+  int64_t missingSeq = 0;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    if (!_have(firstSeq + i))
+    {
+      if (missing)
+      {
+        /* more than one message of the group is missing */
+        return;
+      }
+      missing = true;
+      missingSeq = firstSeq + i;
+    }
+  }
+  if (!missing)
+  {
+    return;
+  }
+  _recoverBuffer.assign(parity, parity + parityLength);
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    auto seq = firstSeq + i;
+    if (seq == missingSeq)
+    {
+      continue;
+    }
+    auto const& message = _history[static_cast<std::size_t>(seq) % historySize];
+    xorBytes(_recoverBuffer.data(), message.cdata(), std::min(message.size(), parityLength));
+    lengthXor ^= static_cast<uint16_t>(message.size());
+  }
+  if (lengthXor > parityLength)
+  {
+    return;
+  }
+  _accept(missingSeq,
+          rtc::CopyOnWriteBuffer(_recoverBuffer.data(), lengthXor),
+          false,
+          messageCallback);
+}
+
+} // namespace faf
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include <webrtc/rtc_base/copyonwritebuffer.h>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/** \brief dst ^= src for len bytes, vectorized with SSE2 or NEON where available
+    */
+void xorBytes(uint8_t* dst, uint8_t const* src, std::size_t len);
+
+/** \brief The instruction set used by xorBytes(): "sse2", "neon" or "scalar"
+    */
+char const* xorBytesImplementation();
+
+/** \brief Build a LossReport message
+    */
+rtc::CopyOnWriteBuffer frameLossReport(uint16_t expected, uint16_t received);
+
+/** \brief Read a LossReport message
+     \returns false if the message is malformed
+    */
+bool parseLossReport(rtc::CopyOnWriteBuffer const& message, uint16_t& expected, uint16_t& received);
+
+/*! \brief Sequences framed messages as FecData and adds one XOR parity message per group.
+ *         A single lost message of a group can be rebuilt from the parity and the others.
+ */
+class FecEncoder
+{
+public:
+  static constexpr std::size_t maxGroupSize = 64;
+
+  FecEncoder();
+
+  /** \brief Set the number of FecData messages per parity message, 0 disables parity.
+             A running group is finished with its old size.
+      */
+  void setGroupSize(std::size_t groupSize);
+  std::size_t groupSize() const;
+
+  /** \brief Wrap a framed message into a FecData message
+       \param parity set to a FecParity message if the message completed a group, otherwise emptied
+      */
+  rtc::CopyOnWriteBuffer encode(rtc::CopyOnWriteBuffer const& message,
+                                rtc::CopyOnWriteBuffer& parity);
+
+  Json::Value status() const;
+
+protected:
+  uint16_t _nextSeq;
+  std::size_t _groupSize;
+  std::size_t _nextGroupSize;
+  uint16_t _groupFirstSeq;
+  std::size_t _groupCount;
+  uint16_t _groupLengthXor;
+  std::vector<uint8_t> _parity;
+
+  uint64_t _dataMessages;
+  uint64_t _parityMessages;
+  uint64_t _parityBytes;
+};
+
+/*! \brief Unwraps FecData messages, drops duplicates and rebuilds lost messages from FecParity messages
+ */
+class FecDecoder
+{
+public:
+  typedef std::function<void (rtc::CopyOnWriteBuffer const&)> MessageCallback;
+
+  FecDecoder();
+
+  /** \brief Handle a FecData or FecParity message
+       \param messageCallback receives the wrapped framed messages, including rebuilt ones
+       \returns false if the message is malformed
+      */
+  bool decode(rtc::CopyOnWriteBuffer const& message,
+              MessageCallback const& messageCallback);
+
+  /** \brief Get the number of expected and received FecData messages since the last call
+      */
+  void takeInterval(uint16_t& expected, uint16_t& received);
+
+  Json::Value status() const;
+
+protected:
+  static constexpr std::size_t historySize = 256;
+
+  int64_t _unwrap(uint16_t seq) const;
+  bool _have(int64_t seq) const;
+  void _accept(int64_t seq,
+               rtc::CopyOnWriteBuffer const& message,
+               bool fromNetwork,
+               MessageCallback const& messageCallback);
+  void _recover(int64_t firstSeq,
+                std::size_t count,
+                uint16_t lengthXor,
+                uint8_t const* parity,
+                std::size_t parityLength,
+                MessageCallback const& messageCallback);
+
+  bool _started;
+  int64_t _highestSeq;
+  std::array<int64_t, historySize> _historySeqs;
+  std::array<rtc::CopyOnWriteBuffer, historySize> _history;
+  std::vector<uint8_t> _recoverBuffer;
+
+  uint64_t _intervalExpected;
+  uint64_t _intervalReceived;
+
+  uint64_t _received;
+  uint64_t _lost;
+  uint64_t _late;
+  uint64_t _recovered;
+  uint64_t _duplicates;
+  uint64_t _parityMessages;
+};
+
+} // namespace faf
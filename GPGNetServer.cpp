@@ -47,6 +47,25 @@ void GPGNetServer::sendMessage(GPGNetMessage const& msg)
   FAF_LOG_INFO << "GPGNetServer::sendMessage: " << msg.toDebug();
 }
 
+void GPGNetServer::sendMessages(std::vector<GPGNetMessage> const& msgs)
+{
+  if (!_connectedSocket)
+  {
+    FAF_LOG_ERROR << "No GPGNetConnection. Wait for the game to connect before sending messages";
+    return;
+  }
+  std::string msgsString;
+  for (auto const& msg : msgs)
+  {
+    msgsString += msg.toBinary();
+  }
+  _connectedSocket->Send(msgsString.c_str(), msgsString.length());
+  for (auto const& msg : msgs)
+  {
+    FAF_LOG_INFO << "GPGNetServer::sendMessages: " << msg.toDebug();
+  }
+}
+
 void GPGNetServer::sendCreateLobby(InitMode initMode,
                                    int port,
                                    std::string const& login,
@@ -68,6 +87,14 @@ void GPGNetServer::sendCreateLobby(InitMode initMode,
 void GPGNetServer::sendConnectToPeer(std::string const& addressAndPort,
                                      std::string const& playerName,
                                      int playerId)
+{
+  sendMessage(connectToPeerMessage(addressAndPort, playerName, playerId));
+  FAF_LOG_INFO << "sending ConnectToPeer " << playerId << " " << playerName << " " << addressAndPort;
+}
+
+GPGNetMessage GPGNetServer::connectToPeerMessage(std::string const& addressAndPort,
+                                                 std::string const& playerName,
+                                                 int playerId)
 {
   GPGNetMessage msg;
   msg.header = "ConnectToPeer";
@@ -76,8 +103,7 @@ void GPGNetServer::sendConnectToPeer(std::string const& addressAndPort,
     playerName,
     playerId
   };
-  sendMessage(msg);
-  FAF_LOG_INFO << "sending ConnectToPeer " << playerId << " " << playerName << " " << addressAndPort;
+  return msg;
 }
 
 void GPGNetServer::sendJoinGame(std::string const& addressAndPort,
@@ -3,6 +3,7 @@
 #include <memory>
 #include <string>
 #include <array>
+#include <vector>
 
 #include <webrtc/rtc_base/asyncsocket.h>
 
@@ -29,6 +30,9 @@ public:
 
   void sendMessage(GPGNetMessage const& msg);
 
+  /** \brief Send several messages with one socket write */
+  void sendMessages(std::vector<GPGNetMessage> const& msgs);
+
   void sendCreateLobby(InitMode initMode,
                        int port,
                        std::string const& login,
@@ -39,6 +43,10 @@ public:
                          std::string const& playerName,
                          int playerId);
 
+  static GPGNetMessage connectToPeerMessage(std::string const& addressAndPort,
+                                            std::string const& playerName,
+                                            int playerId);
+
   void sendJoinGame(std::string const& addressAndPort,
                     std::string const& remotePlayerName,
                     int remotePlayerId);
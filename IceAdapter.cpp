@@ -1,6 +1,9 @@
 #include "IceAdapter.h"
 
+#include <algorithm>
 #include <iostream>
+#include <set>
+#include <stdexcept>
 
 #include <webrtc/pc/test/fakeaudiocapturemodule.h>
 //#include <webrtc/rtc_base/logging.h>
@@ -13,19 +16,71 @@
 
 namespace faf {
 
+static double toMs(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.;
+}
+
+/* how often relays are checked for their local description and completed gathering */
+static constexpr int relaySetupCheckIntervalMs = 50;
+
+/* relays still gathering after this are not measured */
+static constexpr auto relaySetupMeasureTimeout = std::chrono::seconds(60);
+
+static Json::Value relaySetupStatus(RelaySetupStats const& stats)
+{
+  Json::Value result;
+  result["calls"] = static_cast<Json::UInt64>(stats.calls);
+  result["relays"] = static_cast<Json::UInt64>(stats.relays);
+  result["total_ms"] = toMs(stats.total);
+  result["ms_per_relay"] = stats.relays > 0 ? toMs(stats.total) / stats.relays : 0.;
+  result["measured_calls"] = static_cast<Json::UInt64>(stats.measuredCalls);
+  result["local_description_ms"] = stats.measuredCalls > 0 ? toMs(stats.localDescriptionTotal) / stats.measuredCalls : 0.;
+  result["gathered_ms"] = stats.measuredCalls > 0 ? toMs(stats.gatheredTotal) / stats.measuredCalls : 0.;
+  result["gathered_ms_per_relay"] = stats.measuredRelays > 0 ? toMs(stats.gatheredTotal) / stats.measuredRelays : 0.;
+  return result;
+}
+
 IceAdapter::IceAdapter(IceAdapterOptions const& options):
   _options(options),
+  _mainThread(rtc::Thread::Current()),
+  _networkThread(rtc::Thread::Current()),
+  _workerThread(rtc::Thread::Current()),
+  _signalingThread(rtc::Thread::Current()),
   _gpgnetGameState("None"),
   _gametaskString("Idle"),
   _lobbyInitMode("normal"),
-  _lobbyPort(_options.gameUdpPort)
+  _lobbyPort(_options.gameUdpPort),
+  _relaySetupCheckScheduled(false),
+  _statusRevision(0),
+  _relaysSnapshotPending(false)
 {
   _jsonRpcServer.listen(_options.rpcPort);
   _gpgnetServer.listen(_options.gpgNetPort);
 
+  if (_options.threading == "dedicated")
+  {
+    /* The data channels are bound to the signaling thread, so the PeerRelays get their own
+       signaling thread to keep game packets away from JSON-RPC and GPGNet processing. */
+    _ownedNetworkThread = rtc::Thread::CreateWithSocketServer();
+    _ownedNetworkThread->SetName("faf-network", nullptr);
+    _ownedNetworkThread->Start();
+    _ownedWorkerThread = rtc::Thread::Create();
+    _ownedWorkerThread->SetName("faf-worker", nullptr);
+    _ownedWorkerThread->Start();
+    _ownedSignalingThread = rtc::Thread::CreateWithSocketServer();
+    _ownedSignalingThread->SetName("faf-signaling", nullptr);
+    _ownedSignalingThread->Start();
+    _networkThread = _ownedNetworkThread.get();
+    _workerThread = _ownedWorkerThread.get();
+    _signalingThread = _ownedSignalingThread.get();
+    FAF_LOG_INFO << "using dedicated network, worker and signaling threads";
+  }
+
   auto audio_device_module = FakeAudioCaptureModule::Create();
-  _pcfactory = webrtc::CreatePeerConnectionFactory(rtc::Thread::Current(),
-                                                   rtc::Thread::Current(),
+  _pcfactory = webrtc::CreatePeerConnectionFactory(_networkThread,
+                                                   _workerThread,
+                                                   _signalingThread,
                                                    audio_device_module,
                                                    nullptr,
                                                    nullptr);
@@ -34,6 +89,28 @@ IceAdapter::IceAdapter(IceAdapterOptions const& options):
     FAF_LOG_ERROR << "Error in CreatePeerConnectionFactory()";
     std::exit(1);
   }
+  _portAllocatorFactory = std::make_unique<PortAllocatorFactory>(_networkThread,
+                                                                 _options.gathering);
+  if (_options.iceServerRanking != "off")
+  {
+    _iceServerProber = std::make_unique<IceServerProber>(_options.iceServerProbeTimeoutMs,
+                                                         _options.iceServerRanking);
+  }
+  if (_options.certificate == "shared")
+  {
+    _certificateStore = std::make_unique<CertificateStore>(_options.certificateDirectory);
+  }
+  if (_options.peerConnectionPoolSize > 0)
+  {
+    _signalingThread->Invoke<void>(RTC_FROM_HERE, [this]
+    {
+      _peerConnectionPool = std::make_unique<PeerConnectionPool>(_pcfactory,
+                                                                 _certificateStore ? _certificateStore->certificate() : nullptr,
+                                                                 _portAllocatorFactory.get(),
+                                                                 _options.pathMigration == "on",
+                                                                 static_cast<std::size_t>(_options.peerConnectionPoolSize));
+    });
+  }
 
   /* ICE adapter should determine lobby port */
   if (_lobbyPort == 0)
@@ -51,9 +128,31 @@ IceAdapter::IceAdapter(IceAdapterOptions const& options):
   _gpgnetServer.SignalNewGPGNetMessage.connect(this, &IceAdapter::_onGpgNetMessage);
   _gpgnetServer.SignalClientConnected.connect(this, &IceAdapter::_onGameConnected);
   _gpgnetServer.SignalClientDisconnected.connect(this, &IceAdapter::_onGameDisconnected);
+  _jsonRpcServer.SignalClientDisconnected.connect(this, &IceAdapter::_onRpcClientDisconnected);
   _connectRpcMethods();
 }
 
+IceAdapter::~IceAdapter()
+{
+  /* a pending status snapshot may hold relays, which must be released on the signaling thread */
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [this]
+  {
+    _statusInvoker.Flush(rtc::Thread::Current());
+  });
+  std::vector<int> remotePlayerIds;
+  for (auto const& relay : _relays)
+  {
+    remotePlayerIds.push_back(relay.first);
+  }
+  _removePeerRelays(remotePlayerIds);
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [this]
+  {
+    _peerConnectionPool.reset();
+    _pcfactory = nullptr;
+  });
+  _portAllocatorFactory.reset();
+}
+
 void IceAdapter::hostGame(std::string const& map)
 {
   _queueGameTask({IceAdapterGameTask::HostGame,
@@ -61,6 +160,7 @@ void IceAdapter::hostGame(std::string const& map)
                  "",
                  0});
   _gametaskString = "Hosting map " + map + ".";
+  _markStatusChanged();
 }
 
 void IceAdapter::joinGame(std::string const& remotePlayerLogin,
@@ -74,21 +174,81 @@ void IceAdapter::joinGame(std::string const& remotePlayerLogin,
                  remotePlayerLogin,
                  remotePlayerId});
   _gametaskString = "Joining game from player " + remotePlayerLogin + ".";
+  _markStatusChanged();
 }
 
 void IceAdapter::connectToPeer(std::string const& remotePlayerLogin,
                                int remotePlayerId,
                                bool createOffer)
 {
-  _createPeerRelay(remotePlayerId,
-                   remotePlayerLogin,
-                   createOffer);
+  auto relaysBefore = _relays.size();
+  auto setupStart = std::chrono::steady_clock::now();
+  auto relay = _createPeerRelay(remotePlayerId,
+                                remotePlayerLogin,
+                                createOffer);
+  if (_relays.size() > relaysBefore)
+  {
+    ++_singleRelaySetup.calls;
+    ++_singleRelaySetup.relays;
+    _singleRelaySetup.total += std::chrono::steady_clock::now() - setupStart;
+    _measureRelaySetup({false, _singleRelaySetup.calls, setupStart, {relay}});
+  }
   _queueGameTask({IceAdapterGameTask::ConnectToPeer,
                  "",
                  remotePlayerLogin,
                  remotePlayerId});
 }
 
+Json::Value IceAdapter::connectToPeers(std::vector<IceAdapterPeer> const& peers)
+{
+  std::set<int> existingIds;
+  for (auto const& relay : _relays)
+  {
+    existingIds.insert(relay.first);
+  }
+  auto setupStart = std::chrono::steady_clock::now();
+  auto relays = _createPeerRelays(peers);
+  auto setupDuration = std::chrono::steady_clock::now() - setupStart;
+  RelaySetupBatch batch{true, 0, setupStart, {}};
+  for (std::size_t i = 0; i < peers.size(); ++i)
+  {
+    if (existingIds.insert(peers[i].remoteId).second)
+    {
+      batch.relays.push_back(relays[i]);
+    }
+  }
+  auto created = batch.relays.size();
+  if (created > 0)
+  {
+    ++_bulkRelaySetup.calls;
+    _bulkRelaySetup.relays += created;
+    _bulkRelaySetup.total += setupDuration;
+    batch.call = _bulkRelaySetup.calls;
+    _measureRelaySetup(batch);
+  }
+  _queueGameTask({IceAdapterGameTask::ConnectToPeers,
+                 "",
+                 "",
+                 0,
+                 peers});
+
+  Json::Value result;
+  result["peers"] = static_cast<Json::UInt64>(peers.size());
+  result["created"] = static_cast<Json::UInt64>(created);
+  result["setup_ms"] = toMs(setupDuration);
+  result["setup_ms_per_relay"] = created > 0 ? toMs(setupDuration) / created : 0.;
+  /* measured by earlier connectToPeer calls of this adapter, -1 without any */
+  result["single_setup_ms_per_relay"] = _singleRelaySetup.relays > 0 ? toMs(_singleRelaySetup.total) / _singleRelaySetup.relays : -1.;
+  /* set in "last_bulk" once every created relay completed gathering, see _onRelaySetupMeasured() */
+  result["local_description_ms"] = -1.;
+  result["gathered_ms"] = -1.;
+  result["single_gathered_ms_per_relay"] = -1.;
+  result["speedup"] = 0.;
+  _lastBulkConnect = result;
+  FAF_LOG_INFO << "created " << created << " of " << peers.size() << " PeerRelays in " << toMs(setupDuration) << " ms";
+  return result;
+}
+
 void IceAdapter::disconnectFromPeer(int remotePlayerId)
 {
   auto relayIt = _relays.find(remotePlayerId);
@@ -97,7 +257,7 @@ void IceAdapter::disconnectFromPeer(int remotePlayerId)
     FAF_LOG_TRACE << "no relay for remote peer " << remotePlayerId << " found";
     return;
   }
-  _relays.erase(relayIt);
+  _removePeerRelays({remotePlayerId});
   FAF_LOG_INFO << "removed relay for peer " << remotePlayerId;
   _queueGameTask({IceAdapterGameTask::DisconnectFromPeer,
                   "",
@@ -108,6 +268,7 @@ void IceAdapter::disconnectFromPeer(int remotePlayerId)
 void IceAdapter::setLobbyInitMode(std::string const& initMode)
 {
   _lobbyInitMode = initMode;
+  _markStatusChanged();
 }
 
 void IceAdapter::iceMsg(int remotePlayerId, Json::Value const& msg)
@@ -118,7 +279,38 @@ void IceAdapter::iceMsg(int remotePlayerId, Json::Value const& msg)
     FAF_LOG_ERROR << "no relay for remote peer " << remotePlayerId << " found";
     return;
   }
-  relayIt->second->addIceMessage(msg);
+  auto relay = relayIt->second;
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [relay, &msg]
+  {
+    /* an array is the batched form of onIceMsgBatch */
+    if (msg.isArray())
+    {
+      for (auto const& iceMsg : msg)
+      {
+        relay->addIceMessage(iceMsg);
+      }
+      return;
+    }
+    relay->addIceMessage(msg);
+  });
+}
+
+void IceAdapter::setRedundancy(int remotePlayerId, bool enabled)
+{
+  auto relayIt = _relays.find(remotePlayerId);
+  if (relayIt == _relays.end())
+  {
+    throw std::runtime_error("no relay for remote peer " + std::to_string(remotePlayerId) + " found");
+  }
+  auto relay = relayIt->second;
+  auto result = _signalingThread->Invoke<bool>(RTC_FROM_HERE, [relay, enabled]
+  {
+    return relay->setRedundancy(enabled);
+  });
+  if (!result)
+  {
+    throw std::runtime_error("redundant paths are disabled, see --redundant-path");
+  }
 }
 
 void IceAdapter::sendToGpgNet(GPGNetMessage const& message)
@@ -160,10 +352,35 @@ void IceAdapter::setIceServers(Json::Value const& servers)
       FAF_LOG_DEBUG << dbgMsg;
     }
   }
-  for(auto it = _relays.begin(), end = _relays.end(); it != end; ++it)
+  if (!_iceServerProber)
   {
-    it->second->setIceServers(_iceServers);
+    _applyIceServers(true);
+    return;
   }
+  /* Relays connecting right now use the servers as given, the pool only
+     prepares PeerConnections with the ranked servers. */
+  _applyIceServers(false);
+  _iceServerProber->probe(_iceServers, [this](webrtc::PeerConnectionInterface::IceServers const& rankedServers)
+  {
+    _iceServers = rankedServers;
+    _applyIceServers(true);
+  });
+}
+
+void IceAdapter::_applyIceServers(bool includePool)
+{
+  _markStatusChanged();
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [this, includePool]
+  {
+    for(auto it = _relays.begin(), end = _relays.end(); it != end; ++it)
+    {
+      it->second->setIceServers(_iceServers);
+    }
+    if (_peerConnectionPool && includePool)
+    {
+      _peerConnectionPool->setIceServers(_iceServers);
+    }
+  });
 }
 
 Json::Value IceAdapter::status() const
@@ -173,6 +390,18 @@ Json::Value IceAdapter::status() const
   result["ice_servers_size"] = static_cast<int>(_iceServers.size());
   result["lobby_port"] = _lobbyPort;
   result["init_mode"] = _lobbyInitMode;
+  result["threading"] = _options.threading;
+  result["certificate"] = _certificateStore ? _certificateStore->status() : Json::Value();
+  result["port_allocator"] = _portAllocatorFactory->status();
+  result["ice_server_probe"] = _iceServerProber ? _iceServerProber->status() : Json::Value();
+  result["status_subscriptions"] = Json::Value(Json::arrayValue);
+  for (auto const& subscriber : _statusSubscribers)
+  {
+    result["status_subscriptions"].append(subscriber.second.subscription->status());
+  }
+  result["relay_setup"]["single"] = relaySetupStatus(_singleRelaySetup);
+  result["relay_setup"]["bulk"] = relaySetupStatus(_bulkRelaySetup);
+  result["relay_setup"]["last_bulk"] = _lastBulkConnect;
   /* Options */
   {
     Json::Value options;
@@ -197,16 +426,98 @@ Json::Value IceAdapter::status() const
   }
   /* Relays */
   {
-    Json::Value relays(Json::arrayValue);
+    std::vector<std::shared_ptr<PeerRelay>> relays;
     for (auto it = _relays.begin(), end = _relays.end(); it != end; ++it)
     {
-      relays.append(it->second->status());
+      relays.push_back(it->second);
     }
-    result["relays"] = relays;
+    Json::Value snapshot;
+    double snapshotAgeMs = 0.;
+    if (_signalingThread->IsCurrent())
+    {
+      snapshot = _relaysStatus(relays);
+    }
+    else
+    {
+      {
+        std::lock_guard<std::mutex> lock(_relaysSnapshotMutex);
+        snapshot = _relaysSnapshot;
+        snapshotAgeMs = snapshot.isNull() ? -1. : std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _relaysSnapshotTime).count() / 1000.;
+      }
+      if (!_relaysSnapshotPending.exchange(true))
+      {
+        _statusInvoker.AsyncInvoke<void>(RTC_FROM_HERE, _signalingThread, [this, relays]() mutable
+        {
+          auto newSnapshot = _relaysStatus(relays);
+          /* a relay removed meanwhile must still be destroyed on the signaling thread */
+          relays.clear();
+          std::lock_guard<std::mutex> lock(_relaysSnapshotMutex);
+          _relaysSnapshot = newSnapshot;
+          _relaysSnapshotTime = std::chrono::steady_clock::now();
+          _relaysSnapshotPending = false;
+        });
+      }
+    }
+    result["relays"] = snapshot.isNull() ? Json::Value(Json::arrayValue) : snapshot["relays"];
+    result["connection_phases"] = snapshot["connection_phases"];
+    result["peer_connection_pool"] = snapshot["peer_connection_pool"];
+    result["relays_snapshot_age_ms"] = snapshotAgeMs;
+  }
+  return result;
+}
+
+Json::Value IceAdapter::_relaysStatus(std::vector<std::shared_ptr<PeerRelay>> const& relays) const
+{
+  Json::Value result;
+  result["relays"] = Json::Value(Json::arrayValue);
+  std::vector<ConnectionAttemptLog const*> logs;
+  for (auto const& relay : relays)
+  {
+    result["relays"].append(relay->status());
+    logs.push_back(&relay->connectionAttempts());
   }
+  result["connection_phases"] = ConnectionAttemptLog::aggregate(logs);
+  result["peer_connection_pool"] = _peerConnectionPool ? _peerConnectionPool->status() : Json::Value();
   return result;
 }
 
+Json::Value IceAdapter::relayStats(int remotePlayerId, std::size_t maxSamples) const
+{
+  auto relayIt = _relays.find(remotePlayerId);
+  if (relayIt == _relays.end())
+  {
+    throw std::runtime_error("no relay for remote peer " + std::to_string(remotePlayerId) + " found");
+  }
+  auto relay = relayIt->second;
+  return _signalingThread->Invoke<Json::Value>(RTC_FROM_HERE, [relay, maxSamples]
+  {
+    return relay->relayStats(maxSamples);
+  });
+}
+
+Json::Value IceAdapter::subscribeStatus(int intervalMs, rtc::AsyncSocket* session)
+{
+  unsubscribeStatus(session);
+  intervalMs = std::max(intervalMs, _options.statusMinIntervalMs);
+  auto& subscriber = _statusSubscribers[session];
+  subscriber.subscription = std::make_unique<StatusSubscription>(session, intervalMs);
+  subscriber.timer = std::make_unique<Timer>();
+  _updateStatusSubscription(*subscriber.subscription);
+  subscriber.timer->start(intervalMs, std::bind(&IceAdapter::_onStatusTimer, this, session));
+  return subscriber.subscription->takeSnapshot();
+}
+
+void IceAdapter::unsubscribeStatus(rtc::AsyncSocket* session)
+{
+  auto subscriberIt = _statusSubscribers.find(session);
+  if (subscriberIt == _statusSubscribers.end())
+  {
+    return;
+  }
+  subscriberIt->second.timer->stop();
+  _statusSubscribers.erase(subscriberIt);
+}
+
 void IceAdapter::_connectRpcMethods()
 {
   _jsonRpcServer.setRpcCallback("quit",
@@ -287,6 +598,41 @@ void IceAdapter::_connectRpcMethods()
     }
   });
 
+  _jsonRpcServer.setRpcCallback("connectToPeers",
+                             [this](Json::Value const& paramsArray,
+                             Json::Value & result,
+                             Json::Value & error,
+                             rtc::AsyncSocket* session)
+  {
+    if (paramsArray.size() < 1 ||
+        !paramsArray[0].isArray())
+    {
+      error = "Need 1 parameter: peers (array of {remotePlayerLogin (string), remotePlayerId (int), createOffer (bool)})";
+      return;
+    }
+    std::vector<IceAdapterPeer> peers;
+    for (auto const& peerJson : paramsArray[0])
+    {
+      if (!peerJson.isObject() ||
+          !peerJson["remotePlayerId"].isInt())
+      {
+        error = "every peer needs remotePlayerLogin (string), remotePlayerId (int), createOffer (bool)";
+        return;
+      }
+      peers.push_back({peerJson["remotePlayerId"].asInt(),
+                       peerJson["remotePlayerLogin"].asString(),
+                       peerJson["createOffer"].asBool()});
+    }
+    try
+    {
+      result = connectToPeers(peers);
+    }
+    catch(std::exception& e)
+    {
+      error = e.what();
+    }
+  });
+
   _jsonRpcServer.setRpcCallback("disconnectFromPeer",
                              [this](Json::Value const& paramsArray,
                              Json::Value & result,
@@ -339,9 +685,9 @@ void IceAdapter::_connectRpcMethods()
                              rtc::AsyncSocket* session)
   {
     if (paramsArray.size() < 2 ||
-        !paramsArray[1].isObject())
+        !(paramsArray[1].isObject() || paramsArray[1].isArray()))
     {
-      error = "Need 2 parameters: remotePlayerId (int), msg (object)";
+      error = "Need 2 parameters: remotePlayerId (int), msg (object or array)";
       return;
     }
     try
@@ -356,6 +702,30 @@ void IceAdapter::_connectRpcMethods()
     }
   });
 
+  _jsonRpcServer.setRpcCallback("setRedundancy",
+                             [this](Json::Value const& paramsArray,
+                             Json::Value & result,
+                             Json::Value & error,
+                             rtc::AsyncSocket* session)
+  {
+    if (paramsArray.size() < 2 ||
+        !paramsArray[1].isBool())
+    {
+      error = "Need 2 parameters: remotePlayerId (int), enabled (bool)";
+      return;
+    }
+    try
+    {
+      setRedundancy(paramsArray[0].asInt(),
+                    paramsArray[1].asBool());
+      result = "ok";
+    }
+    catch(std::exception& e)
+    {
+      error = e.what();
+    }
+  });
+
   _jsonRpcServer.setRpcCallback("sendToGpgNet",
                              [this](Json::Value const& paramsArray,
                              Json::Value & result,
@@ -417,6 +787,54 @@ void IceAdapter::_connectRpcMethods()
   {
     result = status();
   });
+
+  _jsonRpcServer.setRpcCallback("relayStats",
+                             [this](Json::Value const& paramsArray,
+                             Json::Value & result,
+                             Json::Value & error,
+                             rtc::AsyncSocket* session)
+  {
+    if (paramsArray.size() < 1)
+    {
+      error = "Need at least 1 parameter: remotePlayerId (int), [maxSamples (int)]";
+      return;
+    }
+    try
+    {
+      result = relayStats(paramsArray[0].asInt(),
+                          paramsArray.size() > 1 ? static_cast<std::size_t>(std::max(paramsArray[1].asInt(), 0)) : 0);
+    }
+    catch(std::exception& e)
+    {
+      error = e.what();
+    }
+  });
+
+  _jsonRpcServer.setRpcCallback("subscribeStatus",
+                             [this](Json::Value const& paramsArray,
+                             Json::Value & result,
+                             Json::Value & error,
+                             rtc::AsyncSocket* session)
+  {
+    if (paramsArray.size() > 0 &&
+        !paramsArray[0].isInt())
+    {
+      error = "Need 0 or 1 parameters: [intervalMs (int)]";
+      return;
+    }
+    result = subscribeStatus(paramsArray.size() > 0 ? paramsArray[0].asInt() : 1000,
+                             session);
+  });
+
+  _jsonRpcServer.setRpcCallback("unsubscribeStatus",
+                             [this](Json::Value const& paramsArray,
+                             Json::Value & result,
+                             Json::Value & error,
+                             rtc::AsyncSocket* session)
+  {
+    unsubscribeStatus(session);
+    result = "ok";
+  });
 }
 
 void IceAdapter::_queueGameTask(IceAdapterGameTask t)
@@ -472,6 +890,31 @@ void IceAdapter::_tryExecuteGameTasks()
         }
         break;
       }
+      case IceAdapterGameTask::ConnectToPeers:
+      {
+        if (_gpgnetGameState != "Lobby")
+        {
+          return;
+        }
+        std::vector<GPGNetMessage> messages;
+        for (auto const& peer : task.peers)
+        {
+          auto relayIt = _relays.find(peer.remoteId);
+          if (relayIt == _relays.end())
+          {
+            FAF_LOG_ERROR << "no relay found for joining player " << peer.remoteId;
+            continue;
+          }
+          messages.push_back(GPGNetServer::connectToPeerMessage(std::string("127.0.0.1:") + std::to_string(relayIt->second->localUdpSocketPort()),
+                                                                peer.remoteLogin,
+                                                                peer.remoteId));
+        }
+        if (!messages.empty())
+        {
+          _gpgnetServer.sendMessages(messages);
+        }
+        break;
+      }
       case IceAdapterGameTask::DisconnectFromPeer:
         _gpgnetServer.sendDisconnectFromPeer(task.remoteId);
         break;
@@ -485,6 +928,7 @@ void IceAdapter::_onGameConnected()
   FAF_LOG_INFO << "game connected";
   _jsonRpcServer.sendRequest("onConnectionStateChanged",
                              {"Connected"});
+  _markStatusChanged();
 }
 
 void IceAdapter::_onGameDisconnected()
@@ -494,7 +938,13 @@ void IceAdapter::_onGameDisconnected()
                              {"Disconnected"});
   _gametaskString = "Idle";
   _gpgnetGameState = "None";
-  _relays.clear();
+  _markStatusChanged();
+  std::vector<int> remotePlayerIds;
+  for (auto const& relay : _relays)
+  {
+    remotePlayerIds.push_back(relay.first);
+  }
+  _removePeerRelays(remotePlayerIds);
 }
 
 void IceAdapter::_onGpgNetMessage(GPGNetMessage message)
@@ -505,6 +955,7 @@ void IceAdapter::_onGpgNetMessage(GPGNetMessage message)
     if (message.chunks.size() == 1)
     {
       _gpgnetGameState = message.chunks[0].asString();
+      _markStatusChanged();
       if (_gpgnetGameState == "Idle")
       {
         _gpgnetServer.sendCreateLobby(_lobbyInitMode == "normal" ? InitMode::NormalLobby : InitMode::AutoLobby,
@@ -532,34 +983,202 @@ std::shared_ptr<PeerRelay> IceAdapter::_createPeerRelay(int remotePlayerId,
                                                         std::string const& remotePlayerLogin,
                                                         bool createOffer)
 {
+  return _createPeerRelays({{remotePlayerId, remotePlayerLogin, createOffer}}).front();
+}
+
+std::vector<std::shared_ptr<PeerRelay>> IceAdapter::_createPeerRelays(std::vector<IceAdapterPeer> const& peers)
+{
+  std::vector<IceAdapterPeer> newPeers;
+  for (auto const& peer : peers)
+  {
+    if (_iceServers.empty())
+    {
+      FAF_LOG_ERROR << "no ICE servers while creating PeerRelay for remote player " << peer.remoteLogin
+                    << "(" << peer.remoteId << "). Call setIceServers in advance from client. See https://developer.mozilla.org/en-US/docs/Web/API/RTCConfiguration";
+    }
+    if (_relays.find(peer.remoteId) != _relays.end() ||
+        std::any_of(newPeers.begin(), newPeers.end(), [&peer](IceAdapterPeer const& newPeer) { return newPeer.remoteId == peer.remoteId; }))
+    {
+      FAF_LOG_WARN << "PeerRelay for remote player " << peer.remoteLogin << "(" << peer.remoteId << ") already exists! Skipping instantiation of new PeerRelay.";
+      continue;
+    }
+    newPeers.push_back(peer);
+  }
+
+  /* the relays and their WebRTC objects live on the signaling thread,
+     their callbacks are forwarded to the main thread for JSON-RPC */
+  auto relays = _signalingThread->Invoke<std::vector<std::shared_ptr<PeerRelay>>>(RTC_FROM_HERE, [&]
+  {
+    std::vector<std::shared_ptr<PeerRelay>> result;
+    for (auto const& peer : newPeers)
+    {
+      auto relay = std::make_shared<PeerRelay>(peer.remoteId,
+                                               peer.remoteLogin,
+                                               peer.createOffer,
+                                               _lobbyPort,
+                                               _pcfactory,
+                                               _networkThread,
+                                               _options);
+      relay->setPeerConnectionPool(_peerConnectionPool.get());
+      relay->setPortAllocatorFactory(_portAllocatorFactory.get());
+      if (_certificateStore)
+      {
+        relay->setCertificate(_certificateStore->certificate());
+      }
+      result.push_back(relay);
+    }
+    return result;
+  });
+
+  for (std::size_t i = 0; i < relays.size(); ++i)
+  {
+    _connectPeerRelayCallbacks(newPeers[i].remoteId, relays[i]);
+    relays[i]->setIceServers(_iceServers);
+    _relays[newPeers[i].remoteId] = relays[i];
+  }
+
+  /* reinit() only starts the offer, so the offers and candidate gathering of all relays overlap */
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [&relays]
+  {
+    for (auto const& relay : relays)
+    {
+      relay->reinit();
+    }
+  });
 
-  if (_iceServers.empty())
+  std::vector<std::shared_ptr<PeerRelay>> result;
+  for (auto const& peer : peers)
   {
-    FAF_LOG_ERROR << "no ICE servers while creating PeerRelay for remote player " << remotePlayerLogin
-                  << "(" << remotePlayerId << "). Call setIceServers in advance from client. See https://developer.mozilla.org/en-US/docs/Web/API/RTCConfiguration";
+    result.push_back(_relays[peer.remoteId]);
   }
+  return result;
+}
+
+void IceAdapter::_measureRelaySetup(RelaySetupBatch const& batch)
+{
+  _statusInvoker.AsyncInvoke<void>(RTC_FROM_HERE, _signalingThread, [this, batch]
+  {
+    _relaySetupBatches.push_back(batch);
+    _checkRelaySetups();
+  });
+}
 
-  auto existingRelay = _relays.find(remotePlayerId);
-  if (existingRelay != _relays.end())
+void IceAdapter::_checkRelaySetups()
+{
+  _relaySetupCheckScheduled = false;
+  auto now = std::chrono::steady_clock::now();
+  for (auto batchIt = _relaySetupBatches.begin(); batchIt != _relaySetupBatches.end();)
+  {
+    /* the time stamps of the connection attempt logs are exact, polling only delays the report */
+    auto lastLocalDescription = batchIt->start;
+    auto lastGathered = batchIt->start;
+    bool removed = false;
+    bool gathered = true;
+    for (auto const& weakRelay : batchIt->relays)
+    {
+      auto relay = weakRelay.lock();
+      if (!relay)
+      {
+        removed = true;
+        break;
+      }
+      std::chrono::steady_clock::time_point at;
+      if (relay->connectionAttempts().reached(ConnectionPhase::LocalDescription, at))
+      {
+        lastLocalDescription = std::max(lastLocalDescription, at);
+      }
+      if (!relay->connectionAttempts().reached(ConnectionPhase::Gathered, at))
+      {
+        gathered = false;
+        continue;
+      }
+      lastGathered = std::max(lastGathered, at);
+    }
+    if (!removed &&
+        !gathered &&
+        now - batchIt->start < relaySetupMeasureTimeout)
+    {
+      ++batchIt;
+      continue;
+    }
+    /* a removed relay or one that never completed gathering leaves the call unmeasured */
+    if (!removed &&
+        gathered)
+    {
+      auto batch = *batchIt;
+      auto localDescription = lastLocalDescription - batch.start;
+      auto gatheredDuration = lastGathered - batch.start;
+      _runOnMainThread([this, batch, localDescription, gatheredDuration]
+      {
+        _onRelaySetupMeasured(batch, localDescription, gatheredDuration);
+      });
+    }
+    batchIt = _relaySetupBatches.erase(batchIt);
+  }
+  if (!_relaySetupBatches.empty() &&
+      !_relaySetupCheckScheduled)
   {
-    FAF_LOG_WARN << "PeerRelay for remote player " << remotePlayerLogin << "(" << remotePlayerId << ") already exists! Skipping instantiation of new PeerRelay.";
-    return existingRelay->second;
+    _relaySetupCheckScheduled = true;
+    _statusInvoker.AsyncInvokeDelayed<void>(RTC_FROM_HERE, _signalingThread, [this]
+    {
+      _checkRelaySetups();
+    }, relaySetupCheckIntervalMs);
   }
+}
 
-  auto relay = std::make_shared<PeerRelay>(remotePlayerId,
-                                           remotePlayerLogin,
-                                           createOffer,
-                                           _lobbyPort,
-                                           _pcfactory);
+void IceAdapter::_onRelaySetupMeasured(RelaySetupBatch const& batch,
+                                       std::chrono::steady_clock::duration localDescription,
+                                       std::chrono::steady_clock::duration gathered)
+{
+  auto& stats = batch.bulk ? _bulkRelaySetup : _singleRelaySetup;
+  ++stats.measuredCalls;
+  stats.measuredRelays += batch.relays.size();
+  stats.localDescriptionTotal += localDescription;
+  stats.gatheredTotal += gathered;
+  FAF_LOG_DEBUG << (batch.bulk ? "connectToPeers" : "connectToPeer") << " with " << batch.relays.size()
+                << " new PeerRelays reached local descriptions after " << toMs(localDescription)
+                << " ms and completed gathering after " << toMs(gathered) << " ms";
+
+  if (batch.bulk &&
+      batch.call == _bulkRelaySetup.calls)
+  {
+    auto singleGatheredMsPerRelay = _singleRelaySetup.measuredRelays > 0 ? toMs(_singleRelaySetup.gatheredTotal) / _singleRelaySetup.measuredRelays : -1.;
+    auto gatheredMsPerRelay = toMs(gathered) / batch.relays.size();
+    _lastBulkConnect["local_description_ms"] = toMs(localDescription);
+    _lastBulkConnect["gathered_ms"] = toMs(gathered);
+    _lastBulkConnect["single_gathered_ms_per_relay"] = singleGatheredMsPerRelay;
+    _lastBulkConnect["speedup"] = singleGatheredMsPerRelay > 0 && gatheredMsPerRelay > 0 ?
+                                  singleGatheredMsPerRelay / gatheredMsPerRelay : 0.;
+  }
+  _markStatusChanged();
+}
 
+void IceAdapter::_connectPeerRelayCallbacks(int remotePlayerId, std::shared_ptr<PeerRelay> const& relay)
+{
   relay->setIceMessageCallback([this, remotePlayerId](Json::Value const& iceMsg)
   {
     Json::Value onIceMsgParams(Json::arrayValue);
     onIceMsgParams.append(_options.localPlayerId);
     onIceMsgParams.append(remotePlayerId);
     onIceMsgParams.append(iceMsg);
-    _jsonRpcServer.sendRequest("onIceMsg",
-                               onIceMsgParams);
+    _runOnMainThread([this, onIceMsgParams]
+    {
+      _jsonRpcServer.sendRequest("onIceMsg",
+                                 onIceMsgParams);
+    });
+  });
+
+  relay->setIceMessageBatchCallback([this, remotePlayerId](Json::Value const& iceMsgs)
+  {
+    Json::Value onIceMsgBatchParams(Json::arrayValue);
+    onIceMsgBatchParams.append(_options.localPlayerId);
+    onIceMsgBatchParams.append(remotePlayerId);
+    onIceMsgBatchParams.append(iceMsgs);
+    _runOnMainThread([this, onIceMsgBatchParams]
+    {
+      _jsonRpcServer.sendRequest("onIceMsgBatch",
+                                 onIceMsgBatchParams);
+    });
   });
 
   relay->setStateCallback([this, remotePlayerId](std::string const& state)
@@ -568,8 +1187,11 @@ std::shared_ptr<PeerRelay> IceAdapter::_createPeerRelay(int remotePlayerId,
     onIceStateChangedParams.append(_options.localPlayerId);
     onIceStateChangedParams.append(remotePlayerId);
     onIceStateChangedParams.append(state);
-    _jsonRpcServer.sendRequest("onIceConnectionStateChanged",
-                               onIceStateChangedParams);
+    _runOnMainThread([this, onIceStateChangedParams]
+    {
+      _jsonRpcServer.sendRequest("onIceConnectionStateChanged",
+                                 onIceStateChangedParams);
+    });
   });
 
   relay->setConnectedCallback([this, remotePlayerId](bool connected)
@@ -578,17 +1200,121 @@ std::shared_ptr<PeerRelay> IceAdapter::_createPeerRelay(int remotePlayerId,
     onConnectedParams.append(_options.localPlayerId);
     onConnectedParams.append(remotePlayerId);
     onConnectedParams.append(connected);
-    _jsonRpcServer.sendRequest("onConnected",
-                               onConnectedParams);
+    _runOnMainThread([this, onConnectedParams]
+    {
+      _jsonRpcServer.sendRequest("onConnected",
+                                 onConnectedParams);
+    });
+  });
+
+  relay->setCongestionCallback([this, remotePlayerId](bool congested)
+  {
+    Json::Value onPeerCongestedParams(Json::arrayValue);
+    onPeerCongestedParams.append(_options.localPlayerId);
+    onPeerCongestedParams.append(remotePlayerId);
+    onPeerCongestedParams.append(congested);
+    _runOnMainThread([this, onPeerCongestedParams]
+    {
+      _jsonRpcServer.sendRequest("onPeerCongested",
+                                 onPeerCongestedParams);
+    });
+  });
+}
+
+void IceAdapter::_removePeerRelays(std::vector<int> const& remotePlayerIds)
+{
+  /* PeerRelays must be destroyed on the signaling thread they were created on */
+  std::vector<std::shared_ptr<PeerRelay>> removedRelays;
+  for (auto remotePlayerId : remotePlayerIds)
+  {
+    auto relayIt = _relays.find(remotePlayerId);
+    if (relayIt != _relays.end())
+    {
+      removedRelays.push_back(relayIt->second);
+      _relays.erase(relayIt);
+    }
+  }
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [&removedRelays]
+  {
+    removedRelays.clear();
   });
+}
+
+void IceAdapter::_runOnMainThread(std::function<void()> f)
+{
+  if (_mainThread->IsCurrent())
+  {
+    f();
+  }
+  else
+  {
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE, _mainThread, f);
+  }
+}
 
-  relay->setIceServers(_iceServers);
+void IceAdapter::_markStatusChanged()
+{
+  ++_statusRevision;
+}
+
+Json::Value IceAdapter::_statusSummary() const
+{
+  Json::Value result;
+  result["ice_servers_size"] = static_cast<int>(_iceServers.size());
+  result["init_mode"] = _lobbyInitMode;
+  result["game_connected"] = _gpgnetServer.hasConnectedClient();
+  result["game_state"] = _gpgnetGameState;
+  result["task_string"] = _gametaskString;
+  return result;
+}
 
-  _relays[remotePlayerId] = relay;
+void IceAdapter::_updateStatusSubscription(StatusSubscription& subscription)
+{
+  if (subscription.adapterChanged(_statusRevision))
+  {
+    subscription.updateAdapter(_statusRevision, _statusSummary());
+  }
+  /* unchanged relays cost one revision comparison */
+  _signalingThread->Invoke<void>(RTC_FROM_HERE, [this, &subscription]
+  {
+    std::vector<int> remotePlayerIds;
+    for (auto it = _relays.begin(), end = _relays.end(); it != end; ++it)
+    {
+      remotePlayerIds.push_back(it->first);
+      auto revision = it->second->statusRevision();
+      if (subscription.relayChanged(it->first, revision))
+      {
+        subscription.updateRelay(it->first, revision, it->second->statusSummary());
+      }
+    }
+    subscription.retainRelays(remotePlayerIds);
+  });
+}
 
-  relay->reinit();
+void IceAdapter::_onStatusTimer(rtc::AsyncSocket* session)
+{
+  auto subscriberIt = _statusSubscribers.find(session);
+  if (subscriberIt == _statusSubscribers.end())
+  {
+    return;
+  }
+  auto& subscription = *subscriberIt->second.subscription;
+  _updateStatusSubscription(subscription);
+  auto delta = subscription.takeDelta();
+  if (delta.isNull())
+  {
+    return;
+  }
+  Json::Value onStatusDeltaParams(Json::arrayValue);
+  onStatusDeltaParams.append(delta);
+  _jsonRpcServer.sendRequest("onStatusDelta",
+                             onStatusDeltaParams,
+                             session);
+}
 
-  return relay;
+void IceAdapter::_onRpcClientDisconnected(rtc::AsyncSocket* session)
+{
+  unsubscribeStatus(session);
 }
 
 IceAdapterOptions const& IceAdapter::options() const
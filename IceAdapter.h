@@ -1,18 +1,40 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <queue>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <webrtc/rtc_base/scoped_ref_ptr.h>
+#include <webrtc/rtc_base/asyncinvoker.h>
+#include <webrtc/rtc_base/thread.h>
 #include <webrtc/api/peerconnectioninterface.h>
 
+#include "CertificateStore.h"
 #include "IceAdapterOptions.h"
 #include "GPGNetServer.h"
+#include "IceServerProber.h"
 #include "JsonRpcServer.h"
+#include "PeerConnectionPool.h"
 #include "PeerRelay.h"
+#include "PortAllocatorFactory.h"
+#include "StatusSubscription.h"
+#include "Timer.h"
 
 namespace faf {
 
+/*! \brief A remote player of connectToPeers
+ */
+struct IceAdapterPeer
+{
+  int remoteId;
+  std::string remoteLogin;
+  bool createOffer;
+};
+
 struct IceAdapterGameTask
 {
   enum
@@ -20,17 +42,57 @@ struct IceAdapterGameTask
     JoinGame,
     HostGame,
     ConnectToPeer,
+    ConnectToPeers,
     DisconnectFromPeer
   } task;
   std::string hostMap;
   std::string remoteLogin;
   int remoteId;
+  /* only for ConnectToPeers */
+  std::vector<IceAdapterPeer> peers;
+};
+
+/*! \brief The time spent setting up PeerRelays by connectToPeer or connectToPeers
+ */
+struct RelaySetupStats
+{
+  uint64_t calls = 0;
+  uint64_t relays = 0;
+  std::chrono::steady_clock::duration total = std::chrono::steady_clock::duration::zero();
+
+  /* calls whose relays all gathered their candidates, with the summed time until the last
+     relay of a call set its local description and completed gathering */
+  uint64_t measuredCalls = 0;
+  uint64_t measuredRelays = 0;
+  std::chrono::steady_clock::duration localDescriptionTotal = std::chrono::steady_clock::duration::zero();
+  std::chrono::steady_clock::duration gatheredTotal = std::chrono::steady_clock::duration::zero();
+};
+
+/*! \brief The PeerRelays created by one connectToPeer or connectToPeers call, watched on the
+ *         signaling thread until all of them gathered their candidates
+ */
+struct RelaySetupBatch
+{
+  bool bulk;
+  /* the value of RelaySetupStats::calls of this kind after the call */
+  uint64_t call;
+  std::chrono::steady_clock::time_point start;
+  std::vector<std::weak_ptr<PeerRelay>> relays;
+};
+
+/*! \brief The subscribeStatus subscription of one JSON-RPC client and its notification timer
+ */
+struct StatusSubscriber
+{
+  std::unique_ptr<StatusSubscription> subscription;
+  std::unique_ptr<Timer> timer;
 };
 
 class IceAdapter : public sigslot::has_slots<>
 {
 public:
   IceAdapter(IceAdapterOptions const& options);
+  virtual ~IceAdapter();
 
   /** \brief Sets the IceAdapter in hosting mode and tells the connected game to host the map once
    *         it reaches "Lobby" state
@@ -60,6 +122,14 @@ public:
                      int remotePlayerId,
                      bool createOffer);
 
+  /** \brief Like connectToPeer for several remote players at once.
+   *         All PeerRelays are created in one pass, so their offers and candidate gathering overlap,
+   *         and the game gets all ConnectToPeer messages in one batch once it reached Lobby state.
+       \param peers: the remote players, existing relays are kept
+       \returns A timing report comparing the setup with connectToPeer calls
+      */
+  Json::Value connectToPeers(std::vector<IceAdapterPeer> const& peers);
+
   /** \brief Tell the game to disconnect from a remote peer
    *         Will remove the Relay.
        \param remotePlayerId:    ID of the player to disconnect from
@@ -73,10 +143,17 @@ public:
 
   /** \brief Add ICE signalling message
        \param remotePlayerId: ID of the remote player
-       \param msg: the signalling messages generated from the remote player
+       \param msg: the signalling message generated from the remote player,
+                   or an array of them as sent with onIceMsgBatch
       */
   void iceMsg(int remotePlayerId, Json::Value const& msg);
 
+  /** \brief Send game packets to a peer over a second, TURN relayed connection as well
+       \param remotePlayerId: ID of the remote player
+       \param enabled: true to open the redundant connection, false to close it
+      */
+  void setRedundancy(int remotePlayerId, bool enabled);
+
   /** \brief Send an arbitrary GPGNet message to the game
        \param message: The GPGNet message
       */
@@ -93,6 +170,25 @@ public:
       */
   Json::Value status() const;
 
+  /** \brief Return the recent connection samples of a PeerRelay
+       \param remotePlayerId: ID of the remote player
+       \param maxSamples: the number of most recent samples, 0 for all kept samples
+       \returns The samples as JSON structure, see --stats-interval-ms
+      */
+  Json::Value relayStats(int remotePlayerId, std::size_t maxSamples) const;
+
+  /** \brief Send the changed fields of the adapter and relay summaries as onStatusDelta
+             notifications, a previous subscription of the same client is replaced
+       \param intervalMs: the minimum time between two notifications, see --status-min-interval-ms
+       \param session: the JSON-RPC client to notify
+       \returns The complete summaries the deltas apply to
+      */
+  Json::Value subscribeStatus(int intervalMs, rtc::AsyncSocket* session);
+
+  /** \brief Stop the onStatusDelta notifications to session, other clients stay subscribed
+      */
+  void unsubscribeStatus(rtc::AsyncSocket* session);
+
   IceAdapterOptions const& options() const;
 
 protected:
@@ -105,9 +201,45 @@ protected:
   std::shared_ptr<PeerRelay> _createPeerRelay(int remotePlayerId,
                                               std::string const& remotePlayerLogin,
                                               bool createOffer);
+  std::vector<std::shared_ptr<PeerRelay>> _createPeerRelays(std::vector<IceAdapterPeer> const& peers);
+  void _connectPeerRelayCallbacks(int remotePlayerId, std::shared_ptr<PeerRelay> const& relay);
+  void _removePeerRelays(std::vector<int> const& remotePlayerIds);
+  void _measureRelaySetup(RelaySetupBatch const& batch);
+  /* runs on the signaling thread */
+  void _checkRelaySetups();
+  void _onRelaySetupMeasured(RelaySetupBatch const& batch,
+                             std::chrono::steady_clock::duration localDescription,
+                             std::chrono::steady_clock::duration gathered);
+  void _applyIceServers(bool includePool);
+  void _markStatusChanged();
+  Json::Value _statusSummary() const;
+  /* runs on the signaling thread */
+  Json::Value _relaysStatus(std::vector<std::shared_ptr<PeerRelay>> const& relays) const;
+  void _updateStatusSubscription(StatusSubscription& subscription);
+  void _onStatusTimer(rtc::AsyncSocket* session);
+  void _onRpcClientDisconnected(rtc::AsyncSocket* session);
+  void _runOnMainThread(std::function<void()> f);
 
   IceAdapterOptions _options;
+
+  /* Threads used by WebRTC. The PeerRelays live on the signaling thread.
+     In "single" threading mode all of them are the main thread. */
+  rtc::Thread* _mainThread;
+  std::unique_ptr<rtc::Thread> _ownedNetworkThread;
+  std::unique_ptr<rtc::Thread> _ownedWorkerThread;
+  std::unique_ptr<rtc::Thread> _ownedSignalingThread;
+  rtc::Thread* _networkThread;
+  rtc::Thread* _workerThread;
+  rtc::Thread* _signalingThread;
+
   rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> _pcfactory;
+  std::unique_ptr<PortAllocatorFactory> _portAllocatorFactory;
+  /* nullptr if --certificate is "per-connection" */
+  std::unique_ptr<CertificateStore> _certificateStore;
+  /* lives on the main thread, nullptr if --ice-server-ranking is "off" */
+  std::unique_ptr<IceServerProber> _iceServerProber;
+  /* only accessed on the signaling thread, nullptr if --pc-pool-size is 0 */
+  std::unique_ptr<PeerConnectionPool> _peerConnectionPool;
   GPGNetServer _gpgnetServer;
   JsonRpcServer _jsonRpcServer;
   std::queue<IceAdapterGameTask> _gameTasks;
@@ -118,6 +250,30 @@ protected:
   std::string _lobbyInitMode;
   int _lobbyPort;
 
+  RelaySetupStats _singleRelaySetup;
+  RelaySetupStats _bulkRelaySetup;
+  Json::Value _lastBulkConnect;
+  /* only accessed on the signaling thread */
+  std::vector<RelaySetupBatch> _relaySetupBatches;
+  bool _relaySetupCheckScheduled;
+
+  /* bumped on every change of _statusSummary() */
+  uint64_t _statusRevision;
+  /* one per JSON-RPC client that called subscribeStatus */
+  std::map<rtc::AsyncSocket*, StatusSubscriber> _statusSubscribers;
+
+  /* In "dedicated" threading mode the relays are serialized on the signaling thread in between
+     forwarding game packets. status() returns the last snapshot and requests a new one
+     instead of blocking the main thread until the signaling thread is done. */
+  mutable std::mutex _relaysSnapshotMutex;
+  mutable Json::Value _relaysSnapshot;
+  mutable std::chrono::steady_clock::time_point _relaysSnapshotTime;
+  mutable std::atomic<bool> _relaysSnapshotPending;
+  mutable rtc::AsyncInvoker _statusInvoker;
+
+  /* must be destroyed first to cancel pending calls into the adapter */
+  rtc::AsyncInvoker _invoker;
+
   RTC_DISALLOW_COPY_AND_ASSIGN(IceAdapter);
 };
 
@@ -12,7 +12,42 @@ IceAdapterOptions::IceAdapterOptions():
   rpcPort(7236),
   gpgNetPort(0),
   gameUdpPort(0),
-  logLevel("info")
+  logLevel("info"),
+  gameRecvBatchSize(32),
+  relayRingDepth(512),
+  sctpHighWaterMark(65536),
+  congestionPolicy("drop-oldest"),
+  congestionNotifyMs(1000),
+  aggregationWindowUs(0),
+  fec("off"),
+  fecGroupSize(4),
+  redundantPath("off"),
+  iceRestartTimeoutMs(5000),
+  reconnectNewTimeoutMs(10000),
+  reconnectCheckingTimeoutMs(10000),
+  reconnectDisconnectedTimeoutMs(5000),
+  reconnectBackoffMs(1000),
+  reconnectBackoffMaxMs(30000),
+  pathMigration("off"),
+  pathMigrationMinGainMs(20),
+  pathMigrationCooldownMs(30000),
+  pathMigrationSamples(3),
+  connectAttemptHistory(8),
+  statsIntervalMs(1000),
+  statsHistorySize(300),
+  iceBatchWindowMs(0),
+  certificate("shared"),
+  certificateDirectory(""),
+  gathering("default"),
+  iceServerRanking("order"),
+  iceServerProbeTimeoutMs(2000),
+  statusMinIntervalMs(100),
+  peerConnectionPoolSize(0),
+  preconnectBufferSize(0),
+  preconnectBufferMs(3000),
+  threading("single"),
+  transport("sctp"),
+  rtpDataBandwidthKbps(1000)
 {
 }
 
@@ -30,6 +65,41 @@ IceAdapterOptions IceAdapterOptions::init(int argc, char *argv[])
     ("lobby-port", "set the port the game lobby should use for incoming UDP packets from the PeerRelay. Set to 0 to use an automatic port.", cxxopts::value<int>(result.gameUdpPort))
     ("log-directory", "log to specified directory", cxxopts::value<std::string>(result.logDirectory))
     ("log-level", "set logging verbosity level: error, warn, info, verbose or debug", cxxopts::value<std::string>(result.logLevel))
+    ("game-recv-batch", "set the maximum number of game UDP datagrams a PeerRelay reads per wakeup (1-1024). Set to 1 to disable batching.", cxxopts::value<int>(result.gameRecvBatchSize))
+    ("relay-ring-depth", "set the number of packets buffered per direction between a PeerRelay game socket and its data channel (1-65536)", cxxopts::value<int>(result.relayRingDepth))
+    ("sctp-high-water", "set the data channel buffered amount in bytes above which a peer is considered congested. Set to 0 to disable backpressure.", cxxopts::value<int>(result.sctpHighWaterMark))
+    ("congestion-policy", "set which game packets to drop while a peer is congested: \"drop-oldest\" or \"drop-new\"", cxxopts::value<std::string>(result.congestionPolicy))
+    ("congestion-notify-ms", "set the time in ms a peer must stay congested before the client is notified. Set to 0 to notify at once.", cxxopts::value<int>(result.congestionNotifyMs))
+    ("preconnect-buffer", "set the number of game packets a PeerRelay holds until the connection to the peer is established, rounded up to a power of two (0-65536). Set to 0 to drop them.", cxxopts::value<int>(result.preconnectBufferSize))
+    ("preconnect-buffer-ms", "set the maximum age in ms of game packets held until the connection to the peer is established", cxxopts::value<int>(result.preconnectBufferMs))
+    ("threading", "set the threading mode: \"single\" runs everything on one thread, \"dedicated\" runs WebRTC networking and the PeerRelays on their own threads", cxxopts::value<std::string>(result.threading))
+    ("transport", "set the preferred transport for game data: \"sctp\" uses SCTP data channels, \"rtp\" sends game packets as SRTP over the ICE connection if the peer supports it", cxxopts::value<std::string>(result.transport))
+    ("rtp-data-bandwidth", "set the bandwidth in kbit/s of the RTP transport per peer", cxxopts::value<int>(result.rtpDataBandwidthKbps))
+    ("aggregation-window-us", "set the time in µs game packets are collected into one message to the peer if it supports aggregation. Windows below 1000 are waited out with a 1 ms timer. Set to 0 to send every packet on its own.", cxxopts::value<int>(result.aggregationWindowUs))
+    ("fec", "set forward error correction for game packets: \"off\", \"on\" with a fixed group size or \"auto\" to follow the loss rate of the peer", cxxopts::value<std::string>(result.fec))
+    ("fec-group-size", "set the number of messages protected by one parity message if fec is \"on\" (1-64)", cxxopts::value<int>(result.fecGroupSize))
+    ("redundant-path", "set if game packets are also sent over a second, TURN relayed connection: \"off\", \"manual\" for peers enabled with setRedundancy or \"all\" peers", cxxopts::value<std::string>(result.redundantPath))
+    ("ice-restart-timeout-ms", "set the time in ms an ICE restart after a failed connection may take before the PeerConnection is recreated", cxxopts::value<int>(result.iceRestartTimeoutMs))
+    ("reconnect-new-timeout-ms", "set the time in ms a connection attempt may stay in ICE state \"new\" before it is recreated. Set to 0 to wait forever.", cxxopts::value<int>(result.reconnectNewTimeoutMs))
+    ("reconnect-checking-timeout-ms", "set the time in ms a connection attempt may stay in ICE state \"checking\" before it is recreated. Set to 0 to wait forever.", cxxopts::value<int>(result.reconnectCheckingTimeoutMs))
+    ("reconnect-disconnected-timeout-ms", "set the time in ms a connection may stay in ICE state \"disconnected\" before it is recovered. Set to 0 to wait forever.", cxxopts::value<int>(result.reconnectDisconnectedTimeoutMs))
+    ("reconnect-backoff-ms", "set the delay in ms before recreating a failed connection, doubled for every consecutive attempt", cxxopts::value<int>(result.reconnectBackoffMs))
+    ("reconnect-backoff-max-ms", "set the maximum delay in ms before recreating a failed connection", cxxopts::value<int>(result.reconnectBackoffMaxMs))
+    ("pc-pool-size", "set the number of PeerConnections created ahead of time, so new peers connect faster. Set to 0 to create them on demand.", cxxopts::value<int>(result.peerConnectionPoolSize))
+    ("ice-batch-window-ms", "set the time in ms local ICE candidates are collected into one onIceMsgBatch notification, or until candidate gathering completes. Set to 0 to send every candidate in its own onIceMsg.", cxxopts::value<int>(result.iceBatchWindowMs))
+    ("connect-attempt-history", "set the number of connection attempts per peer whose phase timestamps are kept for the status", cxxopts::value<int>(result.connectAttemptHistory))
+    ("path-migration", "set if connections selected on a TURN relay move to a faster direct candidate pair: \"off\" or \"on\". Requires --stats-interval-ms.", cxxopts::value<std::string>(result.pathMigration))
+    ("path-migration-min-gain-ms", "set the RTT in ms a direct candidate pair must be faster than the relayed one to migrate", cxxopts::value<int>(result.pathMigrationMinGainMs))
+    ("path-migration-cooldown-ms", "set the time in ms between path migrations and after any candidate pair switch", cxxopts::value<int>(result.pathMigrationCooldownMs))
+    ("path-migration-samples", "set the number of consecutive stats samples a direct candidate pair must be faster to migrate", cxxopts::value<int>(result.pathMigrationSamples))
+    ("stats-interval-ms", "set the interval in ms the connection to every peer is sampled for relayStats. Set to 0 to disable sampling.", cxxopts::value<int>(result.statsIntervalMs))
+    ("stats-history", "set the number of connection samples kept per peer for relayStats", cxxopts::value<int>(result.statsHistorySize))
+    ("certificate", "set the DTLS certificate mode: \"shared\" generates one ECDSA certificate for all peers, \"per-connection\" lets every PeerConnection generate its own", cxxopts::value<std::string>(result.certificate))
+    ("certificate-directory", "set a private directory the shared certificate and its key are cached in, readable by the owner only. Without it the certificate is kept in memory.", cxxopts::value<std::string>(result.certificateDirectory))
+    ("gathering", "set the candidate gathering mode: \"default\" or \"shared\", where all relays gather from one STUN server without TCP candidates and with pruned TURN ports", cxxopts::value<std::string>(result.gathering))
+    ("ice-server-ranking", "set how the ICE servers of setIceServers are probed: \"off\", \"probe\" only measures them, \"order\" sorts them by RTT or \"prune\" also tries TURN allocations and drops unreachable servers and failed allocations", cxxopts::value<std::string>(result.iceServerRanking))
+    ("ice-server-probe-timeout-ms", "set the time in ms the ICE servers are probed before unanswered servers count as unreachable", cxxopts::value<int>(result.iceServerProbeTimeoutMs))
+    ("status-min-interval-ms", "set the minimum time in ms between two onStatusDelta notifications, subscribeStatus intervals below it are raised to it", cxxopts::value<int>(result.statusMinIntervalMs))
     ;
 
   options.parse(argc, argv);
@@ -51,6 +121,191 @@ IceAdapterOptions IceAdapterOptions::init(int argc, char *argv[])
     std::cout << options.help() << std::endl;
     std::exit(1);
   }
+  if (result.congestionPolicy != "drop-oldest" &&
+      result.congestionPolicy != "drop-new")
+  {
+    std::cerr << "argument congestion-policy must be \"drop-oldest\" or \"drop-new\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.threading != "single" &&
+      result.threading != "dedicated")
+  {
+    std::cerr << "argument threading must be \"single\" or \"dedicated\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.transport != "sctp" &&
+      result.transport != "rtp")
+  {
+    std::cerr << "argument transport must be \"sctp\" or \"rtp\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.fec != "off" &&
+      result.fec != "on" &&
+      result.fec != "auto")
+  {
+    std::cerr << "argument fec must be \"off\", \"on\" or \"auto\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.redundantPath != "off" &&
+      result.redundantPath != "manual" &&
+      result.redundantPath != "all")
+  {
+    std::cerr << "argument redundant-path must be \"off\", \"manual\" or \"all\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.certificate != "shared" &&
+      result.certificate != "per-connection")
+  {
+    std::cerr << "argument certificate must be \"shared\" or \"per-connection\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.gathering != "default" &&
+      result.gathering != "shared")
+  {
+    std::cerr << "argument gathering must be \"default\" or \"shared\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.iceServerRanking != "off" &&
+      result.iceServerRanking != "probe" &&
+      result.iceServerRanking != "order" &&
+      result.iceServerRanking != "prune")
+  {
+    std::cerr << "argument ice-server-ranking must be \"off\", \"probe\", \"order\" or \"prune\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.iceServerProbeTimeoutMs < 1)
+  {
+    std::cerr << "argument ice-server-probe-timeout-ms must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.statusMinIntervalMs < 1)
+  {
+    std::cerr << "argument status-min-interval-ms must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.pathMigration != "off" &&
+      result.pathMigration != "on")
+  {
+    std::cerr << "argument path-migration must be \"off\" or \"on\"" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.connectAttemptHistory < 1)
+  {
+    std::cerr << "argument connect-attempt-history must be at least 1" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.statsHistorySize < 1)
+  {
+    std::cerr << "argument stats-history must be at least 1" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.fecGroupSize < 1 ||
+      result.fecGroupSize > 64)
+  {
+    std::cerr << "argument fec-group-size must be between 1 and 64" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.gameRecvBatchSize < 1 ||
+      result.gameRecvBatchSize > 1024)
+  {
+    std::cerr << "argument game-recv-batch must be between 1 and 1024" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.relayRingDepth < 1 ||
+      result.relayRingDepth > 65536)
+  {
+    std::cerr << "argument relay-ring-depth must be between 1 and 65536" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.preconnectBufferSize < 0 ||
+      result.preconnectBufferSize > 65536)
+  {
+    std::cerr << "argument preconnect-buffer must be between 0 and 65536" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.congestionNotifyMs < 0)
+  {
+    std::cerr << "argument congestion-notify-ms must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.preconnectBufferMs < 1)
+  {
+    std::cerr << "argument preconnect-buffer-ms must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.rtpDataBandwidthKbps < 1)
+  {
+    std::cerr << "argument rtp-data-bandwidth must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.aggregationWindowUs < 0)
+  {
+    std::cerr << "argument aggregation-window-us must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.iceRestartTimeoutMs < 1)
+  {
+    std::cerr << "argument ice-restart-timeout-ms must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.reconnectNewTimeoutMs < 0)
+  {
+    std::cerr << "argument reconnect-new-timeout-ms must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.reconnectCheckingTimeoutMs < 0)
+  {
+    std::cerr << "argument reconnect-checking-timeout-ms must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.reconnectDisconnectedTimeoutMs < 0)
+  {
+    std::cerr << "argument reconnect-disconnected-timeout-ms must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.reconnectBackoffMs < 1)
+  {
+    std::cerr << "argument reconnect-backoff-ms must be positive" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.reconnectBackoffMaxMs < result.reconnectBackoffMs)
+  {
+    std::cerr << "argument reconnect-backoff-max-ms must be at least reconnect-backoff-ms" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
+  if (result.iceBatchWindowMs < 0)
+  {
+    std::cerr << "argument ice-batch-window-ms must not be negative" << std::endl;
+    std::cout << options.help() << std::endl;
+    std::exit(1);
+  }
 
   return result;
 }
@@ -17,6 +17,41 @@ public:
   int gameUdpPort;        /*!< UDP port the game should use to communicate to the internal Relays */
   std::string logDirectory;    /*!< an optional file loggin directory, default: "" - no file log */
   std::string logLevel;   /*!< logging verbosity level, default: "debug"*/
+  int gameRecvBatchSize;  /*!< maximum number of game datagrams a PeerRelay reads per socket wakeup, default: 32 */
+  int relayRingDepth;     /*!< number of packets buffered per direction between a PeerRelay game socket and its data channel, default: 512 */
+  int sctpHighWaterMark;  /*!< data channel buffered amount in bytes above which a PeerRelay considers the peer congested, 0 disables backpressure, default: 65536 */
+  std::string congestionPolicy; /*!< "drop-oldest" or "drop-new" game packets while the peer is congested, default: "drop-oldest" */
+  int congestionNotifyMs; /*!< time a peer must stay congested before "onPeerCongested" is sent, default: 1000 */
+  int aggregationWindowUs; /*!< time in µs a PeerRelay collects game packets into one data channel message, 0 disables aggregation, default: 0 */
+  std::string fec;        /*!< forward error correction for game packets to the peer: "off", "on" with a fixed group size or "auto" tuned from the loss rate, default: "off" */
+  int fecGroupSize;       /*!< number of messages per XOR parity message if fec is "on", default: 4 */
+  std::string redundantPath; /*!< second, TURN relayed connection to peers carrying copies of game packets: "off", "manual" per peer via setRedundancy or "all" peers, default: "off" */
+  int iceRestartTimeoutMs; /*!< time in ms an ICE restart after a failed connection may take before the PeerConnection is recreated, default: 5000 */
+  int reconnectNewTimeoutMs; /*!< time in ms a connection attempt may stay in ICE state "new" before the offerer recreates it, 0 waits forever, default: 10000 */
+  int reconnectCheckingTimeoutMs; /*!< time in ms a connection attempt may stay in ICE state "checking" before the offerer recreates it, 0 waits forever, default: 10000 */
+  int reconnectDisconnectedTimeoutMs; /*!< time in ms a connection may stay in ICE state "disconnected" before the offerer recovers it, 0 waits forever, default: 5000 */
+  int reconnectBackoffMs; /*!< delay in ms before the first of consecutive PeerConnection rebuilds, doubled for every further one, default: 1000 */
+  int reconnectBackoffMaxMs; /*!< maximum delay in ms between consecutive PeerConnection rebuilds, default: 30000 */
+  std::string pathMigration; /*!< "on" moves connections selected on a TURN relay to a faster direct candidate pair, "off" only reports pair switches, default: "off" */
+  int pathMigrationMinGainMs; /*!< RTT in ms a direct pair must be faster than the relayed one, default: 20 */
+  int pathMigrationCooldownMs; /*!< time in ms between path migrations and after any pair switch, default: 30000 */
+  int pathMigrationSamples; /*!< number of consecutive stats samples the direct pair must be faster, default: 3 */
+  int connectAttemptHistory; /*!< number of connection attempts per PeerRelay whose phase timestamps are kept for the status, default: 8 */
+  int statsIntervalMs; /*!< interval in ms of the connection samples kept for relayStats, 0 disables sampling, default: 1000 */
+  int statsHistorySize; /*!< number of connection samples kept per PeerRelay, default: 300 */
+  int iceBatchWindowMs; /*!< time in ms trickle candidates are collected into one onIceMsgBatch notification, 0 sends every candidate on its own, default: 0 */
+  std::string certificate; /*!< "shared" DTLS certificate for all PeerConnections or "per-connection", default: "shared" */
+  std::string certificateDirectory; /*!< directory the shared certificate and its private key are cached in, "" keeps it in memory, default: "" */
+  std::string gathering; /*!< candidate gathering of the PeerRelays: "default" or "shared" with one STUN server, no TCP candidates and pruned TURN ports, default: "default" */
+  std::string iceServerRanking; /*!< probing of the servers of setIceServers: "off", "probe" only reports, "order" sorts them by RTT, "prune" also drops unreachable ones, default: "order" */
+  int iceServerProbeTimeoutMs; /*!< time in ms the ICE servers are probed before unanswered ones count as unreachable, default: 2000 */
+  int statusMinIntervalMs; /*!< minimum time in ms between two onStatusDelta notifications of subscribeStatus, default: 100 */
+  int peerConnectionPoolSize; /*!< number of PeerConnections created ahead of time after setIceServers, 0 disables the pool, default: 0 */
+  int preconnectBufferSize; /*!< number of game packets a PeerRelay holds until its data channel opens, rounded up to a power of two, 0 drops them, default: 0 */
+  int preconnectBufferMs; /*!< maximum age in ms of game packets held until the data channel opens, default: 3000 */
+  std::string threading;  /*!< "single" runs everything on the main thread, "dedicated" starts separate WebRTC network, worker and signaling threads, default: "single" */
+  std::string transport;  /*!< preferred transport for game data: "sctp" data channels or "rtp" data channels without SCTP, the peers agree on one per connection, default: "sctp" */
+  int rtpDataBandwidthKbps; /*!< bandwidth in kbit/s a PeerRelay allows for its RTP data channel, default: 1000 */
 
   /** \brief Create an options object from cmd arguments
       */
@@ -0,0 +1,540 @@
+#include "IceServerProber.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <webrtc/p2p/base/stun.h>
+#include <webrtc/rtc_base/bytebuffer.h>
+#include <webrtc/rtc_base/helpers.h>
+#include <webrtc/rtc_base/ptr_util.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include "logging.h"
+
+namespace faf {
+
+/* how often unanswered requests are sent again */
+static constexpr int probeTickMs = 100;
+static constexpr int retransmitMs = 500;
+
+static double toMs(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.;
+}
+
+IceServerProber::IceServerProber(int timeoutMs, std::string const& ranking):
+  _timeoutMs(timeoutMs),
+  _ranking(ranking),
+  _probing(false),
+  _duration(std::chrono::steady_clock::duration::zero())
+{
+}
+
+IceServerProber::~IceServerProber()
+{
+  _timer.stop();
+}
+
+IceServerProber::Probe::~Probe()
+{
+  if (resolver)
+  {
+    resolver->Destroy(false);
+  }
+}
+
+void IceServerProber::probe(webrtc::PeerConnectionInterface::IceServers const& servers, RankedCallback cb)
+{
+  _timer.stop();
+  _probes.clear();
+  _servers = servers;
+  _callback = cb;
+  _pruned.assign(_servers.size(), false);
+  _bestRttMs.assign(_servers.size(), -1.);
+  _order.clear();
+  _probing = true;
+  _startedAt = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < _servers.size(); ++i)
+  {
+    auto urls = _servers[i].urls;
+    if (!_servers[i].uri.empty())
+    {
+      urls.push_back(_servers[i].uri);
+    }
+    for (auto const& url : urls)
+    {
+      std::string host;
+      int port;
+      bool turn;
+      bool udp;
+      if (!parseUrl(url, host, port, turn, udp))
+      {
+        continue;
+      }
+      auto probe = std::make_unique<Probe>();
+      probe->serverIndex = i;
+      probe->url = url;
+      probe->turn = turn;
+      probe->allocate = turn && _ranking == "prune";
+      probe->username = _servers[i].username;
+      probe->password = _servers[i].password;
+      probe->allocation = probe->allocate ? "pending" : "";
+      probe->state = "resolving";
+      rtc::SocketAddress address(host, port);
+      if (!udp)
+      {
+        probe->state = "skipped";
+        probe->allocation.clear();
+      }
+      else if (address.IsUnresolvedIP())
+      {
+        probe->resolver = new rtc::AsyncResolver();
+        probe->resolver->SignalDone.connect(this, &IceServerProber::_onResolved);
+        probe->resolver->Start(address);
+      }
+      else
+      {
+        _connect(*probe, address);
+      }
+      _probes.push_back(std::move(probe));
+    }
+  }
+  _timer.start(probeTickMs, std::bind(&IceServerProber::_onTimer, this));
+  _onTimer();
+}
+
+Json::Value IceServerProber::status() const
+{
+  Json::Value result;
+  result["ranking"] = _ranking;
+  result["state"] = _probing ? "probing" : (_servers.empty() ? "idle" : "done");
+  result["duration_ms"] = toMs(_duration);
+  result["servers"] = Json::Value(Json::arrayValue);
+  for (std::size_t i = 0; i < _servers.size(); ++i)
+  {
+    Json::Value server;
+    server["urls"] = Json::Value(Json::arrayValue);
+    for (auto const& url : _servers[i].urls)
+    {
+      server["urls"].append(url);
+    }
+    auto rank = std::find(_order.begin(), _order.end(), i);
+    server["rank"] = rank == _order.end() ? -1 : static_cast<int>(rank - _order.begin());
+    server["pruned"] = i < _pruned.size() && _pruned[i];
+    server["rtt_ms"] = i < _bestRttMs.size() ? _bestRttMs[i] : -1.;
+    server["probes"] = Json::Value(Json::arrayValue);
+    for (auto const& probe : _probes)
+    {
+      if (probe->serverIndex != i)
+      {
+        continue;
+      }
+      Json::Value probeJson;
+      probeJson["url"] = probe->url;
+      probeJson["state"] = probe->state;
+      probeJson["rtt_ms"] = probe->rttMs;
+      probeJson["allocation"] = probe->allocation;
+      server["probes"].append(probeJson);
+    }
+    result["servers"].append(server);
+  }
+  return result;
+}
+
+bool IceServerProber::parseUrl(std::string const& url,
+                               std::string& host,
+                               int& port,
+                               bool& turn,
+                               bool& udp)
+{
+  auto colon = url.find(':');
+  if (colon == std::string::npos)
+  {
+    return false;
+  }
+  auto scheme = url.substr(0, colon);
+  if (scheme != "stun" &&
+      scheme != "stuns" &&
+      scheme != "turn" &&
+      scheme != "turns")
+  {
+    return false;
+  }
+  turn = scheme.compare(0, 4, "turn") == 0;
+  bool secure = scheme.back() == 's';
+  udp = !secure;
+  port = secure ? 5349 : 3478;
+  auto rest = url.substr(colon + 1);
+  auto query = rest.find('?');
+  if (query != std::string::npos)
+  {
+    if (rest.find("transport=tcp", query) != std::string::npos)
+    {
+      udp = false;
+    }
+    rest = rest.substr(0, query);
+  }
+  host = rest;
+  if (!rest.empty() &&
+      rest[0] == '[')
+  {
+    auto end = rest.find(']');
+    if (end == std::string::npos)
+    {
+      return false;
+    }
+    host = rest.substr(1, end - 1);
+    if (end + 1 < rest.size() &&
+        rest[end + 1] == ':')
+    {
+      port = std::atoi(rest.c_str() + end + 2);
+    }
+  }
+  else
+  {
+    auto portColon = rest.rfind(':');
+    if (portColon != std::string::npos)
+    {
+      host = rest.substr(0, portColon);
+      port = std::atoi(rest.c_str() + portColon + 1);
+    }
+  }
+  return !host.empty() &&
+         port > 0 &&
+         port < 65536;
+}
+
+void IceServerProber::_connect(Probe& probe, rtc::SocketAddress const& address)
+{
+  probe.socket.reset(rtc::Thread::Current()->socketserver()->CreateAsyncSocket(address.family(), SOCK_DGRAM));
+  if (!probe.socket ||
+      probe.socket->Connect(address) != 0)
+  {
+    probe.state = "error";
+    if (probe.allocate)
+    {
+      probe.allocation = "failed";
+    }
+    return;
+  }
+  probe.socket->SignalReadEvent.connect(this, &IceServerProber::_onRead);
+  probe.socket->SignalCloseEvent.connect(this, &IceServerProber::_onClose);
+}
+
+void IceServerProber::_onResolved(rtc::AsyncResolverInterface* resolver)
+{
+  auto probe = std::find_if(_probes.begin(), _probes.end(), [resolver](std::unique_ptr<Probe> const& probe)
+  {
+    return probe->resolver == resolver;
+  });
+  if (probe == _probes.end() ||
+      _done(**probe))
+  {
+    return;
+  }
+  /* like WebRTC, prefer IPv4 if the host has both */
+  rtc::SocketAddress address;
+  if (resolver->GetError() != 0 ||
+      (!resolver->GetResolvedAddress(AF_INET, &address) &&
+       !resolver->GetResolvedAddress(AF_INET6, &address)))
+  {
+    FAF_LOG_DEBUG << "resolving ICE server " << (*probe)->url << " failed";
+    (*probe)->state = "unreachable";
+    if ((*probe)->allocate)
+    {
+      (*probe)->allocation = "failed";
+    }
+    return;
+  }
+  _connect(**probe, address);
+}
+
+void IceServerProber::_onTimer()
+{
+  auto now = std::chrono::steady_clock::now();
+  bool timedOut = now - _startedAt >= std::chrono::milliseconds(_timeoutMs);
+  for (auto& probe : _probes)
+  {
+    if (_done(*probe))
+    {
+      continue;
+    }
+    if (timedOut)
+    {
+      /* a TURN server that answered the first request is reachable, only its allocation failed */
+      if (probe->state == "allocating")
+      {
+        probe->state = "ok";
+        probe->allocation = "failed";
+      }
+      else
+      {
+        probe->state = "unreachable";
+        if (probe->allocate)
+        {
+          probe->allocation = "failed";
+        }
+      }
+    }
+    else if (probe->state == "resolving" &&
+             probe->socket &&
+             probe->socket->GetState() == rtc::AsyncSocket::CS_CONNECTED)
+    {
+      probe->state = "binding";
+      _send(*probe, probe->turn ? cricket::TURN_ALLOCATE_REQUEST : cricket::STUN_BINDING_REQUEST);
+    }
+    else if (probe->state != "resolving" &&
+             now - probe->sentAt >= std::chrono::milliseconds(retransmitMs))
+    {
+      _transmit(*probe);
+    }
+  }
+  if (_probing &&
+      std::all_of(_probes.begin(), _probes.end(), [this](std::unique_ptr<Probe> const& probe) { return _done(*probe); }))
+  {
+    _finish();
+  }
+}
+
+void IceServerProber::_onRead(rtc::AsyncSocket* socket)
+{
+  auto probe = std::find_if(_probes.begin(), _probes.end(), [socket](std::unique_ptr<Probe> const& probe)
+  {
+    return probe->socket.get() == socket;
+  });
+  if (probe == _probes.end())
+  {
+    return;
+  }
+  char buffer[2048];
+  int length;
+  while ((length = socket->Recv(buffer, sizeof(buffer), nullptr)) > 0)
+  {
+    _onResponse(**probe, buffer, static_cast<std::size_t>(length));
+  }
+  if (_probing &&
+      std::all_of(_probes.begin(), _probes.end(), [this](std::unique_ptr<Probe> const& probe) { return _done(*probe); }))
+  {
+    _finish();
+  }
+}
+
+void IceServerProber::_onClose(rtc::AsyncSocket* socket, int error)
+{
+  for (auto& probe : _probes)
+  {
+    if (probe->socket.get() == socket &&
+        !_done(*probe))
+    {
+      FAF_LOG_DEBUG << "probing ICE server " << probe->url << " failed: " << error;
+      probe->state = "error";
+      if (probe->allocate)
+      {
+        probe->allocation = "failed";
+      }
+    }
+  }
+}
+
+void IceServerProber::_send(Probe& probe, int requestType)
+{
+  cricket::TurnMessage request;
+  request.SetType(requestType);
+  probe.transactionId = rtc::CreateRandomString(cricket::kStunTransactionIdLength);
+  request.SetTransactionID(probe.transactionId);
+  if (requestType == cricket::TURN_ALLOCATE_REQUEST)
+  {
+    request.AddAttribute(rtc::MakeUnique<cricket::StunUInt32Attribute>(cricket::STUN_ATTR_REQUESTED_TRANSPORT, IPPROTO_UDP << 24));
+  }
+  else if (requestType == cricket::TURN_REFRESH_REQUEST)
+  {
+    /* lifetime 0 releases the allocation */
+    request.AddAttribute(rtc::MakeUnique<cricket::StunUInt32Attribute>(cricket::STUN_ATTR_LIFETIME, 0));
+  }
+  if (!probe.nonce.empty())
+  {
+    request.AddAttribute(rtc::MakeUnique<cricket::StunByteStringAttribute>(cricket::STUN_ATTR_USERNAME, probe.username));
+    request.AddAttribute(rtc::MakeUnique<cricket::StunByteStringAttribute>(cricket::STUN_ATTR_REALM, probe.realm));
+    request.AddAttribute(rtc::MakeUnique<cricket::StunByteStringAttribute>(cricket::STUN_ATTR_NONCE, probe.nonce));
+    std::string key;
+    cricket::ComputeStunCredentialHash(probe.username, probe.realm, probe.password, &key);
+    request.AddMessageIntegrity(key);
+  }
+  rtc::ByteBufferWriter buffer;
+  request.Write(&buffer);
+  probe.request.assign(buffer.Data(), buffer.Length());
+  _transmit(probe);
+}
+
+void IceServerProber::_transmit(Probe& probe)
+{
+  probe.sentAt = std::chrono::steady_clock::now();
+  probe.socket->Send(probe.request.data(), probe.request.size());
+}
+
+void IceServerProber::_onResponse(Probe& probe, char const* data, std::size_t size)
+{
+  cricket::TurnMessage response;
+  rtc::ByteBufferReader reader(data, size);
+  if (!response.Read(&reader) ||
+      response.transaction_id() != probe.transactionId ||
+      _done(probe))
+  {
+    return;
+  }
+  if (probe.rttMs < 0)
+  {
+    probe.rttMs = toMs(std::chrono::steady_clock::now() - probe.sentAt);
+  }
+  if (!probe.turn)
+  {
+    probe.state = "ok";
+    return;
+  }
+  if (response.type() == cricket::TURN_ALLOCATE_RESPONSE)
+  {
+    probe.state = "ok";
+    probe.allocation = "ok";
+    _send(probe, cricket::TURN_REFRESH_REQUEST);
+    return;
+  }
+  if (response.type() != cricket::TURN_ALLOCATE_ERROR_RESPONSE)
+  {
+    return;
+  }
+  auto errorCode = response.GetErrorCode();
+  auto code = errorCode ? errorCode->code() : 0;
+  auto realm = response.GetByteString(cricket::STUN_ATTR_REALM);
+  auto nonce = response.GetByteString(cricket::STUN_ATTR_NONCE);
+  bool authenticated = !probe.nonce.empty();
+  /* the challenge of the unauthenticated request already measures the RTT */
+  if (!probe.allocate)
+  {
+    probe.state = "ok";
+    return;
+  }
+  /* the first allocation asks for the realm and nonce, a stale nonce is renewed */
+  if (((code == cricket::STUN_ERROR_UNAUTHORIZED && !authenticated) ||
+       code == cricket::STUN_ERROR_STALE_NONCE) &&
+      realm &&
+      nonce)
+  {
+    probe.realm = realm->GetString();
+    probe.nonce = nonce->GetString();
+    probe.state = "allocating";
+    _send(probe, cricket::TURN_ALLOCATE_REQUEST);
+    return;
+  }
+  probe.state = "ok";
+  probe.allocation = code == cricket::STUN_ERROR_UNAUTHORIZED ? "unauthorized" : "failed";
+}
+
+bool IceServerProber::_done(Probe const& probe) const
+{
+  return probe.state != "resolving" &&
+         probe.state != "binding" &&
+         probe.state != "allocating";
+}
+
+void IceServerProber::_finish()
+{
+  _probing = false;
+  _duration = std::chrono::steady_clock::now() - _startedAt;
+  _timer.stop();
+  auto rankedServers = _rank();
+  FAF_LOG_INFO << "probed " << _probes.size() << " ICE server URLs in " << toMs(_duration) << " ms, using " << rankedServers.size() << " of " << _servers.size() << " servers";
+  if (_callback)
+  {
+    auto callback = _callback;
+    _callback = RankedCallback();
+    callback(rankedServers);
+  }
+}
+
+webrtc::PeerConnectionInterface::IceServers IceServerProber::_rank()
+{
+  auto count = _servers.size();
+  std::vector<std::size_t> probed(count, 0);
+  std::vector<std::size_t> reachable(count, 0);
+  std::vector<std::size_t> skipped(count, 0);
+  std::vector<std::size_t> turnProbes(count, 0);
+  std::vector<std::size_t> turnAllocated(count, 0);
+  for (auto const& probe : _probes)
+  {
+    auto i = probe->serverIndex;
+    if (probe->state == "skipped")
+    {
+      ++skipped[i];
+      continue;
+    }
+    ++probed[i];
+    if (probe->state == "ok")
+    {
+      ++reachable[i];
+      if (probe->rttMs >= 0 &&
+          (_bestRttMs[i] < 0 || probe->rttMs < _bestRttMs[i]))
+      {
+        _bestRttMs[i] = probe->rttMs;
+      }
+    }
+    if (probe->allocate)
+    {
+      ++turnProbes[i];
+      if (probe->allocation == "ok")
+      {
+        ++turnAllocated[i];
+      }
+    }
+  }
+
+  if (_ranking == "prune")
+  {
+    bool anyKept = false;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      /* servers with unprobed TCP/TLS URLs may still be reachable over those */
+      _pruned[i] = (turnProbes[i] > 0 && turnAllocated[i] == 0) ||
+                   (probed[i] > 0 && reachable[i] == 0 && skipped[i] == 0);
+      anyKept = anyKept || !_pruned[i];
+    }
+    if (!anyKept)
+    {
+      FAF_LOG_WARN << "all ICE servers failed probing, keeping them";
+      _pruned.assign(count, false);
+    }
+  }
+
+  _order.clear();
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    _order.push_back(i);
+  }
+  if (_ranking != "probe")
+  {
+    /* measured servers by RTT first, then unprobed ones, unreachable ones last */
+    auto rankClass = [&](std::size_t i)
+    {
+      return _bestRttMs[i] >= 0 ? 0 : (probed[i] == 0 || skipped[i] > 0) ? 1 : 2;
+    };
+    std::stable_sort(_order.begin(), _order.end(), [&](std::size_t a, std::size_t b)
+    {
+      if (rankClass(a) != rankClass(b))
+      {
+        return rankClass(a) < rankClass(b);
+      }
+      return rankClass(a) == 0 && _bestRttMs[a] < _bestRttMs[b];
+    });
+  }
+
+  webrtc::PeerConnectionInterface::IceServers result;
+  for (auto i : _order)
+  {
+    if (!_pruned[i])
+    {
+      result.push_back(_servers[i]);
+    }
+  }
+  return result;
+}
+
+} // namespace faf
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/rtc_base/asyncsocket.h>
+#include <webrtc/rtc_base/nethelpers.h>
+#include <webrtc/rtc_base/sigslot.h>
+
+#include <third_party/json/json.h>
+
+#include "Timer.h"
+
+namespace faf {
+
+/*! \brief Measures the STUN binding RTT of the ICE servers set by the client and ranks the
+ *         servers by it. All UDP URLs are probed in parallel on the thread the prober was
+ *         created on. TCP and TLS URLs are kept unprobed. TURN allocations are only tried
+ *         when pruning, the other modes take the RTT of the unauthenticated allocate request.
+ */
+class IceServerProber : public sigslot::has_slots<>
+{
+public:
+  typedef std::function<void (webrtc::PeerConnectionInterface::IceServers const& rankedServers)> RankedCallback;
+
+  /** \param ranking: "probe" only reports, "order" sorts the servers by RTT,
+                      "prune" also drops unreachable servers and failed TURN allocations
+      */
+  IceServerProber(int timeoutMs, std::string const& ranking);
+  virtual ~IceServerProber();
+
+  /** \brief Probe servers, a probe still running is abandoned.
+       \param cb: called once with the ranked servers when all probes are answered or timed out
+      */
+  void probe(webrtc::PeerConnectionInterface::IceServers const& servers, RankedCallback cb);
+
+  Json::Value status() const;
+
+  /** \brief Split a "stun:" or "turn:" URL
+       \returns false if the URL is no STUN or TURN URL
+      */
+  static bool parseUrl(std::string const& url,
+                       std::string& host,
+                       int& port,
+                       bool& turn,
+                       bool& udp);
+
+protected:
+  struct Probe
+  {
+    ~Probe();
+
+    std::size_t serverIndex = 0;
+    std::string url;
+    bool turn = false;
+    /* only pruning needs to know whether the credentials work */
+    bool allocate = false;
+    /* "resolving", "binding", "allocating", "ok", "unreachable", "error" or "skipped" for TCP/TLS */
+    std::string state;
+    /* "ok", "unauthorized" if the credentials were rejected, "failed" or "" for STUN and unallocated TURN */
+    std::string allocation;
+    double rttMs = -1.;
+    std::string username;
+    std::string password;
+    std::string realm;
+    std::string nonce;
+    std::string transactionId;
+    /* the last request, sent again until it is answered */
+    std::string request;
+    std::chrono::steady_clock::time_point sentAt;
+    /* host names are resolved first, so the socket gets the family of the server address */
+    rtc::AsyncResolver* resolver = nullptr;
+    std::unique_ptr<rtc::AsyncSocket> socket;
+  };
+
+  void _connect(Probe& probe, rtc::SocketAddress const& address);
+  void _onResolved(rtc::AsyncResolverInterface* resolver);
+  void _onTimer();
+  void _onRead(rtc::AsyncSocket* socket);
+  void _onClose(rtc::AsyncSocket* socket, int error);
+  void _send(Probe& probe, int requestType);
+  void _transmit(Probe& probe);
+  void _onResponse(Probe& probe, char const* data, std::size_t size);
+  bool _done(Probe const& probe) const;
+  void _finish();
+  webrtc::PeerConnectionInterface::IceServers _rank();
+
+  int _timeoutMs;
+  std::string _ranking;
+  webrtc::PeerConnectionInterface::IceServers _servers;
+  std::vector<std::unique_ptr<Probe>> _probes;
+  std::vector<bool> _pruned;
+  std::vector<double> _bestRttMs;
+  std::vector<std::size_t> _order;
+  RankedCallback _callback;
+  bool _probing;
+  std::chrono::steady_clock::time_point _startedAt;
+  std::chrono::steady_clock::duration _duration;
+  Timer _timer;
+
+  RTC_DISALLOW_COPY_AND_ASSIGN(IceServerProber);
+};
+
+} // namespace faf
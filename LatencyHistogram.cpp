@@ -0,0 +1,65 @@
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+#include <string>
+
+namespace faf {
+
+/* upper bucket limits in microseconds, the last bucket takes everything above */
+std::array<int64_t, LatencyHistogram::numBuckets - 1> const LatencyHistogram::_bucketLimitsUs = {
+  10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000
+};
+
+LatencyHistogram::LatencyHistogram():
+  _count(0),
+  _sumUs(0),
+  _maxUs(0)
+{
+  for (auto& bucket : _buckets)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::add(std::chrono::steady_clock::duration duration)
+{
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  std::size_t bucket = 0;
+  while (bucket < _bucketLimitsUs.size() &&
+         us >= _bucketLimitsUs[bucket])
+  {
+    ++bucket;
+  }
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sumUs.fetch_add(us, std::memory_order_relaxed);
+  /* only the adding thread writes the maximum */
+  if (us > _maxUs.load(std::memory_order_relaxed))
+  {
+    _maxUs.store(us, std::memory_order_relaxed);
+  }
+}
+
+uint64_t LatencyHistogram::count() const
+{
+  return _count.load(std::memory_order_relaxed);
+}
+
+Json::Value LatencyHistogram::status() const
+{
+  Json::Value result;
+  auto count = _count.load(std::memory_order_relaxed);
+  result["count"] = static_cast<Json::UInt64>(count);
+  result["mean_us"] = count > 0 ? static_cast<double>(_sumUs.load(std::memory_order_relaxed)) / count : 0.;
+  result["max_us"] = static_cast<Json::Int64>(_maxUs.load(std::memory_order_relaxed));
+  Json::Value buckets;
+  for (std::size_t i = 0; i < _bucketLimitsUs.size(); ++i)
+  {
+    buckets["<" + std::to_string(_bucketLimitsUs[i])] = static_cast<Json::UInt64>(_buckets[i].load(std::memory_order_relaxed));
+  }
+  buckets[">=" + std::to_string(_bucketLimitsUs.back())] = static_cast<Json::UInt64>(_buckets.back().load(std::memory_order_relaxed));
+  result["buckets_us"] = buckets;
+  return result;
+}
+
+} // namespace faf
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief Fixed-bucket histogram of short durations, e.g. the time a packet spends inside a PeerRelay.
+ *         Recording a sample is a few comparisons and never allocates. Samples are added by one
+ *         thread, status() may be read from any other thread.
+ */
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+
+  void add(std::chrono::steady_clock::duration duration);
+
+  uint64_t count() const;
+
+  Json::Value status() const;
+
+protected:
+  static constexpr std::size_t numBuckets = 12;
+  static std::array<int64_t, numBuckets - 1> const _bucketLimitsUs;
+
+  std::array<std::atomic<uint64_t>, numBuckets> _buckets;
+  std::atomic<uint64_t> _count;
+  std::atomic<int64_t> _sumUs;
+  std::atomic<int64_t> _maxUs;
+};
+
+} // namespace faf
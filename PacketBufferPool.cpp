@@ -0,0 +1,56 @@
+#include "PacketBufferPool.h"
+
+#include <algorithm>
+
+namespace faf {
+
+PacketBufferPool::PacketBufferPool(std::size_t poolSize, std::size_t bufferCapacity):
+  _capacity(bufferCapacity),
+  _next(0),
+  _acquisitions(0),
+  _allocations(0)
+{
+  _buffers.reserve(std::max<std::size_t>(poolSize, 1));
+  for (std::size_t i = 0; i < std::max<std::size_t>(poolSize, 1); ++i)
+  {
+    _buffers.emplace_back(_capacity, _capacity);
+  }
+}
+
+rtc::CopyOnWriteBuffer& PacketBufferPool::acquire()
+{
+  auto& buffer = _buffers[_next];
+  _next = (_next + 1) % _buffers.size();
+  _acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+  /* The non-const data() accessor clones the storage if it is still shared.
+     A changed address means the slot had to allocate. */
+  auto previousData = buffer.cdata();
+  if (buffer.data() != previousData)
+  {
+    _allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  buffer.SetSize(_capacity);
+  return buffer;
+}
+
+std::size_t PacketBufferPool::capacity() const
+{
+  return _capacity;
+}
+
+uint64_t PacketBufferPool::allocations() const
+{
+  return _allocations.load(std::memory_order_relaxed);
+}
+
+Json::Value PacketBufferPool::status() const
+{
+  Json::Value result;
+  result["size"] = static_cast<Json::UInt64>(_buffers.size());
+  result["acquisitions"] = static_cast<Json::UInt64>(_acquisitions.load(std::memory_order_relaxed));
+  result["allocations"] = static_cast<Json::UInt64>(_allocations.load(std::memory_order_relaxed));
+  return result;
+}
+
+} // namespace faf
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include <webrtc/rtc_base/copyonwritebuffer.h>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief A ring of reusable, ref-counted packet buffers.
+ *         acquire() hands out a buffer that can be written in place. The storage of a
+ *         slot is only reallocated while an earlier user (e.g. the SCTP send queue) still
+ *         holds a reference to it, which is counted as an allocation. The counters may be
+ *         read from any thread.
+ */
+class PacketBufferPool
+{
+public:
+  PacketBufferPool(std::size_t poolSize, std::size_t bufferCapacity);
+
+  /** \brief Get the next buffer of the pool, sized to capacity() bytes and uniquely owned
+      */
+  rtc::CopyOnWriteBuffer& acquire();
+
+  std::size_t capacity() const;
+
+  /** \brief The number of buffer allocations after the pool was created */
+  uint64_t allocations() const;
+
+  Json::Value status() const;
+
+protected:
+  std::vector<rtc::CopyOnWriteBuffer> _buffers;
+  std::size_t _capacity;
+  std::size_t _next;
+  std::atomic<uint64_t> _acquisitions;
+  std::atomic<uint64_t> _allocations;
+};
+
+} // namespace faf
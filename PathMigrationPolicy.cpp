@@ -0,0 +1,132 @@
+#include "PathMigrationPolicy.h"
+
+#include <algorithm>
+
+namespace faf {
+
+PathMigrationPolicy::PathMigrationPolicy(int minGainMs, int cooldownMs, int requiredSamples):
+  _minGainMs(std::max(minGainMs, 1)),
+  _cooldown(std::max(cooldownMs, 0)),
+  _requiredSamples(static_cast<uint64_t>(std::max(requiredSamples, 1))),
+  _selectedRttMs(-1.),
+  _selectedRelayed(false),
+  _betterSamples(0),
+  _migrations(0),
+  _switches(0),
+  _switchesToDirect(0),
+  _switchesToRelayed(0),
+  _lastGainMs(0.),
+  _totalGainMs(0.)
+{
+}
+
+PathMigrationDecision PathMigrationPolicy::evaluate(std::chrono::steady_clock::time_point now,
+                                                    std::vector<CandidatePairSample> const& pairs,
+                                                    std::string const& selectedPairId,
+                                                    bool mayMigrate)
+{
+  PathMigrationDecision result;
+  auto selected = std::find_if(pairs.begin(), pairs.end(), [&selectedPairId](CandidatePairSample const& pair)
+  {
+    return pair.id == selectedPairId;
+  });
+  if (selectedPairId != _selectedPairId)
+  {
+    if (!_selectedPairId.empty() &&
+        selected != pairs.end())
+    {
+      result.switched = true;
+      result.switchedFromRelayed = _selectedRelayed;
+      result.switchedToRelayed = selected->relayed;
+      if (_selectedRttMs >= 0 &&
+          selected->rttMs >= 0)
+      {
+        result.switchGainMs = _selectedRttMs - selected->rttMs;
+      }
+      ++_switches;
+      if (selected->relayed)
+      {
+        ++_switchesToRelayed;
+      }
+      else
+      {
+        ++_switchesToDirect;
+      }
+      _lastGainMs = result.switchGainMs;
+      _totalGainMs += result.switchGainMs;
+      _quietUntil = now + _cooldown;
+    }
+    _selectedPairId = selectedPairId;
+    _betterSamples = 0;
+  }
+  if (selected == pairs.end())
+  {
+    _betterSamples = 0;
+    return result;
+  }
+  _selectedRttMs = selected->rttMs;
+  _selectedRelayed = selected->relayed;
+  if (!selected->relayed ||
+      selected->rttMs < 0)
+  {
+    _betterSamples = 0;
+    return result;
+  }
+
+  double bestDirectRttMs = -1.;
+  for (auto const& pair : pairs)
+  {
+    if (!pair.relayed &&
+        pair.rttMs >= 0 &&
+        pair.loss <= maxLoss &&
+        (bestDirectRttMs < 0 || pair.rttMs < bestDirectRttMs))
+    {
+      bestDirectRttMs = pair.rttMs;
+    }
+  }
+  if (bestDirectRttMs >= 0 &&
+      selected->rttMs - bestDirectRttMs >= _minGainMs)
+  {
+    ++_betterSamples;
+  }
+  else
+  {
+    _betterSamples = 0;
+  }
+  if (mayMigrate &&
+      _betterSamples >= _requiredSamples &&
+      now >= _quietUntil)
+  {
+    result.migrate = true;
+    result.expectedGainMs = selected->rttMs - bestDirectRttMs;
+    ++_migrations;
+    _betterSamples = 0;
+    _quietUntil = now + _cooldown;
+  }
+  return result;
+}
+
+void PathMigrationPolicy::reset()
+{
+  _selectedPairId.clear();
+  _selectedRttMs = -1.;
+  _selectedRelayed = false;
+  _betterSamples = 0;
+}
+
+Json::Value PathMigrationPolicy::status() const
+{
+  Json::Value result;
+  result["selected_relayed"] = _selectedRelayed;
+  result["selected_rtt_ms"] = _selectedRttMs;
+  result["better_direct_samples"] = static_cast<Json::UInt64>(_betterSamples);
+  result["migrations"] = static_cast<Json::UInt64>(_migrations);
+  result["switches"] = static_cast<Json::UInt64>(_switches);
+  result["switches_to_direct"] = static_cast<Json::UInt64>(_switchesToDirect);
+  result["switches_to_relayed"] = static_cast<Json::UInt64>(_switchesToRelayed);
+  result["last_gain_ms"] = _lastGainMs;
+  result["total_gain_ms"] = _totalGainMs;
+  return result;
+}
+
+} // namespace faf
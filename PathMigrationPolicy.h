@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief One succeeded candidate pair of a stats report
+ */
+struct CandidatePairSample
+{
+  std::string id;
+  /* the local or the remote candidate is a TURN relay */
+  bool relayed = false;
+  double rttMs = -1.;
+  /* share of connectivity checks without response */
+  double loss = 0.;
+};
+
+/*! \brief What PathMigrationPolicy::evaluate() found
+ */
+struct PathMigrationDecision
+{
+  /* the selected pair changed since the last evaluation */
+  bool switched = false;
+  bool switchedFromRelayed = false;
+  bool switchedToRelayed = false;
+  /* RTT of the old pair minus RTT of the new one, 0 if either is unknown */
+  double switchGainMs = 0.;
+  /* the connection should be moved to a direct pair now */
+  bool migrate = false;
+  double expectedGainMs = 0.;
+};
+
+/*! \brief Decides when a connection selected on a TURN relay should move to a faster direct pair.
+ *         A direct pair must be faster by minGainMs in requiredSamples evaluations in a row,
+ *         and a migration waits cooldownMs after the last migration or pair switch,
+ *         so the connection does not flap between paths.
+ */
+class PathMigrationPolicy
+{
+public:
+  PathMigrationPolicy(int minGainMs, int cooldownMs, int requiredSamples);
+
+  /** \brief Track the selected pair of a stats report and check for a faster direct pair.
+       \param mayMigrate: false only tracks, e.g. on the controlled side of the connection
+      */
+  PathMigrationDecision evaluate(std::chrono::steady_clock::time_point now,
+                                 std::vector<CandidatePairSample> const& pairs,
+                                 std::string const& selectedPairId,
+                                 bool mayMigrate);
+
+  /** \brief A new PeerConnection starts without a selected pair, keeps the counters */
+  void reset();
+
+  Json::Value status() const;
+
+protected:
+  /* direct pairs losing more connectivity checks are not migrated to */
+  static constexpr double maxLoss = 0.1;
+
+  double _minGainMs;
+  std::chrono::milliseconds _cooldown;
+  uint64_t _requiredSamples;
+
+  std::string _selectedPairId;
+  double _selectedRttMs;
+  bool _selectedRelayed;
+  uint64_t _betterSamples;
+  std::chrono::steady_clock::time_point _quietUntil;
+
+  uint64_t _migrations;
+  uint64_t _switches;
+  uint64_t _switchesToDirect;
+  uint64_t _switchesToRelayed;
+  double _lastGainMs;
+  double _totalGainMs;
+};
+
+} // namespace faf
@@ -0,0 +1,206 @@
+#include "PeerConnectionPool.h"
+
+#include <webrtc/rtc_base/bind.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include "logging.h"
+
+namespace faf {
+
+/* TURN allocations of old pooled PeerConnections may be gone, so they are replaced */
+static constexpr std::chrono::minutes pooledPeerConnectionMaxAge(10);
+
+void PooledPeerConnectionObserver::setTarget(webrtc::PeerConnectionObserver* target)
+{
+  _target = target;
+}
+
+void PooledPeerConnectionObserver::OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState new_state)
+{
+  if (_target)
+  {
+    _target->OnSignalingChange(new_state);
+  }
+}
+
+void PooledPeerConnectionObserver::OnIceConnectionChange(webrtc::PeerConnectionInterface::IceConnectionState new_state)
+{
+  if (_target)
+  {
+    _target->OnIceConnectionChange(new_state);
+  }
+}
+
+void PooledPeerConnectionObserver::OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state)
+{
+  if (_target)
+  {
+    _target->OnIceGatheringChange(new_state);
+  }
+}
+
+void PooledPeerConnectionObserver::OnIceCandidate(const webrtc::IceCandidateInterface *candidate)
+{
+  if (_target)
+  {
+    _target->OnIceCandidate(candidate);
+  }
+}
+
+void PooledPeerConnectionObserver::OnRenegotiationNeeded()
+{
+  if (_target)
+  {
+    _target->OnRenegotiationNeeded();
+  }
+}
+
+void PooledPeerConnectionObserver::OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel)
+{
+  if (_target)
+  {
+    _target->OnDataChannel(data_channel);
+  }
+}
+
+void PooledPeerConnectionObserver::OnAddStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream)
+{
+  if (_target)
+  {
+    _target->OnAddStream(stream);
+  }
+}
+
+void PooledPeerConnectionObserver::OnRemoveStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream)
+{
+  if (_target)
+  {
+    _target->OnRemoveStream(stream);
+  }
+}
+
+PeerConnectionPool::PeerConnectionPool(rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+                                       rtc::scoped_refptr<rtc::RTCCertificate> const& certificate,
+                                       PortAllocatorFactory* portAllocatorFactory,
+                                       bool iceRenomination,
+                                       std::size_t size):
+  _pcfactory(pcfactory),
+  _certificate(certificate),
+  _portAllocatorFactory(portAllocatorFactory),
+  _iceRenomination(iceRenomination),
+  _size(size),
+  _iceServersSet(false),
+  _refillPending(false),
+  _created(0),
+  _taken(0),
+  _misses(0),
+  _expired(0)
+{
+}
+
+PeerConnectionPool::~PeerConnectionPool()
+{
+  _clear();
+}
+
+void PeerConnectionPool::setIceServers(webrtc::PeerConnectionInterface::IceServers const& iceServers)
+{
+  _clear();
+  _iceServers = iceServers;
+  _iceServersSet = true;
+  _refill();
+}
+
+PooledPeerConnection PeerConnectionPool::take(webrtc::PeerConnectionObserver* observer)
+{
+  auto now = std::chrono::steady_clock::now();
+  while (!_entries.empty() &&
+         now - _entries.front().created > pooledPeerConnectionMaxAge)
+  {
+    _entries.front().pooled.peerConnection->Close();
+    _entries.pop_front();
+    ++_expired;
+  }
+  PooledPeerConnection result;
+  if (_entries.empty())
+  {
+    ++_misses;
+  }
+  else
+  {
+    result = _entries.front().pooled;
+    _entries.pop_front();
+    result.observer->setTarget(observer);
+    ++_taken;
+  }
+  /* creating PeerConnections takes a while, it must not delay the caller */
+  if (!_refillPending &&
+      _iceServersSet)
+  {
+    _refillPending = true;
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                               rtc::Thread::Current(),
+                               rtc::Bind(&PeerConnectionPool::_refill, this));
+  }
+  return result;
+}
+
+Json::Value PeerConnectionPool::status() const
+{
+  Json::Value result;
+  result["size"] = static_cast<Json::UInt64>(_size);
+  result["available"] = static_cast<Json::UInt64>(_entries.size());
+  result["created"] = static_cast<Json::UInt64>(_created);
+  result["taken"] = static_cast<Json::UInt64>(_taken);
+  result["misses"] = static_cast<Json::UInt64>(_misses);
+  result["expired"] = static_cast<Json::UInt64>(_expired);
+  return result;
+}
+
+void PeerConnectionPool::_refill()
+{
+  _refillPending = false;
+  while (_entries.size() < _size)
+  {
+    webrtc::PeerConnectionInterface::RTCConfiguration configuration;
+    configuration.servers = _iceServers;
+    /* gather candidates before the PeerConnection has a local description */
+    configuration.ice_candidate_pool_size = 1;
+    configuration.enable_ice_renomination = _iceRenomination;
+    if (_certificate)
+    {
+      configuration.certificates.push_back(_certificate);
+    }
+    Entry entry;
+    entry.pooled.observer = std::make_shared<PooledPeerConnectionObserver>();
+    std::unique_ptr<cricket::PortAllocator> portAllocator;
+    if (_portAllocatorFactory)
+    {
+      _portAllocatorFactory->configure(configuration);
+      portAllocator = _portAllocatorFactory->create();
+    }
+    entry.pooled.peerConnection = _pcfactory->CreatePeerConnection(configuration,
+                                                                   std::move(portAllocator),
+                                                                   nullptr,
+                                                                   entry.pooled.observer.get());
+    if (!entry.pooled.peerConnection)
+    {
+      FAF_LOG_ERROR << "creating pooled PeerConnection failed";
+      return;
+    }
+    entry.created = std::chrono::steady_clock::now();
+    _entries.push_back(entry);
+    ++_created;
+  }
+}
+
+void PeerConnectionPool::_clear()
+{
+  for (auto& entry: _entries)
+  {
+    entry.pooled.peerConnection->Close();
+  }
+  _entries.clear();
+}
+
+} // namespace faf
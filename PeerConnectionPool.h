@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+
+#include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/rtc_base/asyncinvoker.h>
+
+#include <third_party/json/json.h>
+
+#include "PortAllocatorFactory.h"
+
+namespace faf {
+
+/*! \brief Forwards the events of a pooled PeerConnection to the PeerRelay that took it.
+ *         Events before that are dropped.
+ */
+class PooledPeerConnectionObserver : public webrtc::PeerConnectionObserver
+{
+public:
+  void setTarget(webrtc::PeerConnectionObserver* target);
+
+  virtual void OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState new_state) override;
+  virtual void OnIceConnectionChange(webrtc::PeerConnectionInterface::IceConnectionState new_state) override;
+  virtual void OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state) override;
+  virtual void OnIceCandidate(const webrtc::IceCandidateInterface *candidate) override;
+  virtual void OnRenegotiationNeeded() override;
+  virtual void OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) override;
+  virtual void OnAddStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream) override;
+  virtual void OnRemoveStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream) override;
+
+protected:
+  webrtc::PeerConnectionObserver* _target = nullptr;
+};
+
+/*! \brief A PeerConnection from the pool and the observer it was created with.
+ *         The observer must outlive the PeerConnection.
+ */
+struct PooledPeerConnection
+{
+  /* declared first, so it is destroyed after the PeerConnection */
+  std::shared_ptr<PooledPeerConnectionObserver> observer;
+  rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection;
+};
+
+/*! \brief PeerConnections created ahead of time, so a new PeerRelay skips the DTLS
+ *         certificate generation and starts with candidates already gathered.
+ *         Only used on the signaling thread.
+ */
+class PeerConnectionPool
+{
+public:
+  PeerConnectionPool(rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+                     rtc::scoped_refptr<rtc::RTCCertificate> const& certificate,
+                     PortAllocatorFactory* portAllocatorFactory,
+                     bool iceRenomination,
+                     std::size_t size);
+  virtual ~PeerConnectionPool();
+
+  /** \brief Replace all pooled PeerConnections by ones using the new servers.
+             The pool stays empty until this is called.
+      */
+  void setIceServers(webrtc::PeerConnectionInterface::IceServers const& iceServers);
+
+  /** \brief Take a PeerConnection and forward its events to observer.
+             The pool is refilled in the background.
+       \returns an empty PooledPeerConnection if the pool is empty
+      */
+  PooledPeerConnection take(webrtc::PeerConnectionObserver* observer);
+
+  Json::Value status() const;
+
+protected:
+  struct Entry
+  {
+    PooledPeerConnection pooled;
+    std::chrono::steady_clock::time_point created;
+  };
+
+  void _refill();
+  void _clear();
+
+  rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> _pcfactory;
+  rtc::scoped_refptr<rtc::RTCCertificate> _certificate;
+  PortAllocatorFactory* _portAllocatorFactory;
+  bool _iceRenomination;
+  std::size_t _size;
+  bool _iceServersSet;
+  webrtc::PeerConnectionInterface::IceServers _iceServers;
+  std::deque<Entry> _entries;
+  bool _refillPending;
+  uint64_t _created;
+  uint64_t _taken;
+  uint64_t _misses;
+  uint64_t _expired;
+
+  /* must be destroyed first to cancel a pending refill */
+  rtc::AsyncInvoker _invoker;
+
+  RTC_DISALLOW_COPY_AND_ASSIGN(PeerConnectionPool);
+};
+
+} // namespace faf
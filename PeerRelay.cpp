@@ -1,12 +1,64 @@
 #include "PeerRelay.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include <webrtc/api/jsep.h>
 #include <webrtc/rtc_base/bind.h>
+#include <webrtc/rtc_base/helpers.h>
 
 #include "logging.h"
 #include "PeerRelayObservers.h"
 
 namespace faf {
 
+/* GSO accepts at most 64 segments per send */
+static constexpr std::size_t maxGameSendBatchSize = 64;
+
+/* number of game packets held back while the peer is congested */
+static constexpr std::size_t congestionBacklogDepth = 64;
+
+/* Aggregate messages stay below the path MTU and the RTP data channel limit */
+static constexpr std::size_t maxAggregateMessageSize = 1200;
+
+/* WebRTC silently discards larger messages on RTP data channels */
+static constexpr std::size_t maxRtpMessageSize = 1200;
+
+/* estimated bytes below the game payload of every data channel message:
+   IPv4/UDP, a DTLS record with AES-GCM, the SCTP common header and a DATA chunk */
+static constexpr uint64_t sctpMessageOverhead = 28 + 37 + 12 + 16;
+
+/* estimated bytes below the game payload of every RTP data message:
+   IPv4/UDP, the RTP header and the SRTP authentication tag */
+static constexpr uint64_t rtpMessageOverhead = 28 + 12 + 10;
+
+/* how often a PeerRelay receiving FecData messages reports its loss rate */
+static constexpr std::chrono::seconds lossReportInterval(1);
+
+static Json::Value recoveryStatus(RelayRecoveryStats const& stats)
+{
+  auto toMs = [](std::chrono::steady_clock::duration d)
+  {
+    return static_cast<Json::UInt64>(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+  };
+  Json::Value result;
+  result["attempts"] = static_cast<Json::UInt64>(stats.attempts);
+  result["succeeded"] = static_cast<Json::UInt64>(stats.succeeded);
+  result["last_ms"] = toMs(stats.last);
+  result["mean_ms"] = stats.succeeded > 0 ? toMs(stats.total) / stats.succeeded : 0;
+  result["max_ms"] = toMs(stats.max);
+  return result;
+}
+
+/* SCTP stream id of the "faf" data channel if both peers create it pre-negotiated */
+static constexpr int negotiatedDataChannelId = 0;
+
+/* how often a PeerRelay checks for stuck connection attempts and due reconnects */
+static constexpr int reconnectCheckIntervalMs = 250;
+
+/* WebRTC limits RTP data channels to this bandwidth unless the SDP says otherwise */
+static char const* rtpDataDefaultBandwidthLine = "b=AS:30\r\n";
+
 #define RELAY_LOG_ERROR FAF_LOG_ERROR << "PeerRelay for " << _remotePlayerLogin << " (" << _remotePlayerId << "): "
 #define RELAY_LOG_WARN FAF_LOG_WARN << "PeerRelay for " << _remotePlayerLogin << " (" << _remotePlayerId << "): "
 #define RELAY_LOG_INFO FAF_LOG_INFO << "PeerRelay for " << _remotePlayerLogin << " (" << _remotePlayerId << "): "
@@ -17,78 +69,220 @@ PeerRelay::PeerRelay(int remotePlayerId,
                      std::string const& remotePlayerLogin,
                      bool createOffer,
                      int gameUdpPort,
-                     rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory):
+                     rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+                     rtc::Thread* gameSocketThread,
+                     IceAdapterOptions const& options):
+  _options(options),
   _pcfactory(pcfactory),
+  _signalingThread(rtc::Thread::Current()),
+  _gameSocketThread(gameSocketThread),
+  _peerConnectionPool(nullptr),
+  _portAllocatorFactory(nullptr),
   _createOfferObserver(new rtc::RefCountedObject<CreateOfferObserver>(this)),
   _createAnswerObserver(new rtc::RefCountedObject<CreateAnswerObserver>(this)),
   _setLocalDescriptionObserver(new rtc::RefCountedObject<SetLocalDescriptionObserver>(this)),
   _setRemoteDescriptionObserver(new rtc::RefCountedObject<SetRemoteDescriptionObserver>(this)),
   _rtcStatsCollectorCallback(new rtc::RefCountedObject<RTCStatsCollectorCallback>(this)),
+  _rtcStatsSampleCallback(new rtc::RefCountedObject<RTCStatsSampleCallback>(this)),
   _dataChannelObserver(std::make_unique<DataChannelObserver>(this)),
   _peerConnectionObserver(std::make_shared<PeerConnectionObserver>(this)),
   _remotePlayerId(remotePlayerId),
   _remotePlayerLogin(remotePlayerLogin),
   _createOffer(createOffer),
   _gameUdpAddress("127.0.0.1", gameUdpPort),
-  _localUdpSocket(rtc::Thread::Current()->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM)),
+  /* enough buffers for every received datagram still queued in a ring, the backlog or
+     the preconnect buffer, plus one batch */
+  _gameReceiver(static_cast<std::size_t>(options.gameRecvBatchSize),
+                static_cast<std::size_t>(options.relayRingDepth) +
+                congestionBacklogDepth +
+                static_cast<std::size_t>(options.preconnectBufferSize) +
+                static_cast<std::size_t>(options.gameRecvBatchSize)),
+  _gameSender(maxGameSendBatchSize),
+  _gameToPeerRing(static_cast<std::size_t>(options.relayRingDepth)),
+  _peerToGameRing(static_cast<std::size_t>(options.relayRingDepth)),
+  _gameToPeerDrainPending(false),
+  _peerToGameFlushPending(false),
+  _gameToPeerRingDrops(0),
+  _peerToGameRingDrops(0),
+  _congestionBacklog(congestionBacklogDepth),
+  _congested(false),
+  _congestionNotified(false),
+  _congestionEvents(0),
+  _congestionDroppedNew(0),
+  _congestionDroppedOldest(0),
+  _preconnectBuffer(static_cast<std::size_t>(std::max(options.preconnectBufferSize, 1))),
+  _preconnectHeld(0),
+  _preconnectSaved(0),
+  _preconnectExpired(0),
+  _preconnectOverflowed(0),
+  _framingErrors(0),
+  _aggregator(maxAggregateMessageSize),
+  _aggregateFlushPending(false),
+  _aggregateMessages(0),
+  _aggregatedDatagrams(0),
+  _aggregateOverheadSaved(0),
+  _aggregateFramingBytes(0),
+  _lossReports(0),
+  _peerLossRate(0.),
+  _redundancyEnabled(options.redundantPath == "all"),
+  _redundancyRequestedByPeer(false),
+  _redundantPathReconnect(options.reconnectBackoffMs, options.reconnectBackoffMaxMs),
+  _redundantPathCopies(0),
+  _primaryPathFirst(0),
+  _redundantPathFirst(0),
+  _iceMessageBatch(Json::arrayValue),
+  _iceBatchGeneration(0),
+  _iceMessagesSent(0),
+  _iceBatchesSent(0),
+  _iceBatchedMessages(0),
   _receivedOffer(false),
+  _remoteCapsReceived(false),
+  _dataChannelNegotiated(false),
   _isConnected(false),
   _closing(false),
   _iceState("none"),
-  _connectionAttemptTimeout(std::chrono::seconds(10))
+  _statusRevision(0),
+  _transport("sctp"),
+  _rtpOversizeDrops(0),
+  _session(0),
+  _iceRestartGeneration(0),
+  _reconnectScheduler(options.reconnectBackoffMs, options.reconnectBackoffMaxMs),
+  _iceStateSince(std::chrono::steady_clock::now()),
+  _localDescriptionDuration(std::chrono::steady_clock::duration::zero()),
+  _gatheringDuration(std::chrono::steady_clock::duration::zero()),
+  _connectionAttempts(static_cast<std::size_t>(std::max(options.connectAttemptHistory, 1))),
+  _statsHistory(static_cast<std::size_t>(std::max(options.statsHistorySize, 1))),
+  _pathMigration(options.pathMigrationMinGainMs,
+                 options.pathMigrationCooldownMs,
+                 options.pathMigrationSamples),
+  _migrationPending(false)
 {
-  _localUdpSocket->SignalReadEvent.connect(this, &PeerRelay::_onPeerdataFromGame);
-  if (_localUdpSocket->Bind(rtc::SocketAddress("127.0.0.1", 0)) != 0)
+  _peerToGameQueuedTimes.reserve(maxGameSendBatchSize);
+  if (_options.fec == "on")
+  {
+    _fecEncoder.setGroupSize(static_cast<std::size_t>(_options.fecGroupSize));
+  }
+  /* the game socket is owned by the game socket thread, which may be the current one */
+  _gameSocketThread->Invoke<void>(RTC_FROM_HERE, [this]
+  {
+    _localUdpSocket.reset(_gameSocketThread->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+    _localUdpSocket->SignalReadEvent.connect(this, &PeerRelay::_onPeerdataFromGame);
+    if (_localUdpSocket->Bind(rtc::SocketAddress("127.0.0.1", 0)) != 0)
+    {
+      FAF_LOG_ERROR << "unable to bind local udp socket";
+    }
+    /* the game address is fixed, so a connected socket saves the address lookup per send */
+    if (_localUdpSocket->Connect(_gameUdpAddress) != 0)
+    {
+      FAF_LOG_ERROR << "unable to connect local udp socket to the game";
+    }
+    _localUdpSocketPort = _localUdpSocket->GetLocalAddress().port();
+  });
+  if (_options.statsIntervalMs > 0)
   {
-    FAF_LOG_ERROR << "unable to bind local udp socket";
+    _statsTimer.start(_options.statsIntervalMs, std::bind(&PeerRelay::_sampleStats, this));
   }
-  _localUdpSocketPort = _localUdpSocket->GetLocalAddress().port();
   FAF_LOG_INFO << "PeerRelay for " << remotePlayerLogin << " (" << remotePlayerId << ") listening on UDP port " << _localUdpSocketPort;
 }
 
 PeerRelay::~PeerRelay()
 {
+  _statsTimer.stop();
+  _rtcStatsSampleCallback->detach();
+  _redundantPath.reset();
   _closePeerConnection();
+  _gameSocketThread->Invoke<void>(RTC_FROM_HERE, [this]
+  {
+    _localUdpSocket.reset();
+  });
 }
 
 void PeerRelay::reinit()
 {
-  if (!_checkConnectionTimer.started())
-  {
-    //_checkConnectionTimer.start(1000, std::bind(&PeerRelay::_checkConnectionTimeout, this));
-  }
   _connectStartTime = std::chrono::steady_clock::now();
+  _localDescriptionDuration = std::chrono::steady_clock::duration::zero();
+  _gatheringDuration = std::chrono::steady_clock::duration::zero();
+  _gatheredCandidates = Json::Value(Json::objectValue);
+  _connectionAttempts.begin(_connectStartTime, _recoveryMethod.empty() ? "initial" : _recoveryMethod);
+  _pathMigration.reset();
+  _migrationPending = false;
   _setConnected(false);
   _receivedOffer = false;
 
   _closePeerConnection();
+  /* without a data channel the peer is no longer congested */
+  _updateCongestion();
 
+  _checkConnectionTimer.start(reconnectCheckIntervalMs, std::bind(&PeerRelay::_checkConnectionTimeout, this));
+  _iceState = "none";
+  _iceStateSince = _connectStartTime;
   if (_stateCallback)
   {
     _stateCallback("none");
   }
 
+  /* The offerer picks the transport. It starts with SCTP until the peer
+     announced its capabilities, the answerer follows the offer. */
+  if (_createOffer)
+  {
+    _transport = _negotiatedTransport();
+    _session = rtc::CreateRandomNonZeroId();
+  }
+  _markStatusChanged();
+
   webrtc::PeerConnectionInterface::RTCConfiguration configuration;
   configuration.servers = _iceServerList;
+  if (_certificate)
+  {
+    configuration.certificates.push_back(_certificate);
+  }
+  configuration.enable_rtp_data_channel = _transport == "rtp";
+  /* lets the controlling side move to a better pair without an ICE restart */
+  configuration.enable_ice_renomination = _options.pathMigration == "on";
   /*
   configuration.continual_gathering_policy = webrtc::PeerConnectionInterface::GATHER_CONTINUALLY;
   configuration.ice_connection_receiving_timeout = 5000;
   configuration.ice_backup_candidate_pair_ping_interval = 2000;
   configuration.ice_regather_interval_range = rtc::Optional<rtc::IntervalRange>(rtc::IntervalRange(1000, 20000));
   */
-  _peerConnection = _pcfactory->CreatePeerConnection(configuration,
-                                                     nullptr,
-                                                     nullptr,
-                                                     _peerConnectionObserver.get());
+  PooledPeerConnection pooled;
+  if (_peerConnectionPool &&
+      !configuration.enable_rtp_data_channel)
+  {
+    pooled = _peerConnectionPool->take(_peerConnectionObserver.get());
+  }
+  if (pooled.peerConnection)
+  {
+    RELAY_LOG_DEBUG << "using pooled PeerConnection";
+    _peerConnection = pooled.peerConnection;
+    _pooledObserver = pooled.observer;
+  }
+  else
+  {
+    std::unique_ptr<cricket::PortAllocator> portAllocator;
+    if (_portAllocatorFactory)
+    {
+      _portAllocatorFactory->configure(configuration);
+      portAllocator = _portAllocatorFactory->create();
+    }
+    _peerConnection = _pcfactory->CreatePeerConnection(configuration,
+                                                       std::move(portAllocator),
+                                                       nullptr,
+                                                       _peerConnectionObserver.get());
+  }
+  if (!_peerConnection)
+  {
+    _recoverConnection("creating PeerConnection failed");
+    return;
+  }
   _closing = false;
   if (_createOffer)
   {
-    webrtc::DataChannelInit dataChannelInit;
-    dataChannelInit.maxRetransmits = 0;
-    dataChannelInit.ordered = false;
-    _dataChannel = _peerConnection->CreateDataChannel("faf",
-                                                      &dataChannelInit);
-    _dataChannel->RegisterObserver(_dataChannelObserver.get());
+    /* Until the peer sent its caps, assume it supports a pre-negotiated channel.
+       The channel is opened in-band once the answer shows otherwise. */
+    _createDataChannel(_transport == "sctp" &&
+                       (!_remoteCapsReceived ||
+                        _remoteHasFeature("negotiated-channel")));
     webrtc::PeerConnectionInterface::RTCOfferAnswerOptions options;
     options.offer_to_receive_audio = 0;
     options.offer_to_receive_video = 0;
@@ -116,15 +310,147 @@ Json::Value PeerRelay::status() const
   result["ice_agent"]["rem_cand_addr"] = _remoteCandAddress;
   result["ice_agent"]["loc_cand_type"] = _localCandType;
   result["ice_agent"]["rem_cand_type"] = _remoteCandType;
+  result["transport"]["current"] = _transport;
+  result["transport"]["preferred"] = _options.transport;
+  result["transport"]["remote_caps"] = _remoteCaps;
+  result["transport"]["data_channel"] = _dataChannelNegotiated ? "negotiated" : "in-band";
+  result["transport"]["rtp_oversize_drops"] = static_cast<Json::UInt64>(_rtpOversizeDrops);
+  result["ice_agent"]["pooled"] = static_cast<bool>(_pooledObserver);
+  result["ice_agent"]["time_to_local_description"] = std::chrono::duration_cast<std::chrono::milliseconds>(_localDescriptionDuration).count() / 1000.;
+  result["ice_agent"]["time_to_gathered"] = std::chrono::duration_cast<std::chrono::milliseconds>(_gatheringDuration).count() / 1000.;
+  result["ice_agent"]["gathered_candidates"] = _gatheredCandidates;
+  result["ice_agent"]["connection_attempts"] = _connectionAttempts.status();
   result["ice_agent"]["time_to_connected"] = _isConnected ? std::chrono::duration_cast<std::chrono::milliseconds>(_connectDuration).count() / 1000. : 0.;
+  result["traffic"]["game_to_peer"]["packets"] = static_cast<Json::UInt64>(_gameToPeerTraffic.packets);
+  result["traffic"]["game_to_peer"]["bytes"] = static_cast<Json::UInt64>(_gameToPeerTraffic.bytes);
+  result["traffic"]["game_to_peer"]["dropped_not_connected"] = static_cast<Json::UInt64>(_gameToPeerTraffic.droppedNotConnected);
+  result["traffic"]["game_to_peer"]["dropped_channel_not_open"] = static_cast<Json::UInt64>(_gameToPeerTraffic.droppedChannelNotOpen);
+  result["traffic"]["game_to_peer"]["send_failures"] = static_cast<Json::UInt64>(_gameToPeerTraffic.sendFailures);
+  result["traffic"]["game_to_peer"]["relay_latency"] = _gameToPeerTraffic.latency.status();
+  result["backpressure"]["high_water_bytes"] = _options.sctpHighWaterMark;
+  result["backpressure"]["policy"] = _options.congestionPolicy;
+  result["backpressure"]["buffered_amount"] = static_cast<Json::UInt64>(_dataChannel ? _dataChannel->buffered_amount() : 0);
+  result["backpressure"]["backlog"] = static_cast<Json::UInt64>(_congestionBacklog.sizeApprox());
+  result["backpressure"]["congested"] = _congested;
+  result["backpressure"]["congestion_events"] = static_cast<Json::UInt64>(_congestionEvents);
+  result["backpressure"]["dropped_new"] = static_cast<Json::UInt64>(_congestionDroppedNew);
+  result["backpressure"]["dropped_oldest"] = static_cast<Json::UInt64>(_congestionDroppedOldest);
+  result["preconnect_buffer"]["size"] = _options.preconnectBufferSize > 0 ? static_cast<Json::UInt64>(_preconnectBuffer.capacity()) : 0;
+  result["preconnect_buffer"]["max_age_ms"] = _options.preconnectBufferMs;
+  result["preconnect_buffer"]["queued"] = static_cast<Json::UInt64>(_preconnectBuffer.sizeApprox());
+  result["preconnect_buffer"]["held"] = static_cast<Json::UInt64>(_preconnectHeld);
+  result["preconnect_buffer"]["saved"] = static_cast<Json::UInt64>(_preconnectSaved);
+  result["preconnect_buffer"]["expired"] = static_cast<Json::UInt64>(_preconnectExpired);
+  result["preconnect_buffer"]["overflowed"] = static_cast<Json::UInt64>(_preconnectOverflowed);
+  result["traffic"]["peer_to_game"]["packets"] = static_cast<Json::UInt64>(_peerToGameTraffic.packets);
+  result["traffic"]["peer_to_game"]["bytes"] = static_cast<Json::UInt64>(_peerToGameTraffic.bytes);
+  /* the counters of the game socket thread are atomic, reading them does not wait for it */
+  result["game_recv"] = _gameReceiver.status();
+  result["game_send"] = _gameSender.status();
+  result["traffic"]["peer_to_game"]["relay_latency"] = _peerToGameLatency.status();
+  result["framing"]["active"] = _framingActive();
+  result["framing"]["errors"] = static_cast<Json::UInt64>(_framingErrors);
+  result["aggregation"]["window_us"] = _options.aggregationWindowUs;
+  result["aggregation"]["active"] = _aggregationActive();
+  result["aggregation"]["messages"] = static_cast<Json::UInt64>(_aggregateMessages);
+  result["aggregation"]["datagrams"] = static_cast<Json::UInt64>(_aggregatedDatagrams);
+  result["aggregation"]["datagrams_per_message"] = _aggregateMessages > 0 ? static_cast<double>(_aggregatedDatagrams) / _aggregateMessages : 0.;
+  result["aggregation"]["header_bytes_saved"] = static_cast<Json::UInt64>(_aggregateOverheadSaved);
+  result["aggregation"]["framing_bytes_added"] = static_cast<Json::UInt64>(_aggregateFramingBytes);
+  result["aggregation"]["delay"] = _aggregationDelay.status();
+  result["fec"]["mode"] = _options.fec;
+  result["fec"]["active"] = _fecActive();
+  result["fec"]["xor_implementation"] = xorBytesImplementation();
+  result["fec"]["peer_loss_rate"] = _peerLossRate;
+  result["fec"]["loss_reports"] = static_cast<Json::UInt64>(_lossReports);
+  result["fec"]["send"] = _fecEncoder.status();
+  result["fec"]["receive"] = _fecDecoder.status();
+  result["redundant_path"]["enabled"] = _redundancyEnabled;
+  result["redundant_path"]["requested_by_peer"] = _redundancyRequestedByPeer;
+  result["redundant_path"]["path"] = _redundantPath ? _redundantPath->status() : Json::Value();
+  result["redundant_path"]["reconnect"] = _redundantPathReconnect.status(std::chrono::steady_clock::now());
+  result["redundant_path"]["copies_sent"] = static_cast<Json::UInt64>(_redundantPathCopies);
+  result["redundant_path"]["primary_first"] = static_cast<Json::UInt64>(_primaryPathFirst);
+  result["redundant_path"]["redundant_first"] = static_cast<Json::UInt64>(_redundantPathFirst);
+  result["redundant_path"]["redundant_first_ratio"] = _primaryPathFirst + _redundantPathFirst > 0 ? static_cast<double>(_redundantPathFirst) / (_primaryPathFirst + _redundantPathFirst) : 0.;
+  result["signaling"]["batch_window_ms"] = _options.iceBatchWindowMs;
+  result["signaling"]["messages_sent"] = static_cast<Json::UInt64>(_iceMessagesSent);
+  result["signaling"]["batches_sent"] = static_cast<Json::UInt64>(_iceBatchesSent);
+  result["signaling"]["batched_messages"] = static_cast<Json::UInt64>(_iceBatchedMessages);
+  result["path_migration"] = _pathMigration.status();
+  result["path_migration"]["mode"] = _options.pathMigration;
+  result["path_migration"]["pending"] = _migrationPending;
+  result["recovery"]["recovering"] = _recoveryMethod;
+  result["recovery"]["ice_restart"] = recoveryStatus(_iceRestartRecovery);
+  result["recovery"]["rebuild"] = recoveryStatus(_rebuildRecovery);
+  result["reconnect"] = _reconnectScheduler.status(std::chrono::steady_clock::now());
+  result["reconnect"]["state_age_ms"] = static_cast<Json::Int64>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _iceStateSince).count());
+  result["reconnect"]["state_timeout_ms"] = _stateTimeoutMs(_iceState);
+  result["rings"]["depth"] = static_cast<Json::UInt64>(_gameToPeerRing.capacity());
+  result["rings"]["game_to_peer_queued"] = static_cast<Json::UInt64>(_gameToPeerRing.sizeApprox());
+  result["rings"]["game_to_peer_drops"] = static_cast<Json::UInt64>(_gameToPeerRingDrops.load(std::memory_order_relaxed));
+  result["rings"]["peer_to_game_queued"] = static_cast<Json::UInt64>(_peerToGameRing.sizeApprox());
+  result["rings"]["peer_to_game_drops"] = static_cast<Json::UInt64>(_peerToGameRingDrops.load(std::memory_order_relaxed));
+  return result;
+}
+
+uint64_t PeerRelay::statusRevision() const
+{
+  /* the counters only grow, so their sum changes whenever one of them does */
+  return _statusRevision +
+         _gameToPeerTraffic.packets +
+         _gameToPeerTraffic.bytes +
+         _peerToGameTraffic.packets +
+         _peerToGameTraffic.bytes;
+}
+
+Json::Value PeerRelay::statusSummary() const
+{
+  Json::Value result;
+  result["remote_player_login"] = _remotePlayerLogin;
+  result["state"] = _iceState;
+  result["connected"] = _isConnected;
+  result["loc_cand_type"] = _localCandType;
+  result["rem_cand_type"] = _remoteCandType;
+  result["loc_cand_addr"] = _localCandAddress;
+  result["rem_cand_addr"] = _remoteCandAddress;
+  result["transport"] = _transport;
+  result["recovering"] = _recoveryMethod;
+  result["congested"] = _congested;
+  result["redundant_path"] = _redundancyEnabled;
+  result["packets_sent"] = static_cast<Json::UInt64>(_gameToPeerTraffic.packets);
+  result["bytes_sent"] = static_cast<Json::UInt64>(_gameToPeerTraffic.bytes);
+  result["packets_received"] = static_cast<Json::UInt64>(_peerToGameTraffic.packets);
+  result["bytes_received"] = static_cast<Json::UInt64>(_peerToGameTraffic.bytes);
   return result;
 }
 
+Json::Value PeerRelay::relayStats(std::size_t maxSamples) const
+{
+  Json::Value result;
+  result["remote_player_id"] = _remotePlayerId;
+  result["remote_player_login"] = _remotePlayerLogin;
+  result["interval_ms"] = _options.statsIntervalMs;
+  result["history_size"] = _options.statsHistorySize;
+  result["samples"] = _statsHistory.samples(maxSamples);
+  return result;
+}
+
+ConnectionAttemptLog const& PeerRelay::connectionAttempts() const
+{
+  return _connectionAttempts;
+}
+
 void PeerRelay::setIceMessageCallback(IceMessageCallback cb)
 {
   _iceMessageCallback = cb;
 }
 
+void PeerRelay::setIceMessageBatchCallback(IceMessageBatchCallback cb)
+{
+  _iceMessageBatchCallback = cb;
+}
+
 void PeerRelay::setStateCallback(StateCallback cb)
 {
   _stateCallback = cb;
@@ -135,22 +461,115 @@ void PeerRelay::setConnectedCallback(ConnectedCallback cb)
   _connectedCallback = cb;
 }
 
+void PeerRelay::setCongestionCallback(CongestionCallback cb)
+{
+  _congestionCallback = cb;
+}
+
 void PeerRelay::setIceServers(webrtc::PeerConnectionInterface::IceServers const& iceServers)
 {
   _iceServerList = iceServers;
 }
 
+void PeerRelay::setPeerConnectionPool(PeerConnectionPool* pool)
+{
+  _peerConnectionPool = pool;
+}
+
+void PeerRelay::setPortAllocatorFactory(PortAllocatorFactory* factory)
+{
+  _portAllocatorFactory = factory;
+}
+
+void PeerRelay::setCertificate(rtc::scoped_refptr<rtc::RTCCertificate> const& certificate)
+{
+  _certificate = certificate;
+}
+
 void PeerRelay::addIceMessage(Json::Value const& iceMsg)
 {
   FAF_LOG_DEBUG << "addIceMessage: " << Json::FastWriter().write(iceMsg);
+  if (iceMsg.isMember("path"))
+  {
+    _addPathIceMessage(iceMsg);
+    return;
+  }
   if (!_peerConnection)
   {
     FAF_LOG_ERROR << "!_peerConnection";
     return;
   }
+  if (iceMsg["type"].asString() == "answer" &&
+      iceMsg.isMember("session") &&
+      iceMsg["session"].asUInt() != _session)
+  {
+    RELAY_LOG_INFO << "ignoring answer to the offer of a previous PeerConnection";
+    return;
+  }
   if (iceMsg["type"].asString() == "offer" ||
       iceMsg["type"].asString() == "answer")
   {
+    _remoteCaps = iceMsg["caps"];
+    _remoteCapsReceived = true;
+    if (_redundancyEnabled &&
+        !_redundantPath)
+    {
+      _openRedundantPath();
+    }
+    if (iceMsg["type"].asString() == "answer")
+    {
+      _migrationPending = false;
+    }
+    if (iceMsg["type"].asString() == "offer")
+    {
+      /* peers without caps only support SCTP */
+      auto offeredTransport = iceMsg["caps"].get("transport", "sctp").asString();
+      /* An offer for the known session is an ICE restart or a renegotiation,
+         anything else comes from a new PeerConnection of the peer. */
+      auto session = iceMsg.get("session", 0).asUInt();
+      bool newSession = _session != 0 && session != _session;
+      _session = session;
+      if (!_recoveryMethod.empty())
+      {
+        if (newSession ||
+            offeredTransport != _transport)
+        {
+          _recoveryMethod = "rebuild";
+          ++_rebuildRecovery.attempts;
+        }
+        else
+        {
+          _recoveryMethod = "ice-restart";
+          ++_iceRestartRecovery.attempts;
+        }
+        _markStatusChanged();
+      }
+      if (offeredTransport != _transport)
+      {
+        RELAY_LOG_INFO << "peer offered transport " << offeredTransport << ", recreating PeerConnection";
+        _transport = offeredTransport;
+        reinit();
+      }
+      else if (newSession)
+      {
+        RELAY_LOG_INFO << "peer recreated its PeerConnection, recreating PeerConnection";
+        reinit();
+      }
+    }
+    else if (_createOffer &&
+             _negotiatedTransport() != _transport)
+    {
+      RELAY_LOG_INFO << "peer supports transport " << _negotiatedTransport() << ", renegotiating";
+      reinit();
+      return;
+    }
+    else if (_createOffer &&
+             _dataChannelNegotiated &&
+             !_remoteHasFeature("negotiated-channel"))
+    {
+      RELAY_LOG_INFO << "peer does not support pre-negotiated data channels, opening the data channel in-band";
+      _createDataChannel(false);
+    }
     webrtc::SdpParseError error;
     _receivedOffer = iceMsg["type"].asString() == "offer";
     auto sdp = webrtc::CreateSessionDescription(iceMsg["type"].asString(), iceMsg["sdp"].asString(), &error);
@@ -177,6 +596,10 @@ void PeerRelay::addIceMessage(Json::Value const& iceMsg)
     else if (!_peerConnection->AddIceCandidate(candidate))
     {
       FAF_LOG_ERROR << "adding ICE candidate failed";
+    }
+    else
+    {
+      _connectionAttempts.mark(ConnectionPhase::FirstRemoteCandidate, std::chrono::steady_clock::now());
     };
     delete candidate;
   }
@@ -190,25 +613,229 @@ void PeerRelay::_closePeerConnection()
     _dataChannel->UnregisterObserver();
     _dataChannel.release();
   }
+  _dataChannelNegotiated = false;
+  /* packets queued for the closed channel would reach the next one out of order */
+  RelayPacket stalePacket;
+  while (_congestionBacklog.pop(stalePacket))
+  {
+  }
+  /* candidates of the closed connection are useless to the peer, the pending timer must not send them */
+  _iceMessageBatch.clear();
+  ++_iceBatchGeneration;
   if (_peerConnection)
   {
     _peerConnection->Close();
     _peerConnection.release();
   }
+  if (_pooledObserver)
+  {
+    /* released after the current event, which may come from this observer */
+    _pooledObserver->setTarget(nullptr);
+    auto retiredObserver = _pooledObserver;
+    _pooledObserver.reset();
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                               _signalingThread,
+                               [retiredObserver] {});
+  }
   if (_checkConnectionTimer.started())
   {
     _checkConnectionTimer.stop();
   }
 }
 
+std::string PeerRelay::_negotiatedTransport() const
+{
+  if (_options.transport == "rtp")
+  {
+    for (auto const& transport: _remoteCaps["transports"])
+    {
+      if (transport.asString() == "rtp")
+      {
+        return "rtp";
+      }
+    }
+  }
+  return "sctp";
+}
+
+Json::Value PeerRelay::_localCaps() const
+{
+  Json::Value result;
+  result["transports"].append("sctp");
+  /* the offerer only picks RTP if both peers prefer it */
+  if (_options.transport == "rtp")
+  {
+    result["transports"].append("rtp");
+  }
+  result["transport"] = _transport;
+  result["framing"] = _wantsFraming();
+  result["features"].append("aggregation");
+  result["features"].append("fec");
+  if (_options.redundantPath != "off")
+  {
+    result["features"].append("multipath");
+  }
+  result["features"].append("ice-restart");
+  result["features"].append("negotiated-channel");
+  result["channel"] = _dataChannelNegotiated ? "negotiated" : "in-band";
+  return result;
+}
+
+void PeerRelay::_createDataChannel(bool negotiated)
+{
+  webrtc::DataChannelInit dataChannelInit;
+  /* RTP data channels are always unreliable and reject any retransmission settings */
+  if (_transport == "sctp")
+  {
+    dataChannelInit.maxRetransmits = 0;
+    dataChannelInit.ordered = false;
+  }
+  /* both peers create a pre-negotiated channel on the same stream,
+     so it opens with the SCTP association without the DCEP round trip */
+  if (negotiated)
+  {
+    dataChannelInit.negotiated = true;
+    dataChannelInit.id = negotiatedDataChannelId;
+  }
+  if (_dataChannel)
+  {
+    _dataChannel->UnregisterObserver();
+    _dataChannel->Close();
+  }
+  _dataChannel = _peerConnection->CreateDataChannel("faf",
+                                                    &dataChannelInit);
+  _dataChannelNegotiated = negotiated && _dataChannel;
+  if (!_dataChannel)
+  {
+    RELAY_LOG_ERROR << "creating data channel failed";
+    return;
+  }
+  _dataChannel->RegisterObserver(_dataChannelObserver.get());
+}
+
+void PeerRelay::_onRemoteOfferSet()
+{
+  if (!_dataChannel &&
+      _transport == "sctp" &&
+      _remoteCaps.get("channel", "").asString() == "negotiated")
+  {
+    _createDataChannel(true);
+  }
+}
+
+void PeerRelay::_sampleStats()
+{
+  if (!_closing &&
+      _peerConnection)
+  {
+    _peerConnection->GetStats(_rtcStatsSampleCallback.get());
+  }
+}
+
+void PeerRelay::_sendIceMessage(Json::Value const& iceMsg)
+{
+  if (!_iceMessageCallback)
+  {
+    return;
+  }
+  if (_options.iceBatchWindowMs > 0 &&
+      iceMsg["type"].asString() == "candidate")
+  {
+    _iceMessageBatch.append(iceMsg);
+    if (_iceMessageBatch.size() == 1)
+    {
+      _invoker.AsyncInvokeDelayed<void>(RTC_FROM_HERE,
+                                        _signalingThread,
+                                        rtc::Bind(&PeerRelay::_onIceBatchTimer, this, _iceBatchGeneration),
+                                        static_cast<uint32_t>(_options.iceBatchWindowMs));
+    }
+    return;
+  }
+  /* candidates collected so far go out first, the peer sees the original order */
+  _flushIceMessageBatch();
+  ++_iceMessagesSent;
+  _iceMessageCallback(iceMsg);
+}
+
+void PeerRelay::_onIceBatchTimer(uint32_t batchGeneration)
+{
+  /* the batch of this timer was already flushed early */
+  if (batchGeneration != _iceBatchGeneration)
+  {
+    return;
+  }
+  _flushIceMessageBatch();
+}
+
+void PeerRelay::_flushIceMessageBatch()
+{
+  if (_iceMessageBatch.empty())
+  {
+    return;
+  }
+  ++_iceBatchGeneration;
+  Json::Value batch(Json::arrayValue);
+  std::swap(batch, _iceMessageBatch);
+  if (batch.size() > 1 &&
+      _iceMessageBatchCallback)
+  {
+    ++_iceMessagesSent;
+    ++_iceBatchesSent;
+    _iceBatchedMessages += batch.size();
+    _iceMessageBatchCallback(batch);
+    return;
+  }
+  for (auto const& iceMsg : batch)
+  {
+    ++_iceMessagesSent;
+    _iceMessageCallback(iceMsg);
+  }
+}
+
+void PeerRelay::_setLocalDescription(webrtc::SessionDescriptionInterface* sdp)
+{
+  sdp->ToString(&_localSdp);
+  if (_transport == "rtp")
+  {
+    /* The peer limits its sending rate to the bandwidth in our SDP, which is
+       far too low for game traffic by default. */
+    std::string bandwidthLine = "b=AS:" + std::to_string(_options.rtpDataBandwidthKbps) + "\r\n";
+    std::string::size_type pos;
+    while ((pos = _localSdp.find(rtpDataDefaultBandwidthLine)) != std::string::npos)
+    {
+      _localSdp.replace(pos, std::strlen(rtpDataDefaultBandwidthLine), bandwidthLine);
+    }
+    auto type = sdp->type();
+    delete sdp;
+    webrtc::SdpParseError error;
+    sdp = webrtc::CreateSessionDescription(type, _localSdp, &error);
+    if (!sdp)
+    {
+      RELAY_LOG_ERROR << "parsing modified local SDP failed: " << error.description;
+      return;
+    }
+  }
+  _peerConnection->SetLocalDescription(_setLocalDescriptionObserver,
+                                       sdp);
+}
+
 void PeerRelay::_setIceState(std::string const& state)
 {
   RELAY_LOG_DEBUG << "ice state changed to" << state;
   _iceState = state;
+  _iceStateSince = std::chrono::steady_clock::now();
+  _markStatusChanged();
+  if (_iceState == "checking")
+  {
+    _connectionAttempts.mark(ConnectionPhase::Checking, _iceStateSince);
+  }
   if (_iceState == "connected" ||
       _iceState == "completed")
   {
+    _connectionAttempts.mark(ConnectionPhase::Connected, _iceStateSince);
     _setConnected(true);
+    _reconnectScheduler.onConnected();
+    _onRecovered();
   }
   if (!_closing &&
       _peerConnection)
@@ -227,70 +854,948 @@ void PeerRelay::_setIceState(std::string const& state)
   }
   if (_iceState == "failed")
   {
-    RELAY_LOG_WARN << "Connection failed, forcing reconnect immediately.";
-    reinit();
+    _onIceFailed();
   }
 }
 
-void PeerRelay::_setConnected(bool connected)
+void PeerRelay::_onIceFailed()
 {
-  if (connected != _isConnected)
+  if (_createOffer)
   {
-    _isConnected = connected;
-    if (_connectedCallback)
-    {
-      _connectedCallback(true);
-    }
-    if (connected)
-    {
-      _connectDuration = std::chrono::steady_clock::now() - _connectStartTime;
-      RELAY_LOG_INFO << "connected after " <<  std::chrono::duration_cast<std::chrono::milliseconds>(_connectDuration).count() / 1000.;
-    }
-    else
-    {
-      RELAY_LOG_INFO << "disconnected";
-    }
+    _recoverConnection(_recoveryMethod == "ice-restart" ? "ICE restart failed" : "Connection failed");
+    return;
+  }
+  /* Only the offerer triggers rebuilds. A peer without ICE restart support
+     sends an offer for a new PeerConnection the existing one cannot take. */
+  if (_recoveryMethod.empty())
+  {
+    _recoveryStartedAt = std::chrono::steady_clock::now();
+  }
+  if (!_remoteHasFeature("ice-restart"))
+  {
+    RELAY_LOG_WARN << "Connection failed, waiting for a new offer.";
+    _rebuildPeerConnection();
+    return;
+  }
+  RELAY_LOG_WARN << "Connection failed, waiting for the peer to restart ICE.";
+  if (_recoveryMethod.empty())
+  {
+    _recoveryMethod = "waiting";
+    _markStatusChanged();
   }
 }
 
-void PeerRelay::_checkConnectionTimeout()
+void PeerRelay::_recoverConnection(std::string const& reason)
 {
-  if (_iceState == "new" ||
-      _iceState == "closed" ||
-      _iceState == "disconnected" ||
-      _iceState == "failed" ||
-      _iceState == "none" ||
-      _iceState == "checking"
-      )
+  if (_recoveryMethod.empty())
   {
-    auto timeSinceLastConnectionAttempt = std::chrono::steady_clock::now() - _connectStartTime;
-    if (timeSinceLastConnectionAttempt > _connectionAttemptTimeout)
-    {
-      if (_createOffer)
-      {
-        RELAY_LOG_WARN << "ICE connection state is stuck in offerer. Forcing reconnect...";
-      }
-      else if (_receivedOffer)
-      {
-        RELAY_LOG_WARN << "ICE connection state is stuck in answerer. Forcing reconnect...";
-      }
-      reinit();
-    }
+    _recoveryStartedAt = std::chrono::steady_clock::now();
+  }
+  if (_peerConnection &&
+      _remoteHasFeature("ice-restart") &&
+      _recoveryMethod != "ice-restart" &&
+      (_iceState == "failed" ||
+       _iceState == "disconnected"))
+  {
+    RELAY_LOG_WARN << reason << ", restarting ICE.";
+    _restartIce();
+    return;
   }
+  auto delay = _reconnectScheduler.schedule(std::chrono::steady_clock::now(), reason);
+  RELAY_LOG_WARN << reason << ", recreating PeerConnection in " << delay.count() << " ms.";
 }
 
-void PeerRelay::_onPeerdataFromGame(rtc::AsyncSocket* socket)
+int PeerRelay::_stateTimeoutMs(std::string const& state) const
 {
-  auto msgLength = socket->Recv(_readBuffer.data(), _readBuffer.size(), nullptr);
-  if (!_isConnected)
+  if (state == "none" ||
+      state == "new" ||
+      state == "closed")
   {
-    RELAY_LOG_TRACE << "skipping " << msgLength << " bytes of P2P data until ICE connection is established";
-    return;
+    return _options.reconnectNewTimeoutMs;
+  }
+  if (state == "checking")
+  {
+    return _options.reconnectCheckingTimeoutMs;
+  }
+  if (state == "disconnected")
+  {
+    return _options.reconnectDisconnectedTimeoutMs;
   }
-  if (msgLength > 0 && _dataChannel)
+  return 0;
+}
+
+void PeerRelay::_restartIce()
+{
+  _recoveryMethod = "ice-restart";
+  ++_iceRestartRecovery.attempts;
+  _markStatusChanged();
+  _createIceRestartOffer();
+  auto restartGeneration = ++_iceRestartGeneration;
+  _invoker.AsyncInvokeDelayed<void>(RTC_FROM_HERE,
+                                    _signalingThread,
+                                    rtc::Bind(&PeerRelay::_onIceRestartTimeout, this, restartGeneration),
+                                    static_cast<uint32_t>(_options.iceRestartTimeoutMs));
+}
+
+void PeerRelay::_createIceRestartOffer()
+{
+  /* new ICE credentials on the existing PeerConnection keep DTLS, SCTP and the data channel */
+  webrtc::PeerConnectionInterface::RTCOfferAnswerOptions options;
+  options.offer_to_receive_audio = 0;
+  options.offer_to_receive_video = 0;
+  options.ice_restart = true;
+  _peerConnection->CreateOffer(_createOfferObserver,
+                               options);
+}
+
+void PeerRelay::_evaluatePathMigration(std::vector<CandidatePairSample> const& pairs,
+                                       std::string const& selectedPairId)
+{
+  /* only the offerer is the controlling ICE agent, which picks the pair */
+  bool mayMigrate = _options.pathMigration == "on" &&
+                    _createOffer &&
+                    _isConnected &&
+                    _recoveryMethod.empty() &&
+                    !_migrationPending &&
+                    _remoteHasFeature("ice-restart");
+  auto decision = _pathMigration.evaluate(std::chrono::steady_clock::now(),
+                                          pairs,
+                                          selectedPairId,
+                                          mayMigrate);
+  if (decision.switched)
+  {
+    RELAY_LOG_INFO << "selected candidate pair switched from " << (decision.switchedFromRelayed ? "relayed" : "direct")
+                   << " to " << (decision.switchedToRelayed ? "relayed" : "direct")
+                   << ", RTT gain " << decision.switchGainMs << " ms";
+  }
+  if (decision.migrate)
   {
-    _dataChannel->Send(webrtc::DataBuffer(rtc::CopyOnWriteBuffer(_readBuffer.data(), static_cast<std::size_t>(msgLength)), true));
+    RELAY_LOG_INFO << "direct candidate pair is " << decision.expectedGainMs << " ms faster than the TURN relay, restarting ICE";
+    _migrationPending = true;
+    _migrationStartedAt = std::chrono::steady_clock::now();
+    _createIceRestartOffer();
+  }
+}
+
+void PeerRelay::_rebuildPeerConnection()
+{
+  _recoveryMethod = "rebuild";
+  ++_rebuildRecovery.attempts;
+  _markStatusChanged();
+  /* invalidates a pending ICE restart timeout */
+  ++_iceRestartGeneration;
+  reinit();
+}
+
+void PeerRelay::_onIceRestartTimeout(uint32_t restartGeneration)
+{
+  if (restartGeneration != _iceRestartGeneration ||
+      _recoveryMethod != "ice-restart" ||
+      _isConnected)
+  {
+    return;
+  }
+  _recoverConnection("ICE restart did not connect within " + std::to_string(_options.iceRestartTimeoutMs) + " ms");
+}
+
+void PeerRelay::_onRecovered()
+{
+  if (_recoveryMethod.empty())
+  {
+    return;
+  }
+  auto duration = std::chrono::steady_clock::now() - _recoveryStartedAt;
+  auto stats = _recoveryMethod == "ice-restart" ? &_iceRestartRecovery :
+               _recoveryMethod == "rebuild" ? &_rebuildRecovery : nullptr;
+  if (stats)
+  {
+    ++stats->succeeded;
+    stats->last = duration;
+    stats->total += duration;
+    stats->max = std::max(stats->max, duration);
+  }
+  RELAY_LOG_INFO << "recovered by " << _recoveryMethod << " after " << std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() << " ms";
+  _recoveryMethod.clear();
+  _markStatusChanged();
+  ++_iceRestartGeneration;
+  /* after an ICE restart the data channel stays open and does not flush on its own */
+  if (_dataChannel &&
+      _dataChannel->state() == webrtc::DataChannelInterface::kOpen)
+  {
+    _flushPreconnectBuffer();
+  }
+}
+
+void PeerRelay::_markStatusChanged()
+{
+  ++_statusRevision;
+}
+
+void PeerRelay::_setConnected(bool connected)
+{
+  if (connected != _isConnected)
+  {
+    _isConnected = connected;
+    _markStatusChanged();
+    if (_connectedCallback)
+    {
+      _connectedCallback(true);
+    }
+    if (connected)
+    {
+      _connectDuration = std::chrono::steady_clock::now() - _connectStartTime;
+      RELAY_LOG_INFO << "connected after " <<  std::chrono::duration_cast<std::chrono::milliseconds>(_connectDuration).count() / 1000.;
+    }
+    else
+    {
+      RELAY_LOG_INFO << "disconnected";
+    }
+  }
+}
+
+void PeerRelay::_checkConnectionTimeout()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (_redundantPathReconnect.takeDue(now) &&
+      _redundancyEnabled &&
+      !_redundantPath)
+  {
+    _createRedundantPath(true);
+  }
+  if (_reconnectScheduler.takeDue(now))
+  {
+    /* reinit() restarts this timer, so it must not run inside the timer callback */
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                               _signalingThread,
+                               rtc::Bind(&PeerRelay::_rebuildPeerConnection, this));
+    return;
+  }
+  /* a migration keeps the connection up, so only a lost answer can stall it */
+  if (_migrationPending &&
+      now - _migrationStartedAt > std::chrono::milliseconds(_options.iceRestartTimeoutMs))
+  {
+    _migrationPending = false;
+    _recoverConnection("path migration got no answer within " + std::to_string(_options.iceRestartTimeoutMs) + " ms");
+    return;
+  }
+  /* the answerer follows the offers of the peer, an ICE restart has its own timeout */
+  if (!_createOffer ||
+      _isConnected ||
+      _reconnectScheduler.pending() ||
+      _recoveryMethod == "ice-restart")
+  {
+    return;
+  }
+  auto timeoutMs = _stateTimeoutMs(_iceState);
+  if (timeoutMs > 0 &&
+      now - _iceStateSince > std::chrono::milliseconds(timeoutMs))
+  {
+    _recoverConnection("ICE connection state is stuck in \"" + _iceState + "\" for " + std::to_string(timeoutMs) + " ms");
+  }
+}
+
+void PeerRelay::_onPeerdataFromGame(rtc::AsyncSocket* socket)
+{
+  /* runs on the game socket thread */
+  auto numDatagrams = _gameReceiver.receive(socket);
+  if (numDatagrams == 0)
+  {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < numDatagrams; ++i)
+  {
+    auto const& buffer = _gameReceiver.buffer(i);
+    if (buffer.size() > 0 &&
+        !_gameToPeerRing.push({buffer, now}))
+    {
+      _gameToPeerRingDrops.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (_signalingThread->IsCurrent())
+  {
+    _drainGameToPeerRing();
+  }
+  else if (!_gameToPeerDrainPending.exchange(true))
+  {
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                               _signalingThread,
+                               rtc::Bind(&PeerRelay::_drainGameToPeerRing, this));
+  }
+}
+
+void PeerRelay::_drainGameToPeerRing()
+{
+  /* runs on the signaling thread, which owns the data channel */
+  _gameToPeerDrainPending.store(false);
+  RelayPacket packet;
+  std::size_t numSkipped = 0;
+  while (_gameToPeerRing.pop(packet))
+  {
+    if (!_isConnected ||
+        !_dataChannel)
+    {
+      if (_options.preconnectBufferSize > 0)
+      {
+        _holdPreconnectPacket(packet);
+        continue;
+      }
+      ++numSkipped;
+      ++_gameToPeerTraffic.droppedNotConnected;
+      continue;
+    }
+    if (_dataChannel->state() != webrtc::DataChannelInterface::kOpen)
+    {
+      if (_options.preconnectBufferSize > 0)
+      {
+        _holdPreconnectPacket(packet);
+        continue;
+      }
+      ++_gameToPeerTraffic.droppedChannelNotOpen;
+      continue;
+    }
+    /* keep the packet order while older packets wait in the backlog */
+    if (_congestionBacklog.sizeApprox() > 0 ||
+        _isCongested())
+    {
+      _queueCongestedPacket(packet);
+      continue;
+    }
+    _sendToPeer(packet);
+  }
+  if (numSkipped > 0)
+  {
+    RELAY_LOG_TRACE << "skipping " << numSkipped << " datagrams of P2P data until ICE connection is established";
+  }
+  _updateCongestion();
+}
+
+void PeerRelay::_sendToPeer(RelayPacket const& packet)
+{
+  if (_aggregationActive())
+  {
+    _aggregatePacket(packet);
+    return;
+  }
+  if (!_sendGameMessage(_framingActive() ? frameDatagram(packet.data) : packet.data))
+  {
+    ++_gameToPeerTraffic.sendFailures;
+    return;
+  }
+  ++_gameToPeerTraffic.packets;
+  _gameToPeerTraffic.bytes += packet.data.size();
+  _gameToPeerTraffic.latency.add(std::chrono::steady_clock::now() - packet.received);
+}
+
+bool PeerRelay::_sendGameMessage(rtc::CopyOnWriteBuffer const& message)
+{
+  auto redundant = _redundantPath &&
+                   _redundantPath->isOpen();
+  if (!_fecActive() &&
+      !redundant)
+  {
+    return _sendMessageToPeer(message);
+  }
+  rtc::CopyOnWriteBuffer parity;
+  auto data = _fecEncoder.encode(message, parity);
+  auto result = _sendMessageToPeer(data);
+  /* the peer drops whichever copy of a sequenced message arrives second */
+  if (redundant &&
+      _redundantPath->send(data))
+  {
+    ++_redundantPathCopies;
+    result = true;
+  }
+  if (parity.size() > 0)
+  {
+    _sendMessageToPeer(parity);
+  }
+  return result;
+}
+
+bool PeerRelay::_sendMessageToPeer(rtc::CopyOnWriteBuffer const& message)
+{
+  if (!_dataChannel ||
+      _dataChannel->state() != webrtc::DataChannelInterface::kOpen)
+  {
+    return false;
+  }
+  if (_transport == "rtp" &&
+      message.size() > maxRtpMessageSize)
+  {
+    if (_rtpOversizeDrops++ == 0)
+    {
+      RELAY_LOG_WARN << "dropping game message of " << message.size() << " bytes, RTP data channels only carry up to " << maxRtpMessageSize << " bytes";
+    }
+    return false;
+  }
+  /* DataBuffer shares the buffer instead of copying it */
+  return _dataChannel->Send(webrtc::DataBuffer(message, true));
+}
+
+bool PeerRelay::_wantsFraming() const
+{
+  return _options.aggregationWindowUs > 0 ||
+         _options.fec != "off" ||
+         _options.redundantPath != "off";
+}
+
+bool PeerRelay::_framingActive() const
+{
+  /* Peers without "framing" in their caps only understand plain datagrams.
+     Both peers evaluate the same condition, so either both frame or none. */
+  return _remoteCaps.isMember("framing") &&
+         (_remoteCaps["framing"].asBool() || _wantsFraming());
+}
+
+bool PeerRelay::_remoteHasFeature(std::string const& feature) const
+{
+  for (auto const& remoteFeature: _remoteCaps["features"])
+  {
+    if (remoteFeature.asString() == feature)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PeerRelay::_aggregationActive() const
+{
+  return _options.aggregationWindowUs > 0 &&
+         _framingActive() &&
+         _remoteHasFeature("aggregation");
+}
+
+bool PeerRelay::_fecActive() const
+{
+  return _options.fec != "off" &&
+         _framingActive() &&
+         _remoteHasFeature("fec");
+}
+
+void PeerRelay::_onLossReport(uint16_t expected, uint16_t received)
+{
+  if (expected == 0)
+  {
+    return;
+  }
+  auto loss = 1. - static_cast<double>(received) / expected;
+  _peerLossRate = _lossReports == 0 ? loss : 0.75 * _peerLossRate + 0.25 * loss;
+  ++_lossReports;
+  if (_options.fec != "auto")
+  {
+    return;
+  }
+  /* With loss rate p a group of k messages plus parity fails if two of them
+     are lost, roughly (k+1)k/2 * p^2. Smaller groups keep that below ~0.1%. */
+  std::size_t groupSize = 0;
+  if (_peerLossRate >= 0.05)
+  {
+    groupSize = 2;
+  }
+  else if (_peerLossRate >= 0.02)
+  {
+    groupSize = 4;
+  }
+  else if (_peerLossRate >= 0.01)
+  {
+    groupSize = 8;
+  }
+  else if (_peerLossRate >= 0.005)
+  {
+    groupSize = 16;
+  }
+  if (groupSize != _fecEncoder.groupSize())
+  {
+    RELAY_LOG_INFO << "peer loss rate " << _peerLossRate << ", FEC group size " << _fecEncoder.groupSize() << " -> " << groupSize;
+    _fecEncoder.setGroupSize(groupSize);
+  }
+}
+
+bool PeerRelay::setRedundancy(bool enabled)
+{
+  /* copies are sequenced, so both peers must have agreed on framing upfront */
+  if (enabled &&
+      _options.redundantPath == "off")
+  {
+    return false;
+  }
+  if (enabled == _redundancyEnabled)
+  {
+    return true;
+  }
+  RELAY_LOG_INFO << (enabled ? "enabling" : "disabling") << " redundant path";
+  _redundancyEnabled = enabled;
+  _markStatusChanged();
+  if (enabled)
+  {
+    _openRedundantPath();
+    return true;
+  }
+  _redundancyRequestedByPeer = false;
+  if (_redundantPath)
+  {
+    Json::Value iceMsg;
+    iceMsg["type"] = "path-close";
+    iceMsg["path"] = 1;
+    _sendIceMessage(iceMsg);
+  }
+  _redundantPath.reset();
+  return true;
+}
+
+void PeerRelay::_openRedundantPath()
+{
+  if (_redundantPath ||
+      !_framingActive() ||
+      !_remoteHasFeature("multipath"))
+  {
+    return;
+  }
+  /* the offering PeerRelay also offers the path, so both peers can't offer at once */
+  if (_createOffer)
+  {
+    _createRedundantPath(true);
+  }
+  else
+  {
+    Json::Value iceMsg;
+    iceMsg["type"] = "path-request";
+    iceMsg["path"] = 1;
+    _sendIceMessage(iceMsg);
+  }
+}
+
+void PeerRelay::_createRedundantPath(bool createOffer)
+{
+  _redundantPath.reset();
+  _redundantPath = std::make_unique<RedundantPath>(createOffer,
+                                                   _pcfactory,
+                                                   _iceServerList,
+                                                   _certificate,
+                                                   _portAllocatorFactory,
+                                                   [this](Json::Value const& iceMsg)
+  {
+    _sendIceMessage(iceMsg);
+  },
+  [this](rtc::CopyOnWriteBuffer const& message)
+  {
+    _onPeerMessage(message, true);
+  },
+  [this](std::string const& state)
+  {
+    RELAY_LOG_DEBUG << "redundant path state changed to " << state;
+    if (state == "connected" ||
+        state == "completed")
+    {
+      _redundantPathReconnect.onConnected();
+    }
+    /* the path can't be destroyed from within its own callback */
+    if (state == "failed")
+    {
+      _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                                 _signalingThread,
+                                 rtc::Bind(&PeerRelay::_onRedundantPathFailed, this));
+    }
+  });
+}
+
+void PeerRelay::_addPathIceMessage(Json::Value const& iceMsg)
+{
+  auto type = iceMsg["type"].asString();
+  /* a path costs TURN allocations and doubles the traffic, only accept it if enabled on this side */
+  if ((type == "path-request" ||
+       type == "offer") &&
+      !_redundancyEnabled)
+  {
+    RELAY_LOG_INFO << "refusing redundant path, it is not enabled for this peer";
+    _redundancyRequestedByPeer = false;
+    _redundantPath.reset();
+    Json::Value closeMsg;
+    closeMsg["type"] = "path-close";
+    closeMsg["path"] = 1;
+    _sendIceMessage(closeMsg);
+    return;
+  }
+  if (type == "path-request")
+  {
+    _redundancyRequestedByPeer = true;
+    if (_createOffer &&
+        !_redundantPath)
+    {
+      _createRedundantPath(true);
+    }
+  }
+  else if (type == "path-close")
+  {
+    RELAY_LOG_INFO << "peer closed the redundant path";
+    _redundancyRequestedByPeer = false;
+    _redundantPath.reset();
+  }
+  else if (type == "offer")
+  {
+    /* a new offer replaces the path */
+    _createRedundantPath(false);
+    _redundantPath->addIceMessage(iceMsg);
+  }
+  else if (_redundantPath)
+  {
+    _redundantPath->addIceMessage(iceMsg);
+  }
+}
+
+void PeerRelay::_onRedundantPathFailed()
+{
+  _redundantPath.reset();
+  if (!_createOffer ||
+      !_redundancyEnabled)
+  {
+    RELAY_LOG_WARN << "redundant path failed";
+    return;
+  }
+  /* a TURN server that refuses the path would otherwise be hammered with allocations */
+  auto delay = _redundantPathReconnect.schedule(std::chrono::steady_clock::now(), "redundant path failed");
+  RELAY_LOG_WARN << "redundant path failed, recreating it in " << delay.count() << " ms";
+}
+
+void PeerRelay::_sendLossReport()
+{
+  uint16_t expected;
+  uint16_t received;
+  _fecDecoder.takeInterval(expected, received);
+  _sendMessageToPeer(frameLossReport(expected, received));
+}
+
+void PeerRelay::_aggregatePacket(RelayPacket const& packet)
+{
+  if (!_aggregator.add(packet.data))
+  {
+    _flushAggregate();
+    _aggregator.add(packet.data);
+  }
+  if (_aggregatedReceivedTimes.empty())
+  {
+    _aggregateStartedAt = std::chrono::steady_clock::now();
+  }
+  _aggregatedReceivedTimes.push_back(packet.received);
+  _scheduleAggregateFlush();
+}
+
+void PeerRelay::_scheduleAggregateFlush()
+{
+  if (_aggregateFlushPending)
+  {
+    return;
+  }
+  _aggregateFlushPending = true;
+  auto remaining = std::chrono::microseconds(_options.aggregationWindowUs) - (std::chrono::steady_clock::now() - _aggregateStartedAt);
+  auto remainingUs = std::chrono::duration_cast<std::chrono::microseconds>(remaining).count();
+  /* Delayed messages only have millisecond resolution. The window is rounded up to
+     at least 1 ms, reposting with 0 ms would keep the signaling thread spinning. */
+  auto remainingMs = std::max<int64_t>((remainingUs + 999) / 1000, 1);
+  _invoker.AsyncInvokeDelayed<void>(RTC_FROM_HERE,
+                                    _signalingThread,
+                                    rtc::Bind(&PeerRelay::_onAggregateFlushTimer, this),
+                                    static_cast<uint32_t>(remainingMs));
+}
+
+void PeerRelay::_onAggregateFlushTimer()
+{
+  _aggregateFlushPending = false;
+  if (_aggregatedReceivedTimes.empty())
+  {
+    return;
+  }
+  if (std::chrono::steady_clock::now() - _aggregateStartedAt < std::chrono::microseconds(_options.aggregationWindowUs))
+  {
+    _scheduleAggregateFlush();
+    return;
+  }
+  _flushAggregate();
+}
+
+void PeerRelay::_flushAggregate()
+{
+  if (_aggregatedReceivedTimes.empty())
+  {
+    return;
+  }
+  auto count = _aggregator.count();
+  auto payloadSize = _aggregator.payloadSize();
+  auto message = _aggregator.take();
+  auto now = std::chrono::steady_clock::now();
+  _aggregationDelay.add(now - _aggregateStartedAt);
+  if (_sendGameMessage(message))
+  {
+    ++_aggregateMessages;
+    _aggregatedDatagrams += count;
+    _aggregateOverheadSaved += (count - 1) * (_transport == "rtp" ? rtpMessageOverhead : sctpMessageOverhead);
+    _aggregateFramingBytes += message.size() - payloadSize;
+    _gameToPeerTraffic.packets += count;
+    _gameToPeerTraffic.bytes += payloadSize;
+    for (auto const& received : _aggregatedReceivedTimes)
+    {
+      _gameToPeerTraffic.latency.add(now - received);
+    }
+  }
+  else
+  {
+    _gameToPeerTraffic.sendFailures += count;
+  }
+  _aggregatedReceivedTimes.clear();
+}
+
+bool PeerRelay::_isCongested() const
+{
+  return _options.sctpHighWaterMark > 0 &&
+         _dataChannel &&
+         _dataChannel->buffered_amount() > static_cast<uint64_t>(_options.sctpHighWaterMark);
+}
+
+/* returns false when a packet was dropped, either this one or the oldest queued one */
+bool PeerRelay::_queueCongestedPacket(RelayPacket const& packet)
+{
+  /* games cope better with loss than with seconds of queueing */
+  if (_options.congestionPolicy == "drop-new")
+  {
+    ++_congestionDroppedNew;
+    return false;
+  }
+  if (!_congestionBacklog.push(packet))
+  {
+    RelayPacket oldest;
+    _congestionBacklog.pop(oldest);
+    _congestionBacklog.push(packet);
+    ++_congestionDroppedOldest;
+    return false;
+  }
+  return true;
+}
+
+void PeerRelay::_onBufferedAmountChange()
+{
+  RelayPacket packet;
+  while (!_isCongested() &&
+         _congestionBacklog.pop(packet))
+  {
+    if (_dataChannel &&
+        _isConnected)
+    {
+      _sendToPeer(packet);
+    }
+  }
+  _updateCongestion();
+}
+
+void PeerRelay::_updateCongestion()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (_isCongested())
+  {
+    if (!_congested)
+    {
+      _congested = true;
+      _markStatusChanged();
+      _congestedSince = now;
+      ++_congestionEvents;
+    }
+    else if (!_congestionNotified &&
+             now - _congestedSince >= std::chrono::milliseconds(_options.congestionNotifyMs))
+    {
+      _congestionNotified = true;
+      RELAY_LOG_WARN << "peer congested, data channel buffered amount: " << _dataChannel->buffered_amount();
+      if (_congestionCallback)
+      {
+        _congestionCallback(true);
+      }
+    }
+  }
+  else if (_congested)
+  {
+    _congested = false;
+    _markStatusChanged();
+    if (_congestionNotified)
+    {
+      _congestionNotified = false;
+      RELAY_LOG_INFO << "peer no longer congested after " << std::chrono::duration_cast<std::chrono::milliseconds>(now - _congestedSince).count() << " ms";
+      if (_congestionCallback)
+      {
+        _congestionCallback(false);
+      }
+    }
+  }
+}
+
+void PeerRelay::_onPeerMessage(rtc::CopyOnWriteBuffer const& message, bool fromRedundantPath)
+{
+  if (!_framingActive())
+  {
+    _queueDataForGame(message);
+    return;
+  }
+  auto unframe = [this](rtc::CopyOnWriteBuffer const& framedMessage)
+  {
+    if (!unframeMessage(framedMessage, [this](rtc::CopyOnWriteBuffer const& datagram)
+    {
+      _queueDataForGame(datagram);
+    }))
+    {
+      ++_framingErrors;
+    }
+  };
+  auto kind = message.size() > 0 ? static_cast<RelayFrameKind>(message.cdata()[0]) : RelayFrameKind::Datagram;
+  if (kind == RelayFrameKind::FecData ||
+      kind == RelayFrameKind::FecParity)
+  {
+    /* duplicates are dropped by the decoder, so this only sees the first copy */
+    auto unframeFirst = [this, &unframe, fromRedundantPath](rtc::CopyOnWriteBuffer const& framedMessage)
+    {
+      /* without an open redundant path every message arrives on the primary path first */
+      if (_redundantPath &&
+          _redundantPath->isOpen())
+      {
+        ++(fromRedundantPath ? _redundantPathFirst : _primaryPathFirst);
+      }
+      unframe(framedMessage);
+    };
+    if (!_fecDecoder.decode(message, unframeFirst))
+    {
+      ++_framingErrors;
+    }
+    /* the sender tunes its redundancy from our loss reports */
+    auto now = std::chrono::steady_clock::now();
+    if (now - _lastLossReport >= lossReportInterval)
+    {
+      _lastLossReport = now;
+      _sendLossReport();
+    }
+  }
+  else if (kind == RelayFrameKind::LossReport)
+  {
+    uint16_t expected;
+    uint16_t received;
+    if (parseLossReport(message, expected, received))
+    {
+      _onLossReport(expected, received);
+    }
+    else
+    {
+      ++_framingErrors;
+    }
+  }
+  else
+  {
+    unframe(message);
+  }
+}
+
+void PeerRelay::_queueDataForGame(rtc::CopyOnWriteBuffer const& data)
+{
+  /* runs on the signaling thread */
+  ++_peerToGameTraffic.packets;
+  _peerToGameTraffic.bytes += data.size();
+  if (!_peerToGameRing.push({data, std::chrono::steady_clock::now()}))
+  {
+    _peerToGameRingDrops.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  /* datagrams delivered until the posted flush runs go out together */
+  if (!_peerToGameFlushPending.exchange(true))
+  {
+    _invoker.AsyncInvoke<void>(RTC_FROM_HERE,
+                               _gameSocketThread,
+                               rtc::Bind(&PeerRelay::_flushDataForGame, this));
+  }
+}
+
+void PeerRelay::_flushDataForGame()
+{
+  /* runs on the game socket thread */
+  _peerToGameFlushPending.store(false);
+  if (!_localUdpSocket)
+  {
+    return;
+  }
+  RelayPacket packet;
+  while (_peerToGameRing.pop(packet))
+  {
+    _peerToGameQueuedTimes.push_back(packet.received);
+    if (_gameSender.queue(packet.data))
+    {
+      _flushGameSender();
+    }
+  }
+  _flushGameSender();
+}
+
+void PeerRelay::_flushGameSender()
+{
+  _gameSender.flush(_localUdpSocket.get());
+  auto now = std::chrono::steady_clock::now();
+  for (auto const& received : _peerToGameQueuedTimes)
+  {
+    _peerToGameLatency.add(now - received);
+  }
+  _peerToGameQueuedTimes.clear();
+}
+
+void PeerRelay::_holdPreconnectPacket(RelayPacket const& packet)
+{
+  _expirePreconnectPackets(std::chrono::steady_clock::now());
+  ++_preconnectHeld;
+  if (!_preconnectBuffer.push(packet))
+  {
+    /* the newest packets are the most useful to the game, so the oldest one has to go */
+    RelayPacket oldest;
+    _preconnectBuffer.pop(oldest);
+    _preconnectBuffer.push(packet);
+    ++_preconnectOverflowed;
+  }
+}
+
+void PeerRelay::_expirePreconnectPackets(std::chrono::steady_clock::time_point now)
+{
+  auto maxAge = std::chrono::milliseconds(_options.preconnectBufferMs);
+  RelayPacket expired;
+  while (_preconnectBuffer.front() &&
+         now - _preconnectBuffer.front()->received > maxAge)
+  {
+    _preconnectBuffer.pop(expired);
+    ++_preconnectExpired;
+  }
+}
+
+void PeerRelay::_flushPreconnectBuffer()
+{
+  if (!_dataChannel ||
+      _preconnectBuffer.sizeApprox() == 0)
+  {
+    return;
+  }
+  _expirePreconnectPackets(std::chrono::steady_clock::now());
+  RelayPacket packet;
+  std::size_t numFlushed = 0;
+  while (_preconnectBuffer.pop(packet))
+  {
+    /* a burst of held packets can fill the data channel like any other burst */
+    if (_congestionBacklog.sizeApprox() > 0 ||
+        _isCongested())
+    {
+      if (_queueCongestedPacket(packet))
+      {
+        ++_preconnectSaved;
+      }
+    }
+    else
+    {
+      _sendToPeer(packet);
+      ++_preconnectSaved;
+    }
+    ++numFlushed;
   }
+  RELAY_LOG_DEBUG << "flushed " << numFlushed << " game packets held until the data channel opened";
+  _updateCongestion();
 }
 
 } // namespace faf
@@ -4,12 +4,28 @@
 #include <functional>
 #include <chrono>
 #include <array>
+#include <atomic>
+#include <vector>
 
 #include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/rtc_base/asyncinvoker.h>
 
 #include <third_party/json/json.h>
 
+#include "ConnectionAttemptLog.h"
+#include "FecCodec.h"
+#include "IceAdapterOptions.h"
+#include "LatencyHistogram.h"
+#include "PathMigrationPolicy.h"
+#include "PeerConnectionPool.h"
+#include "PortAllocatorFactory.h"
+#include "RedundantPath.h"
+#include "ReconnectScheduler.h"
+#include "RelayFraming.h"
+#include "RelayStatsHistory.h"
+#include "SpscRing.h"
 #include "Timer.h"
+#include "UdpBatch.h"
 
 namespace faf {
 
@@ -20,6 +36,38 @@ class SetRemoteDescriptionObserver;
 class PeerConnectionObserver;
 class DataChannelObserver;
 class RTCStatsCollectorCallback;
+class RTCStatsSampleCallback;
+
+/*! \brief A datagram on its way through a PeerRelay
+ */
+struct RelayPacket
+{
+  rtc::CopyOnWriteBuffer data;
+  std::chrono::steady_clock::time_point received;
+};
+
+/*! \brief Packet counters of one direction of a PeerRelay
+ */
+struct RelayTrafficCounters
+{
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t droppedNotConnected = 0;
+  uint64_t droppedChannelNotOpen = 0;
+  uint64_t sendFailures = 0;
+  LatencyHistogram latency;
+};
+
+/*! \brief Counters and durations of one way to recover a failed connection
+ */
+struct RelayRecoveryStats
+{
+  uint64_t attempts = 0;
+  uint64_t succeeded = 0;
+  std::chrono::steady_clock::duration last{0};
+  std::chrono::steady_clock::duration total{0};
+  std::chrono::steady_clock::duration max{0};
+};
 
 class PeerRelay : public sigslot::has_slots<>
 {
@@ -28,40 +76,150 @@ public:
             std::string const& remotePlayerLogin,
             bool createOffer,
             int gameUdpPort,
-            rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory);
+            rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+            rtc::Thread* gameSocketThread,
+            IceAdapterOptions const& options);
   virtual ~PeerRelay();
 
   typedef std::function<void (Json::Value const& iceMsg)> IceMessageCallback;
   void setIceMessageCallback(IceMessageCallback cb);
 
+  /** \brief Receives the candidates collected within --ice-batch-window-ms as one array.
+             Without it, batched candidates are passed to the IceMessageCallback one by one.
+      */
+  typedef std::function<void (Json::Value const& iceMsgs)> IceMessageBatchCallback;
+  void setIceMessageBatchCallback(IceMessageBatchCallback cb);
+
   typedef std::function<void (std::string const& state)> StateCallback;
   void setStateCallback(StateCallback cb);
 
   typedef std::function<void (bool)> ConnectedCallback;
   void setConnectedCallback(ConnectedCallback cb);
 
+  typedef std::function<void (bool)> CongestionCallback;
+  void setCongestionCallback(CongestionCallback cb);
+
   void setIceServers(webrtc::PeerConnectionInterface::IceServers const& iceServers);
 
+  /** \brief Take PeerConnections for the SCTP transport from pool instead of creating them.
+       \param pool: must outlive this relay, nullptr disables pooling
+      */
+  void setPeerConnectionPool(PeerConnectionPool* pool);
+
+  /** \brief Create the port allocators of new PeerConnections with factory.
+       \param factory: must outlive this relay, nullptr uses the default allocator of the PeerConnectionFactory
+      */
+  void setPortAllocatorFactory(PortAllocatorFactory* factory);
+
+  /** \brief Use this DTLS certificate for new PeerConnections instead of generating one each.
+      */
+  void setCertificate(rtc::scoped_refptr<rtc::RTCCertificate> const& certificate);
+
   void addIceMessage(Json::Value const& iceMsg);
 
+  /** \brief Keep a second, TURN relayed connection to the peer and send every
+             game message over both. Disabling closes the connection on both sides.
+       \returns false if redundancy is unavailable, see --redundant-path
+      */
+  bool setRedundancy(bool enabled);
+
   void reinit();
 
   int localUdpSocketPort() const;
 
   Json::Value status() const;
 
+  /** \brief Changes whenever a field of statusSummary() changes, without building it.
+       \returns a number that only grows
+      */
+  uint64_t statusRevision() const;
+
+  /** \brief The few fields of status() sent to subscribers of subscribeStatus
+       \returns a flat JSON object
+      */
+  Json::Value statusSummary() const;
+
+  /** \brief The periodic connection samples, see --stats-interval-ms
+       \param maxSamples: the number of most recent samples, 0 for all kept samples
+       \returns The samples and the sampling settings as JSON structure
+      */
+  Json::Value relayStats(std::size_t maxSamples) const;
+
+  /** \brief The phase timestamps of the last connection attempts, see --connect-attempt-history */
+  ConnectionAttemptLog const& connectionAttempts() const;
+
 protected:
   void _closePeerConnection();
   void _setIceState(std::string const& state);
   void _setConnected(bool connected);
+  void _markStatusChanged();
   void _checkConnectionTimeout();
+  void _onIceFailed();
+  void _recoverConnection(std::string const& reason);
+  int _stateTimeoutMs(std::string const& state) const;
+  void _restartIce();
+  void _createIceRestartOffer();
+  void _evaluatePathMigration(std::vector<CandidatePairSample> const& pairs,
+                              std::string const& selectedPairId);
+  void _rebuildPeerConnection();
+  void _onIceRestartTimeout(uint32_t restartGeneration);
+  void _onRecovered();
+  std::string _negotiatedTransport() const;
+  Json::Value _localCaps() const;
+  void _setLocalDescription(webrtc::SessionDescriptionInterface* sdp);
+  void _createDataChannel(bool negotiated);
+  void _onRemoteOfferSet();
+  void _sampleStats();
+  void _sendIceMessage(Json::Value const& iceMsg);
+  void _onIceBatchTimer(uint32_t batchGeneration);
+  void _flushIceMessageBatch();
   void _onPeerdataFromGame(rtc::AsyncSocket* socket);
+  void _drainGameToPeerRing();
+  void _sendToPeer(RelayPacket const& packet);
+  bool _sendGameMessage(rtc::CopyOnWriteBuffer const& message);
+  bool _sendMessageToPeer(rtc::CopyOnWriteBuffer const& message);
+  /* the "framing" flag of the local caps */
+  bool _wantsFraming() const;
+  bool _framingActive() const;
+  bool _remoteHasFeature(std::string const& feature) const;
+  bool _aggregationActive() const;
+  bool _fecActive() const;
+  void _onLossReport(uint16_t expected, uint16_t received);
+  void _sendLossReport();
+  void _openRedundantPath();
+  void _createRedundantPath(bool createOffer);
+  void _addPathIceMessage(Json::Value const& iceMsg);
+  void _onRedundantPathFailed();
+  void _aggregatePacket(RelayPacket const& packet);
+  void _scheduleAggregateFlush();
+  void _onAggregateFlushTimer();
+  void _flushAggregate();
+  bool _isCongested() const;
+  bool _queueCongestedPacket(RelayPacket const& packet);
+  void _onBufferedAmountChange();
+  void _updateCongestion();
+  void _holdPreconnectPacket(RelayPacket const& packet);
+  void _expirePreconnectPackets(std::chrono::steady_clock::time_point now);
+  void _flushPreconnectBuffer();
+  void _onPeerMessage(rtc::CopyOnWriteBuffer const& message, bool fromRedundantPath);
+  void _queueDataForGame(rtc::CopyOnWriteBuffer const& data);
+  void _flushDataForGame();
+  void _flushGameSender();
+
+  IceAdapterOptions _options;
 
   /* runtime objects for WebRTC */
   rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> _pcfactory;
+  rtc::Thread* _signalingThread;
+  rtc::Thread* _gameSocketThread;
   webrtc::PeerConnectionInterface::IceServers _iceServerList;
+  rtc::scoped_refptr<rtc::RTCCertificate> _certificate;
   rtc::scoped_refptr<webrtc::PeerConnectionInterface> _peerConnection;
   rtc::scoped_refptr<webrtc::DataChannelInterface> _dataChannel;
+  PeerConnectionPool* _peerConnectionPool;
+  PortAllocatorFactory* _portAllocatorFactory;
+  /* set if _peerConnection was taken from the pool */
+  std::shared_ptr<PooledPeerConnectionObserver> _pooledObserver;
 
   /* Callback objects for WebRTC API calls */
   rtc::scoped_refptr<CreateOfferObserver> _createOfferObserver;
@@ -69,6 +227,7 @@ protected:
   rtc::scoped_refptr<SetLocalDescriptionObserver> _setLocalDescriptionObserver;
   rtc::scoped_refptr<SetRemoteDescriptionObserver> _setRemoteDescriptionObserver;
   rtc::scoped_refptr<RTCStatsCollectorCallback> _rtcStatsCollectorCallback;
+  rtc::scoped_refptr<RTCStatsSampleCallback> _rtcStatsSampleCallback;
   std::unique_ptr<DataChannelObserver> _dataChannelObserver;
   std::shared_ptr<PeerConnectionObserver> _peerConnectionObserver;
 
@@ -77,19 +236,89 @@ protected:
   std::string _remotePlayerLogin;
   bool _createOffer;
 
-  /* game P2P socket data */
+  /* game P2P socket data, only accessed on the game socket thread */
   rtc::SocketAddress _gameUdpAddress;
   std::unique_ptr<rtc::AsyncSocket> _localUdpSocket;
   int _localUdpSocketPort;
-  std::array<char, 2048> _readBuffer;
+  UdpBatchReceiver _gameReceiver;
+  UdpBatchSender _gameSender;
+  std::vector<std::chrono::steady_clock::time_point> _peerToGameQueuedTimes;
+  LatencyHistogram _peerToGameLatency;
+
+  /* handoff between the game socket thread and the data channel on the signaling thread */
+  SpscRing<RelayPacket> _gameToPeerRing;
+  SpscRing<RelayPacket> _peerToGameRing;
+  std::atomic<bool> _gameToPeerDrainPending;
+  std::atomic<bool> _peerToGameFlushPending;
+  std::atomic<uint64_t> _gameToPeerRingDrops;
+  std::atomic<uint64_t> _peerToGameRingDrops;
+
+  /* traffic counters, only accessed on the signaling thread */
+  RelayTrafficCounters _gameToPeerTraffic;
+  RelayTrafficCounters _peerToGameTraffic;
+
+  /* backpressure state, only accessed on the signaling thread */
+  SpscRing<RelayPacket> _congestionBacklog;
+  bool _congested;
+  bool _congestionNotified;
+  std::chrono::steady_clock::time_point _congestedSince;
+  uint64_t _congestionEvents;
+  uint64_t _congestionDroppedNew;
+  uint64_t _congestionDroppedOldest;
+
+  /* game packets held until the data channel opens, only accessed on the signaling thread */
+  SpscRing<RelayPacket> _preconnectBuffer;
+  uint64_t _preconnectHeld;
+  uint64_t _preconnectSaved;
+  uint64_t _preconnectExpired;
+  uint64_t _preconnectOverflowed;
+
+  /* message framing and small packet aggregation, only accessed on the signaling thread */
+  uint64_t _framingErrors;
+  PacketAggregator _aggregator;
+  std::vector<std::chrono::steady_clock::time_point> _aggregatedReceivedTimes;
+  std::chrono::steady_clock::time_point _aggregateStartedAt;
+  bool _aggregateFlushPending;
+  uint64_t _aggregateMessages;
+  uint64_t _aggregatedDatagrams;
+  uint64_t _aggregateOverheadSaved;
+  uint64_t _aggregateFramingBytes;
+  LatencyHistogram _aggregationDelay;
+
+  /* forward error correction, only accessed on the signaling thread */
+  FecEncoder _fecEncoder;
+  FecDecoder _fecDecoder;
+  std::chrono::steady_clock::time_point _lastLossReport;
+  uint64_t _lossReports;
+  double _peerLossRate;
+
+  /* redundant second connection to the peer, only accessed on the signaling thread */
+  bool _redundancyEnabled;
+  bool _redundancyRequestedByPeer;
+  std::unique_ptr<RedundantPath> _redundantPath;
+  ReconnectScheduler _redundantPathReconnect;
+  uint64_t _redundantPathCopies;
+  uint64_t _primaryPathFirst;
+  uint64_t _redundantPathFirst;
 
   /* callbacks */
   IceMessageCallback _iceMessageCallback;
   StateCallback _stateCallback;
   ConnectedCallback _connectedCallback;
+  CongestionCallback _congestionCallback;
+  IceMessageBatchCallback _iceMessageBatchCallback;
+
+  /* trickle candidates collected for one onIceMsgBatch, only accessed on the signaling thread */
+  Json::Value _iceMessageBatch;
+  uint32_t _iceBatchGeneration;
+  uint64_t _iceMessagesSent;
+  uint64_t _iceBatchesSent;
+  uint64_t _iceBatchedMessages;
 
   /* ICE state data */
   bool _receivedOffer;
+  bool _remoteCapsReceived;
+  bool _dataChannelNegotiated;
   bool _isConnected;
   bool _closing;
   std::string _iceState;
@@ -98,12 +327,43 @@ protected:
   std::string _localCandType;
   std::string _remoteCandType;
   std::string _localSdp;
+  /* bumped on every state change of statusSummary(), its counters are added by statusRevision() */
+  uint64_t _statusRevision;
 
-  /* connectivity check data */
+  /* transport negotiation: "sctp" or "rtp" data channels for the current PeerConnection
+     and the capabilities the peer sent with its last offer or answer */
+  std::string _transport;
+  Json::Value _remoteCaps;
+  uint64_t _rtpOversizeDrops;
+
+  /* recovery from failed ICE connections: the offerer restarts ICE on the existing
+     PeerConnection and only recreates it if that fails. _session identifies the
+     offerer's PeerConnection, so the answerer can tell both apart. */
+  uint32_t _session;
+  std::string _recoveryMethod;
+  std::chrono::steady_clock::time_point _recoveryStartedAt;
+  uint32_t _iceRestartGeneration;
+  RelayRecoveryStats _iceRestartRecovery;
+  RelayRecoveryStats _rebuildRecovery;
+
+  /* connectivity check data, only the offerer recreates stuck or failed connections */
   Timer _checkConnectionTimer;
+  ReconnectScheduler _reconnectScheduler;
+  std::chrono::steady_clock::time_point _iceStateSince;
   std::chrono::steady_clock::time_point _connectStartTime;
+  std::chrono::steady_clock::duration _localDescriptionDuration;
+  std::chrono::steady_clock::duration _gatheringDuration;
+  Json::Value _gatheredCandidates;
   std::chrono::steady_clock::duration _connectDuration;
-  std::chrono::steady_clock::duration _connectionAttemptTimeout;
+  ConnectionAttemptLog _connectionAttempts;
+
+  /* periodic connection samples, only accessed on the signaling thread */
+  Timer _statsTimer;
+  RelayStatsHistory _statsHistory;
+  PathMigrationPolicy _pathMigration;
+  /* the ICE restart offer of a migration waits for its answer, see _checkConnectionTimeout() */
+  bool _migrationPending;
+  std::chrono::steady_clock::time_point _migrationStartedAt;
 
   /* access declarations for observers */
   friend CreateOfferObserver;
@@ -113,6 +373,10 @@ protected:
   friend PeerConnectionObserver;
   friend DataChannelObserver;
   friend RTCStatsCollectorCallback;
+  friend RTCStatsSampleCallback;
+
+  /* must be destroyed first to cancel pending calls into this relay */
+  rtc::AsyncInvoker _invoker;
 
   RTC_DISALLOW_COPY_AND_ASSIGN(PeerRelay);
 };
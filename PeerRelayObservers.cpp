@@ -1,5 +1,7 @@
 #include "PeerRelayObservers.h"
 
+#include <algorithm>
+
 #include <webrtc/api/stats/rtcstats_objects.h>
 
 #include "logging.h"
@@ -14,14 +16,52 @@ namespace faf {
 #define OBSERVER_LOG_DEBUG FAF_LOG_DEBUG << "PeerRelay for " << _relay->_remotePlayerLogin << " (" << _relay->_remotePlayerId << "): "
 #define OBSERVER_LOG_TRACE FAF_LOG_TRACE << "PeerRelay for " << _relay->_remotePlayerLogin << " (" << _relay->_remotePlayerId << "): "
 
+char const* iceConnectionStateName(webrtc::PeerConnectionInterface::IceConnectionState state)
+{
+  switch (state)
+  {
+    case webrtc::PeerConnectionInterface::kIceConnectionNew:
+      return "new";
+    case webrtc::PeerConnectionInterface::kIceConnectionChecking:
+      return "checking";
+    case webrtc::PeerConnectionInterface::kIceConnectionConnected:
+      return "connected";
+    case webrtc::PeerConnectionInterface::kIceConnectionCompleted:
+      return "completed";
+    case webrtc::PeerConnectionInterface::kIceConnectionFailed:
+      return "failed";
+    case webrtc::PeerConnectionInterface::kIceConnectionDisconnected:
+      return "disconnected";
+    case webrtc::PeerConnectionInterface::kIceConnectionClosed:
+      return "closed";
+    case webrtc::PeerConnectionInterface::kIceConnectionMax:
+      /* not in https://developer.mozilla.org/en-US/docs/Web/API/RTCPeerConnection/iceConnectionState */
+      break;
+  }
+  return nullptr;
+}
+
+Json::Value iceCandidateMessage(webrtc::IceCandidateInterface const* candidate)
+{
+  Json::Value candidateJson;
+  std::string candidateString;
+  candidate->ToString(&candidateString);
+  candidateJson["candidate"] = candidateString;
+  candidateJson["sdpMid"] = candidate->sdp_mid();
+  candidateJson["sdpMLineIndex"] = candidate->sdp_mline_index();
+  Json::Value iceMsg;
+  iceMsg["type"] = "candidate";
+  iceMsg["candidate"] = candidateJson;
+  return iceMsg;
+}
+
 void CreateOfferObserver::OnSuccess(webrtc::SessionDescriptionInterface *sdp)
 {
   OBSERVER_LOG_TRACE << "CreateOfferObserver::OnSuccess";
+  _relay->_connectionAttempts.mark(ConnectionPhase::SdpCreated, std::chrono::steady_clock::now());
   if (_relay->_peerConnection)
   {
-    sdp->ToString(&_relay->_localSdp);
-    _relay->_peerConnection->SetLocalDescription(_relay->_setLocalDescriptionObserver,
-                                                 sdp);
+    _relay->_setLocalDescription(sdp);
   }
 }
 
@@ -33,11 +73,10 @@ void CreateOfferObserver::OnFailure(const std::string &msg)
 void CreateAnswerObserver::OnSuccess(webrtc::SessionDescriptionInterface *sdp)
 {
   OBSERVER_LOG_TRACE << "CreateAnswerObserver::OnSuccess";
+  _relay->_connectionAttempts.mark(ConnectionPhase::SdpCreated, std::chrono::steady_clock::now());
   if (_relay->_peerConnection)
   {
-    sdp->ToString(&_relay->_localSdp);
-    _relay->_peerConnection->SetLocalDescription(_relay->_setLocalDescriptionObserver,
-                                                 sdp);
+    _relay->_setLocalDescription(sdp);
   }
 }
 
@@ -49,14 +88,18 @@ void CreateAnswerObserver::OnFailure(const std::string &msg)
 void SetLocalDescriptionObserver::OnSuccess()
 {
   OBSERVER_LOG_DEBUG << "SetLocalDescriptionObserver::OnSuccess";
-  if (_relay->_iceMessageCallback)
+  _relay->_connectionAttempts.mark(ConnectionPhase::LocalDescription, std::chrono::steady_clock::now());
+  if (_relay->_localDescriptionDuration == std::chrono::steady_clock::duration::zero())
   {
-    Json::Value iceMsg;
-    std::string sdpString;
-    iceMsg["type"] = _relay->_createOffer ? "offer" : "answer";
-    iceMsg["sdp"] = _relay->_localSdp;
-    _relay->_iceMessageCallback(iceMsg);
+    _relay->_localDescriptionDuration = std::chrono::steady_clock::now() - _relay->_connectStartTime;
   }
+  Json::Value iceMsg;
+  iceMsg["type"] = _relay->_createOffer ? "offer" : "answer";
+  iceMsg["sdp"] = _relay->_localSdp;
+  iceMsg["caps"] = _relay->_localCaps();
+  /* the answer names the session it answers, so the offerer can drop answers to a replaced PeerConnection */
+  iceMsg["session"] = static_cast<Json::UInt>(_relay->_session);
+  _relay->_sendIceMessage(iceMsg);
 }
 
 void SetLocalDescriptionObserver::OnFailure(const std::string &msg)
@@ -67,9 +110,11 @@ void SetLocalDescriptionObserver::OnFailure(const std::string &msg)
 void SetRemoteDescriptionObserver::OnSuccess()
 {
   OBSERVER_LOG_DEBUG << "SetRemoteDescriptionObserver::OnSuccess";
+  _relay->_connectionAttempts.mark(ConnectionPhase::RemoteDescription, std::chrono::steady_clock::now());
   if (_relay->_peerConnection &&
       !_relay->_createOffer)
   {
+    _relay->_onRemoteOfferSet();
     _relay->_peerConnection->CreateAnswer(_relay->_createAnswerObserver,
                                       nullptr);
   }
@@ -88,57 +133,37 @@ void PeerConnectionObserver::OnSignalingChange(webrtc::PeerConnectionInterface::
 void PeerConnectionObserver::OnIceConnectionChange(webrtc::PeerConnectionInterface::IceConnectionState new_state)
 {
   OBSERVER_LOG_DEBUG << "PeerConnectionObserver::OnIceConnectionChange" << static_cast<int>(new_state);
-  switch (new_state)
+  auto state = iceConnectionStateName(new_state);
+  if (state)
   {
-    case webrtc::PeerConnectionInterface::kIceConnectionNew:
-      _relay->_setIceState("new");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionChecking:
-      _relay->_setIceState("checking");
-    break;
-    case webrtc::PeerConnectionInterface::kIceConnectionConnected:
-      _relay->_setIceState("connected");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionCompleted:
-      _relay->_setIceState("completed");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionFailed:
-      _relay->_setIceState("failed");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionDisconnected:
-      _relay->_setIceState("disconnected");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionClosed:
-      _relay->_setIceState("closed");
-      break;
-    case webrtc::PeerConnectionInterface::kIceConnectionMax:
-      /* not in https://developer.mozilla.org/en-US/docs/Web/API/RTCPeerConnection/iceConnectionState */
-      break;
+    _relay->_setIceState(state);
   }
 }
 
 void PeerConnectionObserver::OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state)
 {
   OBSERVER_LOG_DEBUG << "PeerConnectionObserver::OnIceGatheringChange" << static_cast<int>(new_state);
+  if (new_state == webrtc::PeerConnectionInterface::kIceGatheringComplete &&
+      _relay->_gatheringDuration == std::chrono::steady_clock::duration::zero())
+  {
+    _relay->_gatheringDuration = std::chrono::steady_clock::now() - _relay->_connectStartTime;
+  }
+  if (new_state == webrtc::PeerConnectionInterface::kIceGatheringComplete)
+  {
+    _relay->_connectionAttempts.mark(ConnectionPhase::Gathered, std::chrono::steady_clock::now());
+    /* no more candidates to wait for */
+    _relay->_flushIceMessageBatch();
+  }
 }
 
 void PeerConnectionObserver::OnIceCandidate(const webrtc::IceCandidateInterface *candidate)
 {
   OBSERVER_LOG_DEBUG << "PeerConnectionObserver::OnIceCandidate";
+  _relay->_connectionAttempts.mark(ConnectionPhase::FirstCandidate, std::chrono::steady_clock::now());
+  auto& candidateCount = _relay->_gatheredCandidates[candidate->candidate().type()];
+  candidateCount = candidateCount.asUInt64() + 1;
 
-  if (_relay->_iceMessageCallback)
-  {
-    Json::Value candidateJson;
-    std::string candidateString;
-    candidate->ToString(&candidateString);
-    candidateJson["candidate"] = candidateString;
-    candidateJson["sdpMid"] = candidate->sdp_mid();
-    candidateJson["sdpMLineIndex"] = candidate->sdp_mline_index();
-    Json::Value iceMsg;
-    iceMsg["type"] = "candidate";
-    iceMsg["candidate"] = candidateJson;
-    _relay->_iceMessageCallback(iceMsg);
-  }
+  _relay->_sendIceMessage(iceCandidateMessage(candidate));
 }
 
 void PeerConnectionObserver::OnRenegotiationNeeded()
@@ -149,6 +174,13 @@ void PeerConnectionObserver::OnRenegotiationNeeded()
 void PeerConnectionObserver::OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel)
 {
   OBSERVER_LOG_DEBUG << "PeerConnectionObserver::OnDataChannel";
+  /* an in-band channel replaces a pre-negotiated one the offerer gave up on */
+  if (_relay->_dataChannel)
+  {
+    _relay->_dataChannel->UnregisterObserver();
+    _relay->_dataChannel->Close();
+  }
+  _relay->_dataChannelNegotiated = false;
   _relay->_dataChannel = data_channel;
   _relay->_dataChannel->RegisterObserver(_relay->_dataChannelObserver.get());
 }
@@ -174,7 +206,9 @@ void DataChannelObserver::OnStateChange()
         break;
       case webrtc::DataChannelInterface::kOpen:
         OBSERVER_LOG_DEBUG << "DataChannelObserver::OnStateChange to Open";
+        _relay->_connectionAttempts.mark(ConnectionPhase::DataChannelOpen, std::chrono::steady_clock::now());
         _relay->_setConnected(true);
+        _relay->_flushPreconnectBuffer();
         break;
       case webrtc::DataChannelInterface::kClosing:
         OBSERVER_LOG_DEBUG << "DataChannelObserver::OnStateChange to Closing";
@@ -188,14 +222,27 @@ void DataChannelObserver::OnStateChange()
 }
 void DataChannelObserver::OnMessage(const webrtc::DataBuffer& buffer)
 {
-  OBSERVER_LOG_DEBUG << "DataChannelObserver::OnMessage";
-  if (_relay->_localUdpSocket)
-  {
-    _relay->_localUdpSocket->SendTo(buffer.data.cdata(),
-                                    buffer.data.size(),
-                                    _relay->_gameUdpAddress);
-  }
-  OBSERVER_LOG_DEBUG << "DataChannelObserver::OnMessage done";
+  _relay->_onPeerMessage(buffer.data, false);
+}
+
+void DataChannelObserver::OnBufferedAmountChange(uint64_t previous_amount)
+{
+  _relay->_onBufferedAmountChange();
+}
+
+/* optional stats members are only dereferenced if WebRTC reported them */
+static bool pairSucceeded(webrtc::RTCIceCandidatePairStats const* pair)
+{
+  return pair->state.is_defined() &&
+         *pair->state == "succeeded";
+}
+
+static bool candidateRelayed(webrtc::RTCStats const* stats)
+{
+  auto candidate = static_cast<webrtc::RTCIceCandidateStats const*>(stats);
+  return candidate &&
+         candidate->candidate_type.is_defined() &&
+         *candidate->candidate_type == "relay";
 }
 
 void RTCStatsCollectorCallback::OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report)
@@ -210,7 +257,9 @@ void RTCStatsCollectorCallback::OnStatsDelivered(const rtc::scoped_refptr<const
   auto pairs = report->GetStatsOfType<webrtc::RTCIceCandidatePairStats>();
   for (auto pair: pairs)
   {
-    if (*pair->state == "succeeded")
+    if (pairSucceeded(pair) &&
+        pair->local_candidate_id.is_defined() &&
+        pair->remote_candidate_id.is_defined())
     {
       localCandId = *pair->local_candidate_id;
       remoteCandId = *pair->remote_candidate_id;
@@ -221,6 +270,8 @@ void RTCStatsCollectorCallback::OnStatsDelivered(const rtc::scoped_refptr<const
   {
     return;
   }
+  auto previousLocalCand = _relay->_localCandType + _relay->_localCandAddress;
+  auto previousRemoteCand = _relay->_remoteCandType + _relay->_remoteCandAddress;
   auto lCand = static_cast<webrtc::RTCLocalIceCandidateStats const*>(report->Get(localCandId));
   if (lCand)
   {
@@ -233,6 +284,94 @@ void RTCStatsCollectorCallback::OnStatsDelivered(const rtc::scoped_refptr<const
     _relay->_remoteCandAddress = *rCand->protocol + " " + *rCand->ip +":" + std::to_string(*rCand->port);
     _relay->_remoteCandType = *rCand->candidate_type;
   }
+  if (_relay->_localCandType + _relay->_localCandAddress != previousLocalCand ||
+      _relay->_remoteCandType + _relay->_remoteCandAddress != previousRemoteCand)
+  {
+    _relay->_markStatusChanged();
+  }
+}
+
+void RTCStatsSampleCallback::OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report)
+{
+  if (!_relay ||
+      !report)
+  {
+    return;
+  }
+  RelayStatsSample sample;
+  sample.timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  sample.iceState = _relay->_iceState;
+  sample.localCandType = _relay->_localCandType;
+  sample.remoteCandType = _relay->_remoteCandType;
+  sample.packetsSent = _relay->_gameToPeerTraffic.packets;
+  sample.packetsReceived = _relay->_peerToGameTraffic.packets;
+
+  /* the transport knows the selected pair, before that take any succeeded one */
+  webrtc::RTCIceCandidatePairStats const* selectedPair = nullptr;
+  for (auto transport: report->GetStatsOfType<webrtc::RTCTransportStats>())
+  {
+    if (transport->selected_candidate_pair_id.is_defined())
+    {
+      selectedPair = static_cast<webrtc::RTCIceCandidatePairStats const*>(report->Get(*transport->selected_candidate_pair_id));
+      break;
+    }
+  }
+  if (!selectedPair)
+  {
+    for (auto pair: report->GetStatsOfType<webrtc::RTCIceCandidatePairStats>())
+    {
+      if (pairSucceeded(pair))
+      {
+        selectedPair = pair;
+        break;
+      }
+    }
+  }
+  std::vector<CandidatePairSample> pairs;
+  for (auto pair: report->GetStatsOfType<webrtc::RTCIceCandidatePairStats>())
+  {
+    if (!pairSucceeded(pair))
+    {
+      continue;
+    }
+    CandidatePairSample pairSample;
+    pairSample.id = pair->id();
+    pairSample.relayed = (pair->local_candidate_id.is_defined() && candidateRelayed(report->Get(*pair->local_candidate_id))) ||
+                         (pair->remote_candidate_id.is_defined() && candidateRelayed(report->Get(*pair->remote_candidate_id)));
+    if (pair->current_round_trip_time.is_defined())
+    {
+      pairSample.rttMs = *pair->current_round_trip_time * 1000.;
+    }
+    if (pair->requests_sent.is_defined() &&
+        pair->responses_received.is_defined() &&
+        *pair->requests_sent > 0)
+    {
+      pairSample.loss = 1. - std::min(1., static_cast<double>(*pair->responses_received) / *pair->requests_sent);
+    }
+    pairs.push_back(pairSample);
+  }
+  _relay->_evaluatePathMigration(pairs, selectedPair ? selectedPair->id() : std::string());
+
+  if (selectedPair)
+  {
+    if (selectedPair->current_round_trip_time.is_defined())
+    {
+      sample.rttMs = *selectedPair->current_round_trip_time * 1000.;
+    }
+    if (selectedPair->available_outgoing_bitrate.is_defined())
+    {
+      sample.availableOutgoingBitrate = *selectedPair->available_outgoing_bitrate;
+    }
+    if (selectedPair->bytes_sent.is_defined())
+    {
+      sample.bytesSent = *selectedPair->bytes_sent;
+    }
+    if (selectedPair->bytes_received.is_defined())
+    {
+      sample.bytesReceived = *selectedPair->bytes_received;
+    }
+  }
+  _relay->_statsHistory.add(sample);
 }
 
 } // namespace faf
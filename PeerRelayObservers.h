@@ -2,10 +2,21 @@
 
 #include <webrtc/api/peerconnectioninterface.h>
 
+#include <third_party/json/json.h>
+
 namespace faf {
 
 class PeerRelay;
 
+/** \brief The name of an ICE connection state as used in the status and the state callbacks
+     \returns nullptr for kIceConnectionMax
+    */
+char const* iceConnectionStateName(webrtc::PeerConnectionInterface::IceConnectionState state);
+
+/** \brief Build the "candidate" ICE message for a local candidate
+    */
+Json::Value iceCandidateMessage(webrtc::IceCandidateInterface const* candidate);
+
 class CreateOfferObserver : public webrtc::CreateSessionDescriptionObserver
 {
 private:
@@ -84,6 +95,7 @@ private:
 
   virtual void OnStateChange() override;
   virtual void OnMessage(const webrtc::DataBuffer& buffer) override;
+  virtual void OnBufferedAmountChange(uint64_t previous_amount) override;
 };
 
 class RTCStatsCollectorCallback : public webrtc::RTCStatsCollectorCallback
@@ -97,4 +109,20 @@ private:
   virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override;
 };
 
+/*! \brief Adds a periodic stats report of the selected candidate pair to the relay's history.
+ *         Reports may arrive after the relay is gone, so the relay detaches on destruction.
+ */
+class RTCStatsSampleCallback : public webrtc::RTCStatsCollectorCallback
+{
+private:
+  PeerRelay* _relay;
+
+public:
+  explicit RTCStatsSampleCallback(PeerRelay *relay) : _relay(relay) {}
+
+  void detach() { _relay = nullptr; }
+
+  virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override;
+};
+
 } // namespace faf
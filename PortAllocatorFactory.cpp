@@ -0,0 +1,152 @@
+#include "PortAllocatorFactory.h"
+
+#include <algorithm>
+
+#include <webrtc/p2p/client/basicportallocator.h>
+
+#include "logging.h"
+
+namespace faf {
+
+CountingPacketSocketFactory::CountingPacketSocketFactory():
+  _udpSockets(0),
+  _tcpSockets(0)
+{
+}
+
+rtc::AsyncPacketSocket* CountingPacketSocketFactory::CreateUdpSocket(const rtc::SocketAddress& address,
+                                                                     uint16_t min_port,
+                                                                     uint16_t max_port)
+{
+  auto result = rtc::BasicPacketSocketFactory::CreateUdpSocket(address, min_port, max_port);
+  if (result)
+  {
+    _udpSockets.fetch_add(1, std::memory_order_relaxed);
+  }
+  return result;
+}
+
+rtc::AsyncPacketSocket* CountingPacketSocketFactory::CreateServerTcpSocket(const rtc::SocketAddress& local_address,
+                                                                           uint16_t min_port,
+                                                                           uint16_t max_port,
+                                                                           int opts)
+{
+  auto result = rtc::BasicPacketSocketFactory::CreateServerTcpSocket(local_address, min_port, max_port, opts);
+  if (result)
+  {
+    _tcpSockets.fetch_add(1, std::memory_order_relaxed);
+  }
+  return result;
+}
+
+rtc::AsyncPacketSocket* CountingPacketSocketFactory::CreateClientTcpSocket(const rtc::SocketAddress& local_address,
+                                                                           const rtc::SocketAddress& remote_address,
+                                                                           const rtc::ProxyInfo& proxy_info,
+                                                                           const std::string& user_agent,
+                                                                           int opts)
+{
+  auto result = rtc::BasicPacketSocketFactory::CreateClientTcpSocket(local_address, remote_address, proxy_info, user_agent, opts);
+  if (result)
+  {
+    _tcpSockets.fetch_add(1, std::memory_order_relaxed);
+  }
+  return result;
+}
+
+uint64_t CountingPacketSocketFactory::udpSockets() const
+{
+  return _udpSockets.load(std::memory_order_relaxed);
+}
+
+uint64_t CountingPacketSocketFactory::tcpSockets() const
+{
+  return _tcpSockets.load(std::memory_order_relaxed);
+}
+
+PortAllocatorFactory::PortAllocatorFactory(rtc::Thread* networkThread,
+                                           std::string const& mode):
+  _networkThread(networkThread),
+  _mode(mode),
+  _networkManager(std::make_unique<rtc::BasicNetworkManager>()),
+  _socketFactory(std::make_unique<CountingPacketSocketFactory>()),
+  _allocators(0)
+{
+}
+
+PortAllocatorFactory::~PortAllocatorFactory()
+{
+  /* the network manager and the sockets are used on the network thread */
+  _networkThread->Invoke<void>(RTC_FROM_HERE, [this]
+  {
+    _socketFactory.reset();
+    _networkManager.reset();
+  });
+}
+
+std::unique_ptr<cricket::PortAllocator> PortAllocatorFactory::create()
+{
+  _allocators.fetch_add(1, std::memory_order_relaxed);
+  return std::make_unique<cricket::BasicPortAllocator>(_networkManager.get(),
+                                                       _socketFactory.get());
+}
+
+void PortAllocatorFactory::configure(webrtc::PeerConnectionInterface::RTCConfiguration& configuration) const
+{
+  if (_mode != "shared")
+  {
+    return;
+  }
+  configuration.tcp_candidate_policy = webrtc::PeerConnectionInterface::kTcpCandidatePolicyDisabled;
+  configuration.prune_turn_ports = true;
+  /* every STUN server sees the same mapping of the shared UDP socket,
+     TURN servers report it with the allocation anyway */
+  bool haveStunServer = false;
+  for (auto& server: configuration.servers)
+  {
+    auto isStun = [](std::string const& url)
+    {
+      return url.compare(0, 5, "stun:") == 0 ||
+             url.compare(0, 6, "stuns:") == 0;
+    };
+    std::vector<std::string> urls;
+    for (auto const& url: server.urls)
+    {
+      if (!isStun(url) ||
+          !haveStunServer)
+      {
+        haveStunServer = haveStunServer || isStun(url);
+        urls.push_back(url);
+      }
+    }
+    server.urls = urls;
+    if (isStun(server.uri))
+    {
+      if (haveStunServer)
+      {
+        server.uri.clear();
+      }
+      haveStunServer = true;
+    }
+  }
+  /* a server without any URL left makes CreatePeerConnection() fail */
+  configuration.servers.erase(std::remove_if(configuration.servers.begin(),
+                                             configuration.servers.end(),
+                                             [](webrtc::PeerConnectionInterface::IceServer const& server)
+                                             {
+                                               return server.urls.empty() &&
+                                                      server.uri.empty();
+                                             }),
+                              configuration.servers.end());
+}
+
+Json::Value PortAllocatorFactory::status() const
+{
+  Json::Value result;
+  result["mode"] = _mode;
+  result["allocators"] = static_cast<Json::UInt64>(_allocators.load(std::memory_order_relaxed));
+  result["udp_sockets"] = static_cast<Json::UInt64>(_socketFactory->udpSockets());
+  result["tcp_sockets"] = static_cast<Json::UInt64>(_socketFactory->tcpSockets());
+  return result;
+}
+
+} // namespace faf
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/p2p/base/basicpacketsocketfactory.h>
+#include <webrtc/p2p/base/portallocator.h>
+#include <webrtc/rtc_base/network.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief Socket factory counting the sockets candidate gathering opens
+ */
+class CountingPacketSocketFactory : public rtc::BasicPacketSocketFactory
+{
+public:
+  CountingPacketSocketFactory();
+
+  virtual rtc::AsyncPacketSocket* CreateUdpSocket(const rtc::SocketAddress& address,
+                                                  uint16_t min_port,
+                                                  uint16_t max_port) override;
+  virtual rtc::AsyncPacketSocket* CreateServerTcpSocket(const rtc::SocketAddress& local_address,
+                                                        uint16_t min_port,
+                                                        uint16_t max_port,
+                                                        int opts) override;
+  virtual rtc::AsyncPacketSocket* CreateClientTcpSocket(const rtc::SocketAddress& local_address,
+                                                        const rtc::SocketAddress& remote_address,
+                                                        const rtc::ProxyInfo& proxy_info,
+                                                        const std::string& user_agent,
+                                                        int opts) override;
+
+  uint64_t udpSockets() const;
+  uint64_t tcpSockets() const;
+
+protected:
+  std::atomic<uint64_t> _udpSockets;
+  std::atomic<uint64_t> _tcpSockets;
+};
+
+/*! \brief Creates the port allocators of all PeerConnections of the adapter.
+ *         They share one network manager and socket factory. In "shared" mode
+ *         the relays also gather less: one STUN server, no TCP candidates and
+ *         only the best TURN port per network.
+ */
+class PortAllocatorFactory
+{
+public:
+  PortAllocatorFactory(rtc::Thread* networkThread,
+                       std::string const& mode);
+  virtual ~PortAllocatorFactory();
+
+  /** \brief A new allocator for one PeerConnection, to be passed to CreatePeerConnection
+      */
+  std::unique_ptr<cricket::PortAllocator> create();
+
+  /** \brief Apply the gathering restrictions of the mode to a PeerConnection configuration
+      */
+  void configure(webrtc::PeerConnectionInterface::RTCConfiguration& configuration) const;
+
+  Json::Value status() const;
+
+protected:
+  rtc::Thread* _networkThread;
+  std::string _mode;
+  std::unique_ptr<rtc::BasicNetworkManager> _networkManager;
+  std::unique_ptr<CountingPacketSocketFactory> _socketFactory;
+  std::atomic<uint64_t> _allocators;
+
+  RTC_DISALLOW_COPY_AND_ASSIGN(PortAllocatorFactory);
+};
+
+} // namespace faf
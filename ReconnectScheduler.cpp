@@ -0,0 +1,83 @@
+#include "ReconnectScheduler.h"
+
+#include <algorithm>
+
+namespace faf {
+
+ReconnectScheduler::ReconnectScheduler(int baseDelayMs, int maxDelayMs):
+  _baseDelay(std::max(baseDelayMs, 1)),
+  _maxDelay(std::max(maxDelayMs, baseDelayMs)),
+  _random(std::random_device()()),
+  _pending(false),
+  _lastDelay(0),
+  _consecutiveAttempts(0),
+  _attempts(0),
+  _cancelled(0)
+{
+}
+
+std::chrono::milliseconds ReconnectScheduler::schedule(std::chrono::steady_clock::time_point now,
+                                                       std::string const& reason)
+{
+  if (_pending)
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::max(_dueAt - now, std::chrono::steady_clock::duration::zero()));
+  }
+  auto delay = _baseDelay;
+  for (uint64_t i = 0; i < _consecutiveAttempts && delay < _maxDelay; ++i)
+  {
+    delay *= 2;
+  }
+  delay = std::min(delay, _maxDelay);
+  std::uniform_real_distribution<double> distribution(1. - jitter, 1. + jitter);
+  delay = std::chrono::milliseconds(static_cast<int64_t>(delay.count() * distribution(_random)));
+
+  _pending = true;
+  _dueAt = now + delay;
+  _lastDelay = delay;
+  _lastReason = reason;
+  return delay;
+}
+
+bool ReconnectScheduler::pending() const
+{
+  return _pending;
+}
+
+bool ReconnectScheduler::takeDue(std::chrono::steady_clock::time_point now)
+{
+  if (!_pending ||
+      now < _dueAt)
+  {
+    return false;
+  }
+  _pending = false;
+  ++_consecutiveAttempts;
+  ++_attempts;
+  return true;
+}
+
+void ReconnectScheduler::onConnected()
+{
+  if (_pending)
+  {
+    ++_cancelled;
+  }
+  _pending = false;
+  _consecutiveAttempts = 0;
+}
+
+Json::Value ReconnectScheduler::status(std::chrono::steady_clock::time_point now) const
+{
+  Json::Value result;
+  result["attempts"] = static_cast<Json::UInt64>(_attempts);
+  result["consecutive_attempts"] = static_cast<Json::UInt64>(_consecutiveAttempts);
+  result["cancelled"] = static_cast<Json::UInt64>(_cancelled);
+  result["pending"] = _pending;
+  result["due_in_ms"] = _pending ? static_cast<Json::Int64>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(_dueAt - now).count(), 0)) : 0;
+  result["last_delay_ms"] = static_cast<Json::Int64>(_lastDelay.count());
+  result["last_reason"] = _lastReason;
+  return result;
+}
+
+} // namespace faf
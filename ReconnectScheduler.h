@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief Decides when a PeerRelay may recreate its PeerConnection.
+ *         Consecutive attempts back off exponentially with random jitter,
+ *         so two adapters do not keep replacing each other's offers.
+ */
+class ReconnectScheduler
+{
+public:
+  ReconnectScheduler(int baseDelayMs, int maxDelayMs);
+
+  /** \brief Schedule an attempt unless one is pending.
+       \returns the delay until the attempt is due
+      */
+  std::chrono::milliseconds schedule(std::chrono::steady_clock::time_point now,
+                                     std::string const& reason);
+
+  bool pending() const;
+
+  /** \brief Take the pending attempt if it is due.
+       \returns true if the caller should recreate the connection now
+      */
+  bool takeDue(std::chrono::steady_clock::time_point now);
+
+  /** \brief The connection is established, resets the backoff and drops a pending attempt */
+  void onConnected();
+
+  Json::Value status(std::chrono::steady_clock::time_point now) const;
+
+protected:
+  /* relative random deviation of every delay */
+  static constexpr double jitter = 0.25;
+
+  std::chrono::milliseconds _baseDelay;
+  std::chrono::milliseconds _maxDelay;
+  std::mt19937 _random;
+  bool _pending;
+  std::chrono::steady_clock::time_point _dueAt;
+  std::chrono::milliseconds _lastDelay;
+  std::string _lastReason;
+  uint64_t _consecutiveAttempts;
+  uint64_t _attempts;
+  uint64_t _cancelled;
+};
+
+} // namespace faf
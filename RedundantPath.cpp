@@ -0,0 +1,321 @@
+#include "RedundantPath.h"
+
+#include "logging.h"
+#include "PeerRelayObservers.h"
+
+namespace faf {
+
+/* WebRTC may still hold the observers when the RedundantPath is gone,
+   so the path detaches them on destruction and they ignore later events. */
+
+class PathCreateSdpObserver : public webrtc::CreateSessionDescriptionObserver
+{
+public:
+  explicit PathCreateSdpObserver(RedundantPath* path) : _path(path) {}
+
+  void detach() { _path = nullptr; }
+
+  virtual void OnSuccess(webrtc::SessionDescriptionInterface* sdp) override
+  {
+    if (!_path ||
+        !_path->_peerConnection)
+    {
+      delete sdp;
+      return;
+    }
+    sdp->ToString(&_path->_localSdp);
+    _path->_peerConnection->SetLocalDescription(_path->_setLocalDescriptionObserver, sdp);
+  }
+
+  virtual void OnFailure(const std::string& msg) override
+  {
+    FAF_LOG_WARN << "RedundantPath: creating SDP failed: " << msg;
+  }
+
+private:
+  RedundantPath* _path;
+};
+
+class PathSetSdpObserver : public webrtc::SetSessionDescriptionObserver
+{
+public:
+  PathSetSdpObserver(RedundantPath* path, bool local) : _path(path), _local(local) {}
+
+  void detach() { _path = nullptr; }
+
+  virtual void OnSuccess() override
+  {
+    if (!_path)
+    {
+      return;
+    }
+    if (_local)
+    {
+      Json::Value iceMsg;
+      iceMsg["type"] = _path->_createOffer ? "offer" : "answer";
+      iceMsg["sdp"] = _path->_localSdp;
+      iceMsg["path"] = 1;
+      _path->_iceMessageCallback(iceMsg);
+    }
+    else if (!_path->_createOffer &&
+             _path->_peerConnection)
+    {
+      _path->_peerConnection->CreateAnswer(_path->_createSdpObserver, nullptr);
+    }
+  }
+
+  virtual void OnFailure(const std::string& msg) override
+  {
+    FAF_LOG_WARN << "RedundantPath: setting " << (_local ? "local" : "remote") << " SDP failed: " << msg;
+  }
+
+private:
+  RedundantPath* _path;
+  bool _local;
+};
+
+class PathPeerConnectionObserver : public webrtc::PeerConnectionObserver
+{
+public:
+  explicit PathPeerConnectionObserver(RedundantPath* path) : _path(path) {}
+
+  void detach() { _path = nullptr; }
+
+  virtual void OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState new_state) override {}
+
+  virtual void OnIceConnectionChange(webrtc::PeerConnectionInterface::IceConnectionState new_state) override
+  {
+    auto state = iceConnectionStateName(new_state);
+    if (_path &&
+        state)
+    {
+      _path->_setIceState(state);
+    }
+  }
+
+  virtual void OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state) override {}
+
+  virtual void OnIceCandidate(const webrtc::IceCandidateInterface* candidate) override
+  {
+    if (!_path)
+    {
+      return;
+    }
+    auto iceMsg = iceCandidateMessage(candidate);
+    iceMsg["path"] = 1;
+    _path->_iceMessageCallback(iceMsg);
+  }
+
+  virtual void OnRenegotiationNeeded() override {}
+
+  virtual void OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) override
+  {
+    if (_path)
+    {
+      _path->_setDataChannel(data_channel);
+    }
+  }
+
+  virtual void OnAddStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream) override {}
+  virtual void OnRemoveStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream) override {}
+
+private:
+  RedundantPath* _path;
+};
+
+class PathDataChannelObserver : public webrtc::DataChannelObserver
+{
+public:
+  explicit PathDataChannelObserver(RedundantPath* path) : _path(path) {}
+
+  void detach() { _path = nullptr; }
+
+  virtual void OnStateChange() override
+  {
+    if (_path &&
+        _path->_dataChannel &&
+        _path->_dataChannel->state() == webrtc::DataChannelInterface::kOpen)
+    {
+      FAF_LOG_INFO << "RedundantPath: data channel opened";
+    }
+  }
+
+  virtual void OnMessage(const webrtc::DataBuffer& buffer) override
+  {
+    if (!_path)
+    {
+      return;
+    }
+    ++_path->_messagesReceived;
+    _path->_messageCallback(buffer.data);
+  }
+
+private:
+  RedundantPath* _path;
+};
+
+RedundantPath::RedundantPath(bool createOffer,
+                             rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+                             webrtc::PeerConnectionInterface::IceServers const& iceServers,
+                             rtc::scoped_refptr<rtc::RTCCertificate> const& certificate,
+                             PortAllocatorFactory* portAllocatorFactory,
+                             IceMessageCallback iceMessageCallback,
+                             MessageCallback messageCallback,
+                             StateCallback stateCallback):
+  _createOffer(createOffer),
+  _createSdpObserver(new rtc::RefCountedObject<PathCreateSdpObserver>(this)),
+  _setLocalDescriptionObserver(new rtc::RefCountedObject<PathSetSdpObserver>(this, true)),
+  _setRemoteDescriptionObserver(new rtc::RefCountedObject<PathSetSdpObserver>(this, false)),
+  _peerConnectionObserver(std::make_unique<PathPeerConnectionObserver>(this)),
+  _dataChannelObserver(std::make_unique<PathDataChannelObserver>(this)),
+  _iceMessageCallback(iceMessageCallback),
+  _messageCallback(messageCallback),
+  _stateCallback(stateCallback),
+  _iceState("none"),
+  _messagesSent(0),
+  _messagesReceived(0),
+  _sendFailures(0)
+{
+  webrtc::PeerConnectionInterface::RTCConfiguration configuration;
+  configuration.servers = iceServers;
+  /* only relayed candidates, so the path does not end up on the same
+     direct candidate pair as the primary connection */
+  configuration.type = webrtc::PeerConnectionInterface::kRelay;
+  if (certificate)
+  {
+    configuration.certificates.push_back(certificate);
+  }
+  std::unique_ptr<cricket::PortAllocator> portAllocator;
+  if (portAllocatorFactory)
+  {
+    portAllocatorFactory->configure(configuration);
+    portAllocator = portAllocatorFactory->create();
+  }
+  _peerConnection = pcfactory->CreatePeerConnection(configuration,
+                                                    std::move(portAllocator),
+                                                    nullptr,
+                                                    _peerConnectionObserver.get());
+  if (!_peerConnection)
+  {
+    FAF_LOG_ERROR << "RedundantPath: creating PeerConnection failed";
+    return;
+  }
+  if (_createOffer)
+  {
+    webrtc::DataChannelInit dataChannelInit;
+    dataChannelInit.maxRetransmits = 0;
+    dataChannelInit.ordered = false;
+    _setDataChannel(_peerConnection->CreateDataChannel("faf-path", &dataChannelInit));
+    webrtc::PeerConnectionInterface::RTCOfferAnswerOptions options;
+    options.offer_to_receive_audio = 0;
+    options.offer_to_receive_video = 0;
+    _peerConnection->CreateOffer(_createSdpObserver, options);
+  }
+}
+
+RedundantPath::~RedundantPath()
+{
+  _createSdpObserver->detach();
+  _setLocalDescriptionObserver->detach();
+  _setRemoteDescriptionObserver->detach();
+  _peerConnectionObserver->detach();
+  _dataChannelObserver->detach();
+  if (_dataChannel)
+  {
+    _dataChannel->UnregisterObserver();
+    _dataChannel = nullptr;
+  }
+  if (_peerConnection)
+  {
+    _peerConnection->Close();
+    _peerConnection = nullptr;
+  }
+}
+
+void RedundantPath::addIceMessage(Json::Value const& iceMsg)
+{
+  if (!_peerConnection)
+  {
+    return;
+  }
+  webrtc::SdpParseError error;
+  if (iceMsg["type"].asString() == "offer" ||
+      iceMsg["type"].asString() == "answer")
+  {
+    auto sdp = webrtc::CreateSessionDescription(iceMsg["type"].asString(), iceMsg["sdp"].asString(), &error);
+    if (!sdp)
+    {
+      FAF_LOG_ERROR << "RedundantPath: parsing remote SDP failed: " << error.description;
+      return;
+    }
+    _peerConnection->SetRemoteDescription(_setRemoteDescriptionObserver, sdp);
+  }
+  else if (iceMsg["type"].asString() == "candidate")
+  {
+    std::unique_ptr<webrtc::IceCandidateInterface> candidate(webrtc::CreateIceCandidate(iceMsg["candidate"]["sdpMid"].asString(),
+                                                                                         iceMsg["candidate"]["sdpMLineIndex"].asInt(),
+                                                                                         iceMsg["candidate"]["candidate"].asString(),
+                                                                                         &error));
+    if (!candidate)
+    {
+      FAF_LOG_ERROR << "RedundantPath: parsing ICE candidate failed: " << error.description;
+    }
+    else if (!_peerConnection->AddIceCandidate(candidate.get()))
+    {
+      FAF_LOG_ERROR << "RedundantPath: adding ICE candidate failed";
+    }
+  }
+}
+
+bool RedundantPath::isOpen() const
+{
+  return _dataChannel &&
+         _dataChannel->state() == webrtc::DataChannelInterface::kOpen;
+}
+
+bool RedundantPath::send(rtc::CopyOnWriteBuffer const& message)
+{
+  if (!isOpen() ||
+      !_dataChannel->Send(webrtc::DataBuffer(message, true)))
+  {
+    ++_sendFailures;
+    return false;
+  }
+  ++_messagesSent;
+  return true;
+}
+
+Json::Value RedundantPath::status() const
+{
+  Json::Value result;
+  result["state"] = _iceState;
+  result["open"] = isOpen();
+  result["messages_sent"] = static_cast<Json::UInt64>(_messagesSent);
+  result["messages_received"] = static_cast<Json::UInt64>(_messagesReceived);
+  result["send_failures"] = static_cast<Json::UInt64>(_sendFailures);
+  return result;
+}
+
+void RedundantPath::_setDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> const& dataChannel)
+{
+  if (_dataChannel)
+  {
+    _dataChannel->UnregisterObserver();
+  }
+  _dataChannel = dataChannel;
+  if (_dataChannel)
+  {
+    _dataChannel->RegisterObserver(_dataChannelObserver.get());
+  }
+}
+
+void RedundantPath::_setIceState(std::string const& state)
+{
+  _iceState = state;
+  if (_stateCallback)
+  {
+    _stateCallback(state);
+  }
+}
+
+} // namespace faf
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <string>
+
+#include <webrtc/api/peerconnectioninterface.h>
+
+#include <third_party/json/json.h>
+
+#include "PortAllocatorFactory.h"
+
+namespace faf {
+
+class PathCreateSdpObserver;
+class PathSetSdpObserver;
+class PathPeerConnectionObserver;
+class PathDataChannelObserver;
+
+/*! \brief A second connection of a PeerRelay to its peer, restricted to TURN relayed candidates.
+ *         It carries copies of the game messages, so loss or a latency spike on one connection
+ *         is hidden by the other. Its ICE messages are tagged with "path": 1.
+ */
+class RedundantPath
+{
+public:
+  typedef std::function<void (Json::Value const& iceMsg)> IceMessageCallback;
+  typedef std::function<void (rtc::CopyOnWriteBuffer const& message)> MessageCallback;
+  typedef std::function<void (std::string const& state)> StateCallback;
+
+  RedundantPath(bool createOffer,
+                rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> const& pcfactory,
+                webrtc::PeerConnectionInterface::IceServers const& iceServers,
+                rtc::scoped_refptr<rtc::RTCCertificate> const& certificate,
+                PortAllocatorFactory* portAllocatorFactory,
+                IceMessageCallback iceMessageCallback,
+                MessageCallback messageCallback,
+                StateCallback stateCallback);
+  virtual ~RedundantPath();
+
+  /** \brief Add an offer, answer or candidate of the peer's RedundantPath
+      */
+  void addIceMessage(Json::Value const& iceMsg);
+
+  bool isOpen() const;
+
+  /** \brief Send a framed message to the peer
+       \returns false if the path is not open or the message was refused
+      */
+  bool send(rtc::CopyOnWriteBuffer const& message);
+
+  Json::Value status() const;
+
+protected:
+  void _setDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> const& dataChannel);
+  void _setIceState(std::string const& state);
+
+  bool _createOffer;
+  rtc::scoped_refptr<webrtc::PeerConnectionInterface> _peerConnection;
+  rtc::scoped_refptr<webrtc::DataChannelInterface> _dataChannel;
+
+  rtc::scoped_refptr<PathCreateSdpObserver> _createSdpObserver;
+  rtc::scoped_refptr<PathSetSdpObserver> _setLocalDescriptionObserver;
+  rtc::scoped_refptr<PathSetSdpObserver> _setRemoteDescriptionObserver;
+  std::unique_ptr<PathPeerConnectionObserver> _peerConnectionObserver;
+  std::unique_ptr<PathDataChannelObserver> _dataChannelObserver;
+
+  IceMessageCallback _iceMessageCallback;
+  MessageCallback _messageCallback;
+  StateCallback _stateCallback;
+
+  std::string _iceState;
+  std::string _localSdp;
+  uint64_t _messagesSent;
+  uint64_t _messagesReceived;
+  uint64_t _sendFailures;
+
+  friend PathCreateSdpObserver;
+  friend PathSetSdpObserver;
+  friend PathPeerConnectionObserver;
+  friend PathDataChannelObserver;
+
+  RTC_DISALLOW_COPY_AND_ASSIGN(RedundantPath);
+};
+
+} // namespace faf
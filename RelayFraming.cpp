@@ -0,0 +1,116 @@
+#include "RelayFraming.h"
+
+namespace faf {
+
+/* kind byte */
+static constexpr std::size_t frameHeaderSize = 1;
+
+/* length prefix of each datagram in an Aggregate message */
+static constexpr std::size_t aggregateLengthSize = 2;
+
+rtc::CopyOnWriteBuffer frameDatagram(rtc::CopyOnWriteBuffer const& datagram)
+{
+  rtc::CopyOnWriteBuffer result(0, frameHeaderSize + datagram.size());
+  auto kind = static_cast<uint8_t>(RelayFrameKind::Datagram);
+  result.AppendData(&kind, frameHeaderSize);
+  result.AppendData(datagram.cdata(), datagram.size());
+  return result;
+}
+
+bool unframeMessage(rtc::CopyOnWriteBuffer const& message,
+                    std::function<void (rtc::CopyOnWriteBuffer const&)> const& datagramCallback)
+{
+  if (message.size() < frameHeaderSize)
+  {
+    return false;
+  }
+  auto data = message.cdata();
+  switch (static_cast<RelayFrameKind>(data[0]))
+  {
+    case RelayFrameKind::Datagram:
+      datagramCallback(rtc::CopyOnWriteBuffer(data + frameHeaderSize, message.size() - frameHeaderSize));
+      return true;
+    case RelayFrameKind::Aggregate:
+    {
+      std::size_t pos = frameHeaderSize;
+      while (pos < message.size())
+      {
+        if (pos + aggregateLengthSize > message.size())
+        {
+          return false;
+        }
+        std::size_t length = (static_cast<std::size_t>(data[pos]) << 8) | data[pos + 1];
+        pos += aggregateLengthSize;
+        if (pos + length > message.size())
+        {
+          return false;
+        }
+        datagramCallback(rtc::CopyOnWriteBuffer(data + pos, length));
+        pos += length;
+      }
+      return true;
+    }
+    default:
+      break;
+  }
+  return false;
+}
+
+PacketAggregator::PacketAggregator(std::size_t maxMessageSize):
+  _maxMessageSize(maxMessageSize),
+  _messageSize(frameHeaderSize),
+  _payloadSize(0)
+{
+}
+
+bool PacketAggregator::add(rtc::CopyOnWriteBuffer const& datagram)
+{
+  auto messageSize = _messageSize + aggregateLengthSize + datagram.size();
+  if (!_datagrams.empty() &&
+      messageSize > _maxMessageSize)
+  {
+    return false;
+  }
+  _datagrams.push_back(datagram);
+  _messageSize = messageSize;
+  _payloadSize += datagram.size();
+  return true;
+}
+
+std::size_t PacketAggregator::count() const
+{
+  return _datagrams.size();
+}
+
+std::size_t PacketAggregator::payloadSize() const
+{
+  return _payloadSize;
+}
+
+rtc::CopyOnWriteBuffer PacketAggregator::take()
+{
+  rtc::CopyOnWriteBuffer result;
+  if (_datagrams.size() == 1)
+  {
+    result = frameDatagram(_datagrams.front());
+  }
+  else if (!_datagrams.empty())
+  {
+    result = rtc::CopyOnWriteBuffer(0, _messageSize);
+    auto kind = static_cast<uint8_t>(RelayFrameKind::Aggregate);
+    result.AppendData(&kind, frameHeaderSize);
+    for (auto const& datagram : _datagrams)
+    {
+      uint8_t length[aggregateLengthSize] = {static_cast<uint8_t>(datagram.size() >> 8),
+                                             static_cast<uint8_t>(datagram.size() & 0xff)};
+      result.AppendData(length, aggregateLengthSize);
+      result.AppendData(datagram.cdata(), datagram.size());
+    }
+  }
+  _datagrams.clear();
+  _messageSize = frameHeaderSize;
+  _payloadSize = 0;
+  return result;
+}
+
+} // namespace faf
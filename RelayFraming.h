@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include <webrtc/rtc_base/copyonwritebuffer.h>
+
+namespace faf {
+
+/*! \brief Kinds of data channel messages between PeerRelays that negotiated framing.
+ *         Every framed message starts with its kind byte.
+ */
+enum class RelayFrameKind : uint8_t
+{
+  Datagram = 0x01,  /*!< one game datagram */
+  Aggregate = 0x02, /*!< game datagrams, each prefixed with its 16 bit big-endian length */
+  FecData = 0x03,   /*!< 16 bit sequence number, followed by a Datagram or Aggregate message */
+  FecParity = 0x04, /*!< 16 bit first sequence number, 8 bit count, 16 bit XOR of the lengths and the XOR of the FecData payloads */
+  LossReport = 0x05 /*!< 16 bit number of expected and of received FecData messages since the last report */
+};
+
+/** \brief Frame a single game datagram
+    */
+rtc::CopyOnWriteBuffer frameDatagram(rtc::CopyOnWriteBuffer const& datagram);
+
+/** \brief Split a framed message into the game datagrams it carries
+     \returns false if the message is malformed or of unknown kind
+    */
+bool unframeMessage(rtc::CopyOnWriteBuffer const& message,
+                    std::function<void (rtc::CopyOnWriteBuffer const&)> const& datagramCallback);
+
+/*! \brief Packs game datagrams into one Aggregate message of limited size
+ */
+class PacketAggregator
+{
+public:
+  explicit PacketAggregator(std::size_t maxMessageSize);
+
+  /** \brief Add a datagram to the pending message. A datagram is always accepted by
+             an empty aggregator, even if it exceeds the maximum message size.
+       \returns false if the datagram does not fit, the pending message must be taken first
+      */
+  bool add(rtc::CopyOnWriteBuffer const& datagram);
+
+  /** \brief The number of datagrams in the pending message */
+  std::size_t count() const;
+
+  /** \brief The number of game bytes in the pending message */
+  std::size_t payloadSize() const;
+
+  /** \brief Get the pending message and start a new one.
+             A single datagram is framed as Datagram message.
+      */
+  rtc::CopyOnWriteBuffer take();
+
+protected:
+  std::size_t _maxMessageSize;
+  std::vector<rtc::CopyOnWriteBuffer> _datagrams;
+  std::size_t _messageSize;
+  std::size_t _payloadSize;
+};
+
+} // namespace faf
@@ -0,0 +1,49 @@
+#include "RelayStatsHistory.h"
+
+#include <algorithm>
+
+namespace faf {
+
+RelayStatsHistory::RelayStatsHistory(std::size_t capacity):
+  _samples(std::max<std::size_t>(capacity, 1)),
+  _next(0),
+  _size(0)
+{
+}
+
+void RelayStatsHistory::add(RelayStatsSample const& sample)
+{
+  _samples[_next] = sample;
+  _next = (_next + 1) % _samples.size();
+  _size = std::min(_size + 1, _samples.size());
+}
+
+std::size_t RelayStatsHistory::size() const
+{
+  return _size;
+}
+
+Json::Value RelayStatsHistory::samples(std::size_t maxSamples) const
+{
+  Json::Value result(Json::arrayValue);
+  auto count = maxSamples > 0 ? std::min(maxSamples, _size) : _size;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    auto const& sample = _samples[(_next + _samples.size() - count + i) % _samples.size()];
+    Json::Value sampleJson;
+    sampleJson["time"] = static_cast<Json::Int64>(sample.timeMs);
+    sampleJson["state"] = sample.iceState;
+    sampleJson["loc_cand_type"] = sample.localCandType;
+    sampleJson["rem_cand_type"] = sample.remoteCandType;
+    sampleJson["rtt_ms"] = sample.rttMs;
+    sampleJson["available_outgoing_bitrate"] = sample.availableOutgoingBitrate;
+    sampleJson["bytes_sent"] = static_cast<Json::UInt64>(sample.bytesSent);
+    sampleJson["bytes_received"] = static_cast<Json::UInt64>(sample.bytesReceived);
+    sampleJson["packets_sent"] = static_cast<Json::UInt64>(sample.packetsSent);
+    sampleJson["packets_received"] = static_cast<Json::UInt64>(sample.packetsReceived);
+    result.append(sampleJson);
+  }
+  return result;
+}
+
+} // namespace faf
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief One periodic sample of the connection to a peer.
+ *         The byte counters are those of the selected candidate pair, the packet
+ *         counters are game packets relayed since the PeerRelay was created.
+ *         A negative rtt or bitrate was not reported by WebRTC.
+ */
+struct RelayStatsSample
+{
+  int64_t timeMs = 0;
+  std::string iceState;
+  std::string localCandType;
+  std::string remoteCandType;
+  double rttMs = -1.;
+  double availableOutgoingBitrate = -1.;
+  uint64_t bytesSent = 0;
+  uint64_t bytesReceived = 0;
+  uint64_t packetsSent = 0;
+  uint64_t packetsReceived = 0;
+};
+
+/*! \brief Fixed-size ring of the most recent RelayStatsSamples.
+ *         All slots are allocated upfront, the oldest sample is overwritten.
+ */
+class RelayStatsHistory
+{
+public:
+  explicit RelayStatsHistory(std::size_t capacity);
+
+  void add(RelayStatsSample const& sample);
+
+  std::size_t size() const;
+
+  /** \brief The most recent samples, oldest first.
+       \param maxSamples: 0 returns all kept samples
+       \returns an array of sample objects
+      */
+  Json::Value samples(std::size_t maxSamples) const;
+
+protected:
+  std::vector<RelayStatsSample> _samples;
+  std::size_t _next;
+  std::size_t _size;
+};
+
+} // namespace faf
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace faf {
+
+/*! \brief Bounded lock-free ring for one producer and one consumer thread.
+ *         All slots are allocated upfront, so push() and pop() never allocate.
+ *         The depth is rounded up to the next power of two.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+  explicit SpscRing(std::size_t depth):
+    _slots(_roundUpToPowerOfTwo(depth)),
+    _mask(_slots.size() - 1),
+    _head(0),
+    _tailCache(0),
+    _tail(0),
+    _headCache(0)
+  {
+  }
+
+  /** \brief Append a value. Must only be called from the producer thread.
+       \returns false if the ring is full
+      */
+  bool push(T const& value)
+  {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _headCache == _slots.size())
+    {
+      _headCache = _head.load(std::memory_order_acquire);
+      if (tail - _headCache == _slots.size())
+      {
+        return false;
+      }
+    }
+    _slots[tail & _mask] = value;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** \brief Take the oldest value. Must only be called from the consumer thread.
+       \returns false if the ring is empty
+      */
+  bool pop(T& value)
+  {
+    auto head = _head.load(std::memory_order_relaxed);
+    if (head == _tailCache)
+    {
+      _tailCache = _tail.load(std::memory_order_acquire);
+      if (head == _tailCache)
+      {
+        return false;
+      }
+    }
+    /* moving out leaves the slot empty, so it does not keep the value alive */
+    value = std::move(_slots[head & _mask]);
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** \brief The oldest value or nullptr if empty. Must only be called from the consumer thread.
+      */
+  T const* front()
+  {
+    auto head = _head.load(std::memory_order_relaxed);
+    if (head == _tailCache)
+    {
+      _tailCache = _tail.load(std::memory_order_acquire);
+      if (head == _tailCache)
+      {
+        return nullptr;
+      }
+    }
+    return &_slots[head & _mask];
+  }
+
+  std::size_t capacity() const
+  {
+    return _slots.size();
+  }
+
+  /** \brief The number of queued values, only approximate while the other side is active */
+  std::size_t sizeApprox() const
+  {
+    return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+  }
+
+protected:
+  static std::size_t _roundUpToPowerOfTwo(std::size_t value)
+  {
+    std::size_t result = 1;
+    while (result < value)
+    {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  std::vector<T> _slots;
+  std::size_t const _mask;
+
+  /* consumer side */
+  alignas(64) std::atomic<std::size_t> _head;
+  std::size_t _tailCache;
+
+  /* producer side */
+  alignas(64) std::atomic<std::size_t> _tail;
+  std::size_t _headCache;
+};
+
+} // namespace faf
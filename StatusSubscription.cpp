@@ -0,0 +1,147 @@
+#include "StatusSubscription.h"
+
+#include <algorithm>
+#include <string>
+
+namespace faf {
+
+StatusSubscription::StatusSubscription(rtc::AsyncSocket* session, int intervalMs):
+  _session(session),
+  _intervalMs(intervalMs),
+  _hasAdapter(false),
+  _seq(0),
+  _relayChecks(0),
+  _relaySummaries(0)
+{
+}
+
+rtc::AsyncSocket* StatusSubscription::session() const
+{
+  return _session;
+}
+
+int StatusSubscription::intervalMs() const
+{
+  return _intervalMs;
+}
+
+bool StatusSubscription::adapterChanged(uint64_t revision) const
+{
+  return !_hasAdapter ||
+         _adapter.revision != revision;
+}
+
+void StatusSubscription::updateAdapter(uint64_t revision, Json::Value const& summary)
+{
+  _diff(_adapter.fields, summary, _delta["adapter"]);
+  if (_delta["adapter"].empty())
+  {
+    _delta.removeMember("adapter");
+  }
+  _adapter.revision = revision;
+  _adapter.fields = summary;
+  _hasAdapter = true;
+}
+
+bool StatusSubscription::relayChanged(int remotePlayerId, uint64_t revision) const
+{
+  auto it = _relays.find(remotePlayerId);
+  return it == _relays.end() ||
+         it->second.revision != revision;
+}
+
+void StatusSubscription::updateRelay(int remotePlayerId, uint64_t revision, Json::Value const& summary)
+{
+  auto& relay = _relays[remotePlayerId];
+  auto key = std::to_string(remotePlayerId);
+  auto& relayDelta = _delta["relays"][key];
+  _diff(relay.fields, summary, relayDelta);
+  if (relayDelta.empty())
+  {
+    _delta["relays"].removeMember(key);
+    if (_delta["relays"].empty())
+    {
+      _delta.removeMember("relays");
+    }
+  }
+  relay.revision = revision;
+  relay.fields = summary;
+  ++_relaySummaries;
+}
+
+void StatusSubscription::retainRelays(std::vector<int> const& remotePlayerIds)
+{
+  _relayChecks += remotePlayerIds.size();
+  for (auto it = _relays.begin(); it != _relays.end();)
+  {
+    if (std::find(remotePlayerIds.begin(), remotePlayerIds.end(), it->first) != remotePlayerIds.end())
+    {
+      ++it;
+      continue;
+    }
+    auto key = std::to_string(it->first);
+    if (_delta.isMember("relays"))
+    {
+      _delta["relays"].removeMember(key);
+      if (_delta["relays"].empty())
+      {
+        _delta.removeMember("relays");
+      }
+    }
+    _delta["removed"].append(it->first);
+    it = _relays.erase(it);
+  }
+}
+
+Json::Value StatusSubscription::takeDelta()
+{
+  if (_delta.empty())
+  {
+    return Json::Value();
+  }
+  Json::Value result;
+  result.swap(_delta);
+  result["seq"] = static_cast<Json::UInt64>(++_seq);
+  return result;
+}
+
+Json::Value StatusSubscription::takeSnapshot()
+{
+  _delta = Json::Value();
+  Json::Value result;
+  result["seq"] = static_cast<Json::UInt64>(_seq);
+  result["interval_ms"] = _intervalMs;
+  result["adapter"] = _adapter.fields;
+  result["relays"] = Json::Value(Json::objectValue);
+  for (auto const& relay : _relays)
+  {
+    result["relays"][std::to_string(relay.first)] = relay.second.fields;
+  }
+  return result;
+}
+
+Json::Value StatusSubscription::status() const
+{
+  Json::Value result;
+  result["interval_ms"] = _intervalMs;
+  result["deltas_sent"] = static_cast<Json::UInt64>(_seq);
+  result["relay_summaries"] = static_cast<Json::UInt64>(_relaySummaries);
+  result["relays_skipped"] = static_cast<Json::UInt64>(_relayChecks > _relaySummaries ? _relayChecks - _relaySummaries : 0);
+  return result;
+}
+
+void StatusSubscription::_diff(Json::Value const& previous,
+                               Json::Value const& current,
+                               Json::Value& delta)
+{
+  for (auto const& name : current.getMemberNames())
+  {
+    if (!previous.isMember(name) ||
+        previous[name] != current[name])
+    {
+      delta[name] = current[name];
+    }
+  }
+}
+
+} // namespace faf
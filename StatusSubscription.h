@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <webrtc/rtc_base/asyncsocket.h>
+
+#include <third_party/json/json.h>
+
+namespace faf {
+
+/*! \brief The state last sent to a subscriber of subscribeStatus.
+ *         The adapter and every PeerRelay are only summarized again if their
+ *         status revision changed, and only changed fields go into the delta.
+ */
+class StatusSubscription
+{
+public:
+  StatusSubscription(rtc::AsyncSocket* session, int intervalMs);
+
+  /** \returns the JSON-RPC client the deltas are sent to */
+  rtc::AsyncSocket* session() const;
+
+  int intervalMs() const;
+
+  bool adapterChanged(uint64_t revision) const;
+  void updateAdapter(uint64_t revision, Json::Value const& summary);
+
+  bool relayChanged(int remotePlayerId, uint64_t revision) const;
+  void updateRelay(int remotePlayerId, uint64_t revision, Json::Value const& summary);
+
+  /** \brief Forget the relays missing in remotePlayerIds and report them as removed.
+             Called once per check with all current relays.
+      */
+  void retainRelays(std::vector<int> const& remotePlayerIds);
+
+  /** \brief Ends the current delta
+       \returns the changes since the last call, null if nothing changed
+      */
+  Json::Value takeDelta();
+
+  /** \brief Drops the pending delta
+       \returns the complete state, the base for the following deltas
+      */
+  Json::Value takeSnapshot();
+
+  Json::Value status() const;
+
+protected:
+  struct Summary
+  {
+    uint64_t revision = 0;
+    Json::Value fields;
+  };
+
+  /* adds the fields of current that differ from previous to delta */
+  static void _diff(Json::Value const& previous,
+                    Json::Value const& current,
+                    Json::Value& delta);
+
+  rtc::AsyncSocket* _session;
+  int _intervalMs;
+  bool _hasAdapter;
+  Summary _adapter;
+  std::map<int, Summary> _relays;
+  Json::Value _delta;
+  uint64_t _seq;
+  /* relays checked for changes and relays summarized again */
+  uint64_t _relayChecks;
+  uint64_t _relaySummaries;
+};
+
+} // namespace faf
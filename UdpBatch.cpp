@@ -0,0 +1,385 @@
+#include "UdpBatch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(WEBRTC_LINUX)
+#  include <errno.h>
+#  include <netinet/in.h>
+#  include <netinet/udp.h>
+#endif
+
+#include <webrtc/rtc_base/physicalsocketserver.h>
+
+#include "logging.h"
+
+namespace faf {
+
+#if defined(WEBRTC_LINUX)
+/* The batched syscalls need the descriptor of a socket created by the PhysicalSocketServer.
+   Any other AsyncSocket implementation gets -1 and falls back to the per-datagram calls. */
+static int socketDescriptor(rtc::AsyncSocket* socket)
+{
+  auto physicalSocket = dynamic_cast<rtc::PhysicalSocket*>(socket);
+  return physicalSocket ? static_cast<int>(physicalSocket->GetSocketFD()) : -1;
+}
+#endif
+
+UdpBatchReceiver::UdpBatchReceiver(std::size_t batchSize, std::size_t poolSize):
+  _batchSize(std::max<std::size_t>(batchSize, 1)),
+  _pool(std::max(poolSize, _batchSize), maxDatagramSize),
+  _buffers(_batchSize, nullptr),
+  _acquired(0),
+  _received(0),
+  _wakeups(0),
+  _datagrams(0),
+  _maxBatch(0)
+{
+  for (auto& bucket : _batchHistogram)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+#if defined(WEBRTC_LINUX)
+  _msgs.resize(_batchSize);
+  _iovecs.resize(_batchSize);
+  for (std::size_t i = 0; i < _batchSize; ++i)
+  {
+    std::memset(&_msgs[i], 0, sizeof(mmsghdr));
+    _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+    _msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+#endif
+}
+
+std::size_t UdpBatchReceiver::receive(rtc::AsyncSocket* socket)
+{
+  /* Buffers acquired in the last call but not filled stay armed, so the pool only
+     advances by the number of received datagrams. They move to the front in
+     acquisition order. */
+  std::size_t armed = 0;
+  for (std::size_t i = _received; i < _acquired; ++i)
+  {
+    _buffers[armed++] = _buffers[i];
+  }
+  _acquired = armed;
+  _received = 0;
+
+  std::size_t count = 0;
+#if defined(WEBRTC_LINUX)
+  auto fd = _batchSize > 1 ? socketDescriptor(socket) : -1;
+  if (fd >= 0)
+  {
+    /* The last slot is left for the Recv() loop below. Only a Recv() call
+       re-enables the read event of the rtc socket after it fired. */
+    for (; _acquired < _batchSize - 1; ++_acquired)
+    {
+      _buffers[_acquired] = &_pool.acquire();
+    }
+    for (std::size_t i = 0; i < _batchSize - 1; ++i)
+    {
+      _iovecs[i].iov_base = _buffers[i]->data();
+      _iovecs[i].iov_len = _buffers[i]->size();
+    }
+    auto result = recvmmsg(fd,
+                           _msgs.data(),
+                           static_cast<unsigned int>(_batchSize - 1),
+                           MSG_DONTWAIT,
+                           nullptr);
+    if (result > 0)
+    {
+      count = static_cast<std::size_t>(result);
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        _buffers[i]->SetSize(_msgs[i].msg_len);
+      }
+    }
+  }
+#endif
+  while (count < _batchSize &&
+         _receiveSingle(socket, count))
+  {
+    ++count;
+  }
+  _received = count;
+
+  /* spurious read events would only dilute the datagrams per wakeup */
+  if (count == 0)
+  {
+    return count;
+  }
+  ++_wakeups;
+  _datagrams += count;
+  if (count > _maxBatch.load(std::memory_order_relaxed))
+  {
+    _maxBatch.store(count, std::memory_order_relaxed);
+  }
+  std::size_t bucket = 0;
+  for (std::size_t c = count; c > 1 && bucket < _batchHistogram.size() - 1; c >>= 1)
+  {
+    ++bucket;
+  }
+  ++_batchHistogram[bucket];
+  return count;
+}
+
+rtc::CopyOnWriteBuffer const& UdpBatchReceiver::buffer(std::size_t index) const
+{
+  return *_buffers[index];
+}
+
+Json::Value UdpBatchReceiver::status() const
+{
+  Json::Value result;
+  result["batch_size"] = static_cast<Json::UInt64>(_batchSize);
+  uint64_t wakeups = _wakeups;
+  uint64_t datagrams = _datagrams;
+  result["wakeups"] = static_cast<Json::UInt64>(wakeups);
+  result["datagrams"] = static_cast<Json::UInt64>(datagrams);
+  result["datagrams_per_wakeup"] = wakeups > 0 ? static_cast<double>(datagrams) / wakeups : 0.;
+  result["max_datagrams_per_wakeup"] = static_cast<Json::UInt64>(_maxBatch.load());
+  Json::Value histogram;
+  histogram["1"] = static_cast<Json::UInt64>(_batchHistogram[0].load());
+  histogram["2-3"] = static_cast<Json::UInt64>(_batchHistogram[1].load());
+  histogram["4-7"] = static_cast<Json::UInt64>(_batchHistogram[2].load());
+  histogram["8-15"] = static_cast<Json::UInt64>(_batchHistogram[3].load());
+  histogram["16-31"] = static_cast<Json::UInt64>(_batchHistogram[4].load());
+  histogram["32+"] = static_cast<Json::UInt64>(_batchHistogram[5].load());
+  result["wakeup_histogram"] = histogram;
+  result["buffer_pool"] = _pool.status();
+  result["buffer_pool"]["allocations_per_datagram"] = datagrams > 0 ? static_cast<double>(_pool.allocations()) / datagrams : 0.;
+  return result;
+}
+
+bool UdpBatchReceiver::_receiveSingle(rtc::AsyncSocket* socket, std::size_t index)
+{
+  /* a slot armed for recvmmsg() but left unused can be taken as is */
+  if (index >= _acquired)
+  {
+    _buffers[index] = &_pool.acquire();
+    _acquired = index + 1;
+  }
+  auto msgLength = socket->Recv(_buffers[index]->data(), _buffers[index]->size(), nullptr);
+  if (msgLength < 0)
+  {
+    return false;
+  }
+  _buffers[index]->SetSize(static_cast<std::size_t>(msgLength));
+  return true;
+}
+
+UdpBatchSender::UdpBatchSender(std::size_t maxBatchSize):
+  _maxBatchSize(std::max<std::size_t>(maxBatchSize, 1)),
+#if defined(WEBRTC_LINUX)
+#  if defined(UDP_SEGMENT)
+  _gsoSupported(true),
+#  else
+  _gsoSupported(false),
+#  endif
+#endif
+  _flushes(0),
+  _datagrams(0),
+  _syscalls(0),
+  _gsoSends(0),
+  _errors(0)
+{
+  _queue.reserve(_maxBatchSize);
+#if defined(WEBRTC_LINUX)
+  _msgs.resize(_maxBatchSize);
+  _iovecs.resize(_maxBatchSize);
+#endif
+}
+
+bool UdpBatchSender::queue(rtc::CopyOnWriteBuffer const& datagram)
+{
+  _queue.push_back(datagram);
+  return _queue.size() >= _maxBatchSize;
+}
+
+bool UdpBatchSender::empty() const
+{
+  return _queue.empty();
+}
+
+void UdpBatchSender::flush(rtc::AsyncSocket* socket)
+{
+  if (_queue.empty())
+  {
+    return;
+  }
+  ++_flushes;
+  _datagrams += _queue.size();
+#if defined(WEBRTC_LINUX)
+  auto fd = socketDescriptor(socket);
+  std::size_t begin = 0;
+  while (fd < 0 &&
+         begin < _queue.size())
+  {
+    _sendSingle(socket, begin);
+    ++begin;
+  }
+  while (begin < _queue.size())
+  {
+    auto runLength = _gsoSupported ? _segmentRunLength(begin) : 1;
+    if (runLength > 1 &&
+        _sendSegmented(fd, begin, begin + runLength))
+    {
+      begin += runLength;
+      continue;
+    }
+    /* everything up to the next run worth segmenting goes into one sendmmsg() */
+    auto end = begin + 1;
+    while (end < _queue.size() &&
+           (!_gsoSupported || _segmentRunLength(end) < 2))
+    {
+      ++end;
+    }
+    _sendMultiple(fd, begin, end);
+    begin = end;
+  }
+#else
+  for (std::size_t i = 0; i < _queue.size(); ++i)
+  {
+    _sendSingle(socket, i);
+  }
+#endif
+  _queue.clear();
+}
+
+Json::Value UdpBatchSender::status() const
+{
+  Json::Value result;
+  uint64_t datagrams = _datagrams;
+  uint64_t syscalls = _syscalls;
+  result["flushes"] = static_cast<Json::UInt64>(_flushes.load());
+  result["datagrams"] = static_cast<Json::UInt64>(datagrams);
+  result["syscalls"] = static_cast<Json::UInt64>(syscalls);
+  result["gso_sends"] = static_cast<Json::UInt64>(_gsoSends.load());
+  result["errors"] = static_cast<Json::UInt64>(_errors.load());
+  result["datagrams_per_syscall"] = syscalls > 0 ? static_cast<double>(datagrams) / syscalls : 0.;
+  return result;
+}
+
+bool UdpBatchSender::_sendSingle(rtc::AsyncSocket* socket, std::size_t index)
+{
+  ++_syscalls;
+  if (socket->Send(_queue[index].cdata(), _queue[index].size()) < 0)
+  {
+    ++_errors;
+    return false;
+  }
+  return true;
+}
+
+#if defined(WEBRTC_LINUX)
+std::size_t UdpBatchSender::_segmentRunLength(std::size_t begin) const
+{
+  /* GSO splits the payload into segments of the first datagram's size,
+     only the last segment may be shorter */
+  static constexpr std::size_t maxSegments = 64;
+  static constexpr std::size_t maxPayload = 65000;
+  auto segmentSize = _queue[begin].size();
+  auto end = begin;
+  std::size_t payload = 0;
+  while (end < _queue.size() &&
+         end - begin < maxSegments &&
+         _queue[end].size() <= segmentSize &&
+         payload + _queue[end].size() <= maxPayload)
+  {
+    payload += _queue[end].size();
+    ++end;
+    if (_queue[end - 1].size() < segmentSize)
+    {
+      break;
+    }
+  }
+  return end - begin;
+}
+
+bool UdpBatchSender::_sendSegmented(int fd, std::size_t begin, std::size_t end)
+{
+#if defined(UDP_SEGMENT)
+  auto count = end - begin;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    _iovecs[i].iov_base = const_cast<uint8_t*>(_queue[begin + i].cdata());
+    _iovecs[i].iov_len = _queue[begin + i].size();
+  }
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  std::memset(control, 0, sizeof(control));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = _iovecs.data();
+  msg.msg_iovlen = count;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  auto segmentSize = static_cast<uint16_t>(_queue[begin].size());
+  std::memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+
+  ++_syscalls;
+  if (sendmsg(fd, &msg, MSG_DONTWAIT) < 0)
+  {
+    if (errno == EINVAL ||
+        errno == EIO ||
+        errno == ENOPROTOOPT ||
+        errno == EOPNOTSUPP)
+    {
+      FAF_LOG_INFO << "UDP GSO not supported, falling back to sendmmsg";
+      _gsoSupported = false;
+      return false;
+    }
+    _errors += count;
+    return true;
+  }
+  ++_gsoSends;
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::size_t UdpBatchSender::_sendMultiple(int fd, std::size_t begin, std::size_t end)
+{
+  auto count = end - begin;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    _iovecs[i].iov_base = const_cast<uint8_t*>(_queue[begin + i].cdata());
+    _iovecs[i].iov_len = _queue[begin + i].size();
+    std::memset(&_msgs[i], 0, sizeof(mmsghdr));
+    _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+    _msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  std::size_t sent = 0;
+  std::size_t processed = 0;
+  while (processed < count)
+  {
+    ++_syscalls;
+    auto result = sendmmsg(fd,
+                           &_msgs[processed],
+                           static_cast<unsigned int>(count - processed),
+                           MSG_DONTWAIT);
+    if (result > 0)
+    {
+      sent += static_cast<std::size_t>(result);
+      processed += static_cast<std::size_t>(result);
+    }
+    else if (errno == EAGAIN ||
+             errno == EWOULDBLOCK)
+    {
+      break;
+    }
+    else
+    {
+      /* skip the datagram that failed, e.g. ECONNREFUSED while the game is not listening */
+      ++processed;
+    }
+  }
+  _errors += count - sent;
+  return sent;
+}
+#endif
+
+} // namespace faf
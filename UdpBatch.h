@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include <webrtc/rtc_base/asyncsocket.h>
+
+#include <third_party/json/json.h>
+
+#include "PacketBufferPool.h"
+
+#if defined(WEBRTC_LINUX)
+#  include <sys/socket.h>
+#endif
+
+namespace faf {
+
+/*! \brief Drains all pending datagrams of a non-blocking UDP socket per read event.
+ *         Uses recvmmsg() on Linux and repeated Recv() calls on other platforms.
+ *         Datagrams are received in place into buffers of a PacketBufferPool, so they
+ *         can be passed on without copying.
+ */
+class UdpBatchReceiver
+{
+public:
+  static constexpr std::size_t maxDatagramSize = 2048;
+
+  /** \brief Create a receiver
+       \param poolSize the number of pooled buffers, should cover every received datagram
+                       still referenced downstream plus the batch size
+      */
+  UdpBatchReceiver(std::size_t batchSize, std::size_t poolSize);
+
+  /** \brief Receive up to batchSize datagrams from socket
+       \returns The number of received datagrams, accessible via buffer()
+      */
+  std::size_t receive(rtc::AsyncSocket* socket);
+
+  rtc::CopyOnWriteBuffer const& buffer(std::size_t index) const;
+
+  Json::Value status() const;
+
+protected:
+  bool _receiveSingle(rtc::AsyncSocket* socket, std::size_t index);
+
+  std::size_t _batchSize;
+  PacketBufferPool _pool;
+  /* the first _acquired slots hold pool buffers, the first _received of them were filled */
+  std::vector<rtc::CopyOnWriteBuffer*> _buffers;
+  std::size_t _acquired;
+  std::size_t _received;
+#if defined(WEBRTC_LINUX)
+  std::vector<mmsghdr> _msgs;
+  std::vector<iovec> _iovecs;
+#endif
+
+  /* counters for datagrams per read event, written by the receiving thread, read by status() */
+  std::atomic<uint64_t> _wakeups;
+  std::atomic<uint64_t> _datagrams;
+  std::atomic<std::size_t> _maxBatch;
+  std::array<std::atomic<uint64_t>, 6> _batchHistogram;
+};
+
+/*! \brief Queues datagrams for a connected UDP socket and sends them at once.
+ *         Uses UDP GSO for runs of equally sized datagrams and sendmmsg() otherwise on
+ *         Linux, and one Send() call per datagram on other platforms.
+ */
+class UdpBatchSender
+{
+public:
+  explicit UdpBatchSender(std::size_t maxBatchSize);
+
+  /** \brief Queue a datagram. The buffer is shared, not copied.
+       \returns true if the queue reached the maximum batch size and should be flushed
+      */
+  bool queue(rtc::CopyOnWriteBuffer const& datagram);
+
+  bool empty() const;
+
+  /** \brief Send all queued datagrams to the address socket is connected to
+      */
+  void flush(rtc::AsyncSocket* socket);
+
+  Json::Value status() const;
+
+protected:
+  bool _sendSingle(rtc::AsyncSocket* socket, std::size_t index);
+#if defined(WEBRTC_LINUX)
+  std::size_t _segmentRunLength(std::size_t begin) const;
+  bool _sendSegmented(int fd, std::size_t begin, std::size_t end);
+  std::size_t _sendMultiple(int fd, std::size_t begin, std::size_t end);
+#endif
+
+  std::size_t _maxBatchSize;
+  std::vector<rtc::CopyOnWriteBuffer> _queue;
+#if defined(WEBRTC_LINUX)
+  std::vector<mmsghdr> _msgs;
+  std::vector<iovec> _iovecs;
+  bool _gsoSupported;
+#endif
+
+  /* counters for datagrams per flush, written by the sending thread, read by status() */
+  std::atomic<uint64_t> _flushes;
+  std::atomic<uint64_t> _datagrams;
+  std::atomic<uint64_t> _syscalls;
+  std::atomic<uint64_t> _gsoSends;
+  std::atomic<uint64_t> _errors;
+};
+
+} // namespace faf
@@ -122,3 +122,7 @@ class TestClient:
     localId, remoteId, msg = args
     #self.log("onIceonIceMsg: {} {} {}".format(localId, remoteId, msg))
     self.dispatcher.remotes[remoteId].call("sendToIceAdapter", ["iceMsg", [localId, msg]])
+
+  def onIceOnIceMsgBatch(self, args):
+    localId, remoteId, msgs = args
+    self.dispatcher.remotes[remoteId].call("sendToIceAdapter", ["iceMsg", [localId, msgs]])
@@ -0,0 +1,321 @@
+/* Connects two PeerRelays with different framing related options and checks that
+ * game packets arrive unchanged in both directions. Both relays must agree whether
+ * messages are framed, a mismatch shows up as framing errors or mangled packets.
+ * A FEC case drops messages between encoder and decoder and checks they are rebuilt.
+ *
+ * usage: framingtest [packets per case (=200)]
+ */
+#include <iostream>
+#include <array>
+#include <functional>
+#include <vector>
+#include <set>
+#include <memory>
+#include <string>
+
+#include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/pc/test/fakeaudiocapturemodule.h>
+#include <webrtc/rtc_base/asyncinvoker.h>
+#include <webrtc/rtc_base/ssladapter.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include "FecCodec.h"
+#include "IceAdapterOptions.h"
+#include "PeerRelay.h"
+#include "Timer.h"
+#include "logging.h"
+
+static rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> pcfactory;
+
+/* the game side of a PeerRelay, either echoes or records what it receives */
+class FramingTestGame : public sigslot::has_slots<>
+{
+public:
+  explicit FramingTestGame(bool echo):
+    _echo(echo)
+  {
+    _socket.reset(rtc::Thread::Current()->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+    _socket->SignalReadEvent.connect(this, &FramingTestGame::_onData);
+    if (_socket->Bind(rtc::SocketAddress("127.0.0.1", 0)) != 0)
+    {
+      std::cerr << "unable to bind game socket" << std::endl;
+      std::exit(1);
+    }
+  }
+
+  int port() const
+  {
+    return _socket->GetLocalAddress().port();
+  }
+
+  void setRelayPort(int port)
+  {
+    _relayAddress = rtc::SocketAddress("127.0.0.1", port);
+  }
+
+  void send(std::string const& packet)
+  {
+    _socket->SendTo(packet.data(), packet.size(), _relayAddress);
+  }
+
+  std::multiset<std::string> const& received() const
+  {
+    return _received;
+  }
+
+protected:
+  void _onData(rtc::AsyncSocket* socket)
+  {
+    int msgLength;
+    while ((msgLength = socket->Recv(_buffer.data(), _buffer.size(), nullptr)) > 0)
+    {
+      if (_echo)
+      {
+        _socket->SendTo(_buffer.data(), static_cast<std::size_t>(msgLength), _relayAddress);
+        continue;
+      }
+      _received.emplace(reinterpret_cast<char const*>(_buffer.data()), static_cast<std::size_t>(msgLength));
+    }
+  }
+
+  bool _echo;
+  std::multiset<std::string> _received;
+  std::array<uint8_t, 2048> _buffer;
+  std::unique_ptr<rtc::AsyncSocket> _socket;
+  rtc::SocketAddress _relayAddress;
+};
+
+struct FramingTestCase
+{
+  std::string name;
+  std::string offererFec;
+  int offererAggregationWindowUs;
+  std::string answererFec;
+  int answererAggregationWindowUs;
+};
+
+/* a packet of varying size whose content identifies it, the first byte looks like a frame kind */
+static std::string testPacket(std::size_t seq)
+{
+  std::string result(1 + (seq * 37) % 900, '\0');
+  for (std::size_t i = 0; i < result.size(); ++i)
+  {
+    result[i] = static_cast<char>((seq + i) % 251);
+  }
+  result[0] = static_cast<char>(seq % 6);
+  return result;
+}
+
+/* drops the first message of every group, the first group straddles the sequence number
+   wraparound so the decoder unwraps its sequence numbers to negative ones */
+static bool runFecLossCase(std::size_t packets)
+{
+  std::size_t const groupSize = 3;
+  faf::FecEncoder encoder;
+  faf::FecDecoder decoder;
+  encoder.setGroupSize(groupSize);
+  rtc::CopyOnWriteBuffer parity;
+  /* 65535 is a multiple of the group size, the next group starts at sequence number 65535 */
+  for (std::size_t i = 0; i < 65535; ++i)
+  {
+    encoder.encode(rtc::CopyOnWriteBuffer(), parity);
+  }
+
+  std::multiset<std::string> received;
+  auto onMessage = [&](rtc::CopyOnWriteBuffer const& message)
+  {
+    received.emplace(reinterpret_cast<char const*>(message.cdata()), message.size());
+  };
+  std::size_t dropped = 0;
+  bool malformed = false;
+  for (std::size_t seq = 1; seq <= packets; ++seq)
+  {
+    auto packet = testPacket(seq);
+    auto data = encoder.encode(rtc::CopyOnWriteBuffer(packet.data(), packet.size()), parity);
+    if ((seq - 1) % groupSize == 0)
+    {
+      ++dropped;
+    }
+    else
+    {
+      malformed = !decoder.decode(data, onMessage) || malformed;
+    }
+    if (parity.size() > 0)
+    {
+      malformed = !decoder.decode(parity, onMessage) || malformed;
+    }
+  }
+
+  auto status = decoder.status();
+  std::size_t intact = 0;
+  for (std::size_t seq = 1; seq <= packets; ++seq)
+  {
+    intact += received.count(testPacket(seq)) > 0 ? 1 : 0;
+  }
+  /* the last group may be incomplete and lack its parity */
+  auto expectedRecovered = packets / groupSize;
+  bool passed = !malformed &&
+                intact >= packets - (dropped - expectedRecovered) &&
+                received.size() == intact &&
+                status["recovered"].asUInt64() == expectedRecovered;
+  std::cout << "fec-loss: " << (passed ? "passed" : "FAILED")
+            << " received " << intact << "/" << packets
+            << " dropped " << dropped
+            << " recovered " << status["recovered"].asUInt64() << "/" << expectedRecovered
+            << std::endl;
+  return passed;
+}
+
+static bool runCase(FramingTestCase const& testCase, std::size_t packets)
+{
+  auto offererOptions = faf::IceAdapterOptions::init(1, "sender");
+  offererOptions.fec = testCase.offererFec;
+  offererOptions.aggregationWindowUs = testCase.offererAggregationWindowUs;
+  auto answererOptions = faf::IceAdapterOptions::init(2, "echoer");
+  answererOptions.fec = testCase.answererFec;
+  answererOptions.aggregationWindowUs = testCase.answererAggregationWindowUs;
+
+  FramingTestGame sender(false);
+  FramingTestGame echoer(true);
+  auto offerer = std::make_unique<faf::PeerRelay>(2, "echoer", true, sender.port(), pcfactory, rtc::Thread::Current(), offererOptions);
+  auto answerer = std::make_unique<faf::PeerRelay>(1, "sender", false, echoer.port(), pcfactory, rtc::Thread::Current(), answererOptions);
+  sender.setRelayPort(offerer->localUdpSocketPort());
+  echoer.setRelayPort(answerer->localUdpSocketPort());
+
+  /* like the client, deliver ICE messages outside of the callback */
+  rtc::AsyncInvoker invoker;
+  offerer->setIceMessageCallback([&](Json::Value const& iceMsg)
+  {
+    invoker.AsyncInvoke<void>(RTC_FROM_HERE, rtc::Thread::Current(), [&answerer, iceMsg]
+    {
+      answerer->addIceMessage(iceMsg);
+    });
+  });
+  answerer->setIceMessageCallback([&](Json::Value const& iceMsg)
+  {
+    invoker.AsyncInvoke<void>(RTC_FROM_HERE, rtc::Thread::Current(), [&offerer, iceMsg]
+    {
+      offerer->addIceMessage(iceMsg);
+    });
+  });
+
+  bool connected = false;
+  std::size_t sent = 0;
+  faf::Timer warmupTimer;
+  faf::Timer sendTimer;
+  faf::Timer drainTimer;
+  faf::Timer timeoutTimer;
+
+  auto finish = [&]
+  {
+    warmupTimer.stop();
+    sendTimer.stop();
+    drainTimer.stop();
+    timeoutTimer.stop();
+    rtc::Thread::Current()->Quit();
+  };
+
+  /* probe until a packet came back, both relays know the caps of the other one by then */
+  auto const probe = testPacket(0);
+  warmupTimer.start(100, [&]
+  {
+    if (sender.received().count(probe) == 0)
+    {
+      sender.send(probe);
+      return;
+    }
+    warmupTimer.stop();
+    connected = true;
+    sendTimer.start(5, [&]
+    {
+      sender.send(testPacket(++sent));
+      if (sent < packets)
+      {
+        return;
+      }
+      sendTimer.stop();
+      drainTimer.start(1000, finish);
+    });
+  });
+  timeoutTimer.start(static_cast<int>(30000 + packets * 5), [&]
+  {
+    std::cerr << testCase.name << ": timed out" << std::endl;
+    finish();
+  });
+
+  answerer->reinit();
+  offerer->reinit();
+  rtc::Thread::Current()->Run();
+
+  auto offererStatus = offerer->status();
+  auto answererStatus = answerer->status();
+  std::size_t intact = 0;
+  for (std::size_t seq = 1; seq <= sent; ++seq)
+  {
+    intact += sender.received().count(testPacket(seq)) > 0 ? 1 : 0;
+  }
+  /* the probe may have been answered several times */
+  auto mangled = sender.received().size() - intact - sender.received().count(probe);
+
+  bool passed = connected &&
+                sent == packets &&
+                intact == packets &&
+                mangled == 0 &&
+                offererStatus["framing"]["active"].asBool() == answererStatus["framing"]["active"].asBool() &&
+                offererStatus["framing"]["errors"].asUInt64() == 0 &&
+                answererStatus["framing"]["errors"].asUInt64() == 0;
+  std::cout << testCase.name << ": " << (passed ? "passed" : "FAILED")
+            << " framing " << offererStatus["framing"]["active"].asBool() << "/" << answererStatus["framing"]["active"].asBool()
+            << " fec " << offererStatus["fec"]["active"].asBool() << "/" << answererStatus["fec"]["active"].asBool()
+            << " aggregation " << offererStatus["aggregation"]["active"].asBool() << "/" << answererStatus["aggregation"]["active"].asBool()
+            << " received " << intact << "/" << packets
+            << " mangled " << mangled
+            << " framing_errors " << offererStatus["framing"]["errors"].asUInt64() << "/" << answererStatus["framing"]["errors"].asUInt64()
+            << std::endl;
+  return passed;
+}
+
+int main(int argc, char *argv[])
+{
+  std::size_t packets = argc > 1 ? std::stoul(argv[1]) : 200;
+
+  faf::logging_init("warn");
+
+  if (!rtc::InitializeSSL())
+  {
+    std::cerr << "Error in InitializeSSL()";
+    std::exit(1);
+  }
+
+  pcfactory = webrtc::CreatePeerConnectionFactory(rtc::Thread::Current(),
+                                                  rtc::Thread::Current(),
+                                                  rtc::Thread::Current(),
+                                                  FakeAudioCaptureModule::Create(),
+                                                  nullptr,
+                                                  nullptr);
+  if (!pcfactory)
+  {
+    std::cerr << "Error in CreatePeerConnectionFactory()";
+    std::exit(1);
+  }
+
+  std::vector<FramingTestCase> testCases = {
+    {"plain", "off", 0, "off", 0},
+    {"fec-offerer", "on", 0, "off", 0},
+    {"fec-answerer", "off", 0, "on", 0},
+    {"aggregation-offerer", "off", 2000, "off", 0},
+    {"aggregation-answerer", "off", 0, "off", 2000},
+    {"fec-vs-aggregation", "on", 0, "off", 2000},
+    {"fec-auto-vs-aggregation", "off", 2000, "auto", 0}
+  };
+  bool passed = runFecLossCase(packets);
+  for (auto const& testCase: testCases)
+  {
+    rtc::Thread::Current()->Restart();
+    passed = runCase(testCase, packets) && passed;
+  }
+
+  pcfactory = nullptr;
+  rtc::CleanupSSL();
+  return passed ? 0 : 1;
+}
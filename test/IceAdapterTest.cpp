@@ -97,6 +97,14 @@ public:
     {
       iceAdapters.at(paramsArray[1].asInt())->iceMsg(localId, paramsArray[2]);
     });
+    _client->setRpcCallback("onIceMsgBatch",
+                            [this](Json::Value const& paramsArray,
+                                   Json::Value&,
+                                   Json::Value&,
+                                   rtc::AsyncSocket*)
+    {
+      iceAdapters.at(paramsArray[1].asInt())->iceMsg(localId, paramsArray[2]);
+    });
     _client->setRpcCallback("onIceConnectionStateChanged",
                             [this](Json::Value const& paramsArray,
                             Json::Value&,
@@ -0,0 +1,113 @@
+/* Probes local STUN and TURN test servers with the IceServerProber and checks the ranking.
+ * Runs offline: all servers listen on 127.0.0.1, one URL points to a closed port.
+ *
+ * usage: iceserverprobetest [ranking (=prune)]
+ */
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <webrtc/p2p/base/teststunserver.h>
+#include <webrtc/p2p/base/testturnserver.h>
+#include <webrtc/rtc_base/ssladapter.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include "IceServerProber.h"
+#include "logging.h"
+
+static webrtc::PeerConnectionInterface::IceServer iceServer(std::string const& url,
+                                                             std::string const& username = "",
+                                                             std::string const& password = "")
+{
+  webrtc::PeerConnectionInterface::IceServer result;
+  result.urls.push_back(url);
+  result.username = username;
+  result.password = password;
+  return result;
+}
+
+int main(int argc, char *argv[])
+{
+  std::string ranking = argc > 1 ? argv[1] : "prune";
+
+  faf::logging_init("warn");
+
+  if (!rtc::InitializeSSL())
+  {
+    std::cerr << "Error in InitializeSSL()";
+    std::exit(1);
+  }
+
+  rtc::SocketAddress stunAddress("127.0.0.1", 34780);
+  rtc::SocketAddress turnAddress("127.0.0.1", 34790);
+  std::unique_ptr<cricket::TestStunServer> stunServer(cricket::TestStunServer::Create(rtc::Thread::Current(), stunAddress));
+  /* the test TURN server accepts every user whose password equals the username */
+  cricket::TestTurnServer turnServer(rtc::Thread::Current(), turnAddress, turnAddress);
+
+  webrtc::PeerConnectionInterface::IceServers servers;
+  servers.push_back(iceServer("stun:127.0.0.1:34799"));
+  servers.push_back(iceServer("turn:127.0.0.1:34790", "faf", "wrong"));
+  servers.push_back(iceServer("turn:127.0.0.1:34790?transport=udp", "faf", "faf"));
+  servers.push_back(iceServer("stun:127.0.0.1:34780"));
+  servers.push_back(iceServer("turns:127.0.0.1:34791", "faf", "faf"));
+
+  faf::IceServerProber prober(1000, ranking);
+  bool done = false;
+  webrtc::PeerConnectionInterface::IceServers rankedServers;
+  prober.probe(servers, [&](webrtc::PeerConnectionInterface::IceServers const& ranked)
+  {
+    rankedServers = ranked;
+    done = true;
+  });
+  while (!done)
+  {
+    rtc::Thread::Current()->ProcessMessages(100);
+  }
+
+  auto status = prober.status();
+  std::cout << status.toStyledString() << std::endl;
+  std::cout << "ranked servers:" << std::endl;
+  for (auto const& server : rankedServers)
+  {
+    std::cout << "  " << server.urls.front() << " (" << server.username << ":" << server.password << ")" << std::endl;
+  }
+
+  int result = 0;
+  auto expect = [&result](bool condition, std::string const& what)
+  {
+    if (!condition)
+    {
+      std::cerr << "FAILED: " << what << std::endl;
+      result = 1;
+    }
+  };
+  auto const& probed = status["servers"];
+  expect(probed[0]["probes"][0]["state"].asString() != "ok", "closed port is not reachable");
+  if (ranking == "prune")
+  {
+    expect(probed[1]["probes"][0]["allocation"].asString() == "unauthorized", "wrong TURN password is rejected");
+    expect(probed[2]["probes"][0]["allocation"].asString() == "ok", "TURN allocation succeeds");
+  }
+  else
+  {
+    expect(probed[1]["probes"][0]["allocation"].asString().empty(), "no TURN allocation is tried");
+    expect(probed[2]["probes"][0]["state"].asString() == "ok", "TURN server answers the unauthenticated request");
+    expect(probed[2]["rtt_ms"].asDouble() >= 0, "TURN RTT is measured");
+  }
+  expect(probed[3]["probes"][0]["state"].asString() == "ok", "STUN binding succeeds");
+  expect(probed[3]["rtt_ms"].asDouble() >= 0, "STUN RTT is measured");
+  expect(probed[4]["probes"][0]["state"].asString() == "skipped", "TLS URL is not probed");
+  if (ranking == "prune")
+  {
+    expect(rankedServers.size() == 3, "unreachable server and rejected TURN credentials are pruned");
+  }
+  else if (ranking == "order")
+  {
+    expect(rankedServers.size() == servers.size(), "no server is pruned");
+    expect(rankedServers.back().urls.front() == "stun:127.0.0.1:34799", "unreachable server is ranked last");
+  }
+  std::cout << (result == 0 ? "all checks passed" : "some checks failed") << std::endl;
+
+  rtc::CleanupSSL();
+  return result;
+}
@@ -52,6 +52,7 @@ TestClient::TestClient(std::string const& login):
   _iceAdapterConnection.setRpcCallback("onConnectionStateChanged", std::bind(sendIceEventToClient, "OnConnectionStateChanged", _1, _2, _3, _4));
   _iceAdapterConnection.setRpcCallback("onGpgNetMessageReceived", std::bind(sendIceEventToClient, "OnGpgNetMessageReceived", _1, _2, _3, _4));
   _iceAdapterConnection.setRpcCallback("onIceMsg", std::bind(sendIceEventToClient, "OnIceMsg", _1, _2, _3, _4));
+  _iceAdapterConnection.setRpcCallback("onIceMsgBatch", std::bind(sendIceEventToClient, "OnIceMsgBatch", _1, _2, _3, _4));
   _iceAdapterConnection.setRpcCallback("onIceConnectionStateChanged", std::bind(sendIceEventToClient, "OnIceConnectionStateChanged", _1, _2, _3, _4));
   _iceAdapterConnection.setRpcCallback("onConnected", std::bind(sendIceEventToClient, "OnConnected", _1, _2, _3, _4));
 
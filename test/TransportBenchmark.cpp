@@ -0,0 +1,345 @@
+/* Compares latency and wire overhead of the PeerRelay transports "sctp" and "rtp".
+ * Two PeerRelays are connected in this process. A simulated game behind the offering
+ * relay sends timestamped packets, the game behind the answering relay echoes them.
+ *
+ * usage: transportbenchmark [packets (=1000)] [packet size (=200)] [interval ms (=10)]
+ */
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <chrono>
+#include <cstring>
+
+#include <webrtc/api/peerconnectioninterface.h>
+#include <webrtc/api/stats/rtcstats_objects.h>
+#include <webrtc/pc/test/fakeaudiocapturemodule.h>
+#include <webrtc/rtc_base/asyncinvoker.h>
+#include <webrtc/rtc_base/ssladapter.h>
+#include <webrtc/rtc_base/thread.h>
+
+#include "IceAdapterOptions.h"
+#include "PeerRelay.h"
+#include "Timer.h"
+#include "logging.h"
+
+static rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> pcfactory;
+
+/* gives access to the PeerConnection for transport stats */
+class BenchmarkRelay : public faf::PeerRelay
+{
+public:
+  using faf::PeerRelay::PeerRelay;
+
+  rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection() const
+  {
+    return _peerConnection;
+  }
+};
+
+/* sums up the bytes sent and received on all ICE connections of a PeerConnection */
+class TransportBytesCallback : public webrtc::RTCStatsCollectorCallback
+{
+public:
+  explicit TransportBytesCallback(std::function<void (uint64_t)> cb) : _cb(cb) {}
+
+  virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override
+  {
+    uint64_t result = 0;
+    for (auto transport: report->GetStatsOfType<webrtc::RTCTransportStats>())
+    {
+      if (transport->bytes_sent.is_defined())
+      {
+        result += *transport->bytes_sent;
+      }
+      if (transport->bytes_received.is_defined())
+      {
+        result += *transport->bytes_received;
+      }
+    }
+    _cb(result);
+  }
+private:
+  std::function<void (uint64_t)> _cb;
+};
+
+static void collectTransportBytes(BenchmarkRelay* relay, std::function<void (uint64_t)> cb)
+{
+  rtc::scoped_refptr<TransportBytesCallback> callback(new rtc::RefCountedObject<TransportBytesCallback>(cb));
+  relay->peerConnection()->GetStats(callback.get());
+}
+
+static int64_t nowUs()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* the game side of a PeerRelay */
+class BenchmarkGame : public sigslot::has_slots<>
+{
+public:
+  explicit BenchmarkGame(bool echo):
+    _echo(echo),
+    _received(0)
+  {
+    _socket.reset(rtc::Thread::Current()->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+    _socket->SignalReadEvent.connect(this, &BenchmarkGame::_onData);
+    if (_socket->Bind(rtc::SocketAddress("127.0.0.1", 0)) != 0)
+    {
+      std::cerr << "unable to bind game socket" << std::endl;
+      std::exit(1);
+    }
+  }
+
+  int port() const
+  {
+    return _socket->GetLocalAddress().port();
+  }
+
+  void setRelayPort(int port)
+  {
+    _relayAddress = rtc::SocketAddress("127.0.0.1", port);
+  }
+
+  void send(uint32_t seq, std::size_t size)
+  {
+    std::vector<uint8_t> packet(std::max(size, sizeof(uint32_t) + sizeof(int64_t)), 0);
+    auto sentUs = nowUs();
+    std::memcpy(packet.data(), &seq, sizeof(seq));
+    std::memcpy(packet.data() + sizeof(seq), &sentUs, sizeof(sentUs));
+    _socket->SendTo(packet.data(), packet.size(), _relayAddress);
+  }
+
+  std::size_t received() const
+  {
+    return _received;
+  }
+
+  /* round trip times in µs of packets with seq > 0 */
+  std::vector<int64_t>& rtts()
+  {
+    return _rtts;
+  }
+
+protected:
+  void _onData(rtc::AsyncSocket* socket)
+  {
+    int msgLength;
+    while ((msgLength = socket->Recv(_buffer.data(), _buffer.size(), nullptr)) > 0)
+    {
+      ++_received;
+      if (_echo)
+      {
+        _socket->SendTo(_buffer.data(), static_cast<std::size_t>(msgLength), _relayAddress);
+        continue;
+      }
+      uint32_t seq;
+      int64_t sentUs;
+      std::memcpy(&seq, _buffer.data(), sizeof(seq));
+      std::memcpy(&sentUs, _buffer.data() + sizeof(seq), sizeof(sentUs));
+      if (seq > 0)
+      {
+        _rtts.push_back(nowUs() - sentUs);
+      }
+    }
+  }
+
+  bool _echo;
+  std::size_t _received;
+  std::vector<int64_t> _rtts;
+  std::array<uint8_t, 2048> _buffer;
+  std::unique_ptr<rtc::AsyncSocket> _socket;
+  rtc::SocketAddress _relayAddress;
+};
+
+struct BenchmarkResult
+{
+  bool completed = false;
+  std::string transport;
+  std::size_t sent = 0;
+  std::vector<int64_t> rtts;
+  uint64_t wireBytesBefore = 0;
+  uint64_t wireBytesAfter = 0;
+};
+
+static BenchmarkResult runBenchmark(std::string const& transport,
+                                    std::size_t packets,
+                                    std::size_t packetSize,
+                                    int intervalMs)
+{
+  BenchmarkResult result;
+  auto options = faf::IceAdapterOptions::init(1, "pinger");
+  options.transport = transport;
+
+  BenchmarkGame pinger(false);
+  BenchmarkGame echoer(true);
+  auto offerer = std::make_unique<BenchmarkRelay>(2, "echoer", true, pinger.port(), pcfactory, rtc::Thread::Current(), options);
+  auto answerer = std::make_unique<BenchmarkRelay>(1, "pinger", false, echoer.port(), pcfactory, rtc::Thread::Current(), options);
+  pinger.setRelayPort(offerer->localUdpSocketPort());
+  echoer.setRelayPort(answerer->localUdpSocketPort());
+
+  /* like the client, deliver ICE messages outside of the callback */
+  rtc::AsyncInvoker invoker;
+  offerer->setIceMessageCallback([&](Json::Value const& iceMsg)
+  {
+    invoker.AsyncInvoke<void>(RTC_FROM_HERE, rtc::Thread::Current(), [&answerer, iceMsg]
+    {
+      answerer->addIceMessage(iceMsg);
+    });
+  });
+  answerer->setIceMessageCallback([&](Json::Value const& iceMsg)
+  {
+    invoker.AsyncInvoke<void>(RTC_FROM_HERE, rtc::Thread::Current(), [&offerer, iceMsg]
+    {
+      offerer->addIceMessage(iceMsg);
+    });
+  });
+
+  faf::Timer warmupTimer;
+  faf::Timer sendTimer;
+  faf::Timer drainTimer;
+  faf::Timer timeoutTimer;
+
+  auto finish = [&]
+  {
+    warmupTimer.stop();
+    sendTimer.stop();
+    drainTimer.stop();
+    timeoutTimer.stop();
+    rtc::Thread::Current()->Quit();
+  };
+
+  /* probe with seq 0 until an echo returns over the requested transport */
+  warmupTimer.start(100, [&]
+  {
+    if (offerer->status()["transport"]["current"].asString() != transport ||
+        answerer->status()["transport"]["current"].asString() != transport)
+    {
+      return;
+    }
+    if (pinger.received() == 0)
+    {
+      pinger.send(0, packetSize);
+      return;
+    }
+    warmupTimer.stop();
+    std::cout << transport << ": connected, sending " << packets << " packets" << std::endl;
+    collectTransportBytes(offerer.get(), [&](uint64_t bytes)
+    {
+      result.wireBytesBefore = bytes;
+      sendTimer.start(intervalMs, [&]
+      {
+        pinger.send(static_cast<uint32_t>(++result.sent), packetSize);
+        if (result.sent < packets)
+        {
+          return;
+        }
+        sendTimer.stop();
+        drainTimer.start(1000, [&]
+        {
+          drainTimer.stop();
+          collectTransportBytes(offerer.get(), [&](uint64_t bytes)
+          {
+            result.wireBytesAfter = bytes;
+            result.completed = true;
+            finish();
+          });
+        });
+      });
+    });
+  });
+  timeoutTimer.start(static_cast<int>(30000 + packets * intervalMs), [&]
+  {
+    std::cerr << transport << ": benchmark timed out" << std::endl;
+    finish();
+  });
+
+  answerer->reinit();
+  offerer->reinit();
+  rtc::Thread::Current()->Run();
+
+  result.transport = transport;
+  result.rtts = pinger.rtts();
+  return result;
+}
+
+static void printResult(BenchmarkResult& result, std::size_t packetSize)
+{
+  std::cout << result.transport << ":";
+  if (!result.completed)
+  {
+    std::cout << " failed" << std::endl;
+    return;
+  }
+  auto& rtts = result.rtts;
+  std::sort(rtts.begin(), rtts.end());
+  auto percentile = [&](double p)
+  {
+    return rtts.empty() ? 0. : rtts[std::min(rtts.size() - 1, static_cast<std::size_t>(p * rtts.size()))] / 1000.;
+  };
+  auto mean = rtts.empty() ? 0. : std::accumulate(rtts.begin(), rtts.end(), 0.) / rtts.size() / 1000.;
+  /* every packet that came back crossed the wire twice, lost ones at least once */
+  auto wirePackets = result.sent + rtts.size();
+  auto wireBytes = result.wireBytesAfter - result.wireBytesBefore;
+  auto payloadBytes = wirePackets * packetSize;
+  std::cout << std::fixed << std::setprecision(3)
+            << " sent " << result.sent
+            << " received " << rtts.size()
+            << " loss " << (result.sent > 0 ? 100. * (result.sent - rtts.size()) / result.sent : 0.) << "%"
+            << " rtt_ms mean " << mean
+            << " p50 " << percentile(0.5)
+            << " p95 " << percentile(0.95)
+            << " p99 " << percentile(0.99)
+            << " max " << (rtts.empty() ? 0. : rtts.back() / 1000.)
+            << " wire_bytes " << wireBytes
+            << " overhead_bytes_per_packet " << (wirePackets > 0 ? (static_cast<double>(wireBytes) - payloadBytes) / wirePackets : 0.)
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  std::size_t packets = argc > 1 ? std::stoul(argv[1]) : 1000;
+  std::size_t packetSize = argc > 2 ? std::stoul(argv[2]) : 200;
+  int intervalMs = argc > 3 ? std::stoi(argv[3]) : 10;
+
+  faf::logging_init("warn");
+
+  if (!rtc::InitializeSSL())
+  {
+    std::cerr << "Error in InitializeSSL()";
+    std::exit(1);
+  }
+
+  pcfactory = webrtc::CreatePeerConnectionFactory(rtc::Thread::Current(),
+                                                  rtc::Thread::Current(),
+                                                  rtc::Thread::Current(),
+                                                  FakeAudioCaptureModule::Create(),
+                                                  nullptr,
+                                                  nullptr);
+  if (!pcfactory)
+  {
+    std::cerr << "Error in CreatePeerConnectionFactory()";
+    std::exit(1);
+  }
+
+  std::vector<BenchmarkResult> results;
+  for (auto transport: {"sctp", "rtp"})
+  {
+    rtc::Thread::Current()->Restart();
+    results.push_back(runBenchmark(transport, packets, packetSize, intervalMs));
+  }
+
+  std::cout << "packet size " << packetSize << " bytes, interval " << intervalMs << " ms" << std::endl;
+  for (auto& result: results)
+  {
+    printResult(result, packetSize);
+  }
+
+  pcfactory = nullptr;
+  rtc::CleanupSSL();
+  return 0;
+}